@@ -0,0 +1,464 @@
+#include "itkIFTWatershedFromMarkersImageFilter.h"
+#include "itkDisSimMorphologicalWatershedFromMarkersImageFilter.h"
+#include "itkDifPriority.h"
+#include <itkMorphologicalWatershedFromMarkersImageFilter.h>
+#include <itkTimeProbe.h>
+#include <itkMultiThreader.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include "ioutils.h"
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Timing of the watershed filters, written as JSON for tracking
+// regressions. Each engine is run on the given images and on synthetic
+// volumes from 64^3 up to the maximum size, in unsigned char, short
+// and float, with a few marker densities and plateau fractions. Each
+// result has the best and median wall time of the repeats, voxels/s
+// of the best, and the peak resident set size of the run.
+//
+// The IFT filter is timed with each of the queue strategies given
+// with -q, by default auto and a, and the "queue" field of its
+// results says which. It is null for the other filters.
+//
+// usage: benchmarkWS [-o out.json] [-s max size] [-r repeats] [-q queue,...] [image[,marker]]...
+//
+// Images are read as short. Without a marker image, markers are placed
+// at random. Missing images are skipped.
+
+// the IFT queue strategies to time
+static std::vector<itk::IFTQueueStrategy::Type> queues;
+
+typedef unsigned char LabPixType;
+
+static unsigned long state = 1;
+static unsigned long nextRandom()
+{
+  state = state * 1103515245 + 12345;
+  return (state / 65536) % 32768;
+}
+
+// a random number up to 2^30, for positions in large images
+static unsigned long nextLargeRandom()
+{
+  return nextRandom() * 32768 + nextRandom();
+}
+
+////////////////////////////////////////////////////////
+// resident set size, in bytes, from /proc where there is one
+
+// Start a new peak. Linux only, elsewhere the peak is that of the
+// whole process so far.
+static void resetPeakRSS()
+{
+  std::ofstream clear("/proc/self/clear_refs");
+  if (clear)
+    clear << "5" << std::flush;
+}
+
+static double procStatus(const char *field)
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  const size_t len = strlen(field);
+  while (std::getline(status, line))
+    {
+    if (line.compare(0, len, field) == 0)
+      return atof(line.c_str() + len) * 1024;
+    }
+  return -1;
+}
+
+static double currentRSS()
+{
+  return std::max(procStatus("VmRSS:"), 0.0);
+}
+
+static double peakRSS()
+{
+  double peak = procStatus("VmHWM:");
+  if (peak >= 0)
+    return peak;
+#if !defined(_WIN32)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024.0;
+#endif
+#else
+  return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////
+// what is being timed, for the JSON record
+typedef struct CaseType
+{
+  std::string Image, Pixel;
+  std::vector<unsigned long> Size;
+  unsigned long Markers;
+  double Density, Plateau;
+} CaseType;
+
+class BenchmarkType
+{
+public:
+  BenchmarkType(std::ostream &out, int repeats) : Out(out), Repeats(repeats), First(true)
+  {
+    Out << "{\n  \"queues\": [";
+    for (size_t q = 0; q < queues.size(); q++)
+      Out << (q ? ", " : "") << "\"" << itk::IFTQueueStrategy::GetName(queues[q]) << "\"";
+    Out << "],\n"
+	<< "  \"threads\": " << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << ",\n"
+	<< "  \"repeats\": " << Repeats << ",\n"
+	<< "  \"results\": [";
+  }
+
+  ~BenchmarkType()
+  {
+    Out << "\n  ]\n}" << std::endl;
+  }
+
+  // Repeats updates of new filters of type TFilter on input and
+  // marker, set up by setup
+  template <class TFilter, class TSetup>
+  void Time(const char *engine, bool lines, const CaseType &c,
+	    typename TFilter::InputImageType *input,
+	    typename TFilter::OutputImageType *marker, const TSetup &setup)
+  {
+    std::vector<double> times;
+    double peak = 0, base = 0;
+    for (int r = 0; r < Repeats; r++)
+      {
+      typename TFilter::Pointer filter = TFilter::New();
+      filter->SetInput(input);
+      filter->SetMarkerImage(marker);
+      filter->SetMarkWatershedLine(lines);
+      setup(filter.GetPointer());
+
+      resetPeakRSS();
+      base = currentRSS();
+      itk::TimeProbe timer;
+      timer.Start();
+      filter->Update();
+      timer.Stop();
+      peak = std::max(peak, peakRSS());
+      times.push_back(timer.GetTotal());
+      }
+    std::sort(times.begin(), times.end());
+
+    double voxels = 1;
+    for (size_t i = 0; i < c.Size.size(); i++)
+      voxels *= c.Size[i];
+    const double best = times[0];
+
+    std::ostringstream size;
+    for (size_t i = 0; i < c.Size.size(); i++)
+      size << (i ? ", " : "") << c.Size[i];
+    Out << (First ? "\n" : ",\n")
+	<< "    {\"engine\": \"" << engine << "\", \"queue\": " << setup.Queue()
+	<< ", \"lines\": " << (lines ? "true" : "false")
+	<< ", \"image\": \"" << jsonString(c.Image) << "\", \"pixel\": \"" << c.Pixel
+	<< "\", \"size\": [" << size.str() << "], \"voxels\": " << voxels
+	<< ", \"markers\": " << c.Markers << ", \"marker_density\": " << c.Density
+	<< ", \"plateau_fraction\": " << c.Plateau
+	<< ", \"wall_seconds\": " << best << ", \"median_wall_seconds\": " << times[times.size() / 2]
+	<< ", \"voxels_per_second\": " << (best > 0 ? voxels / best : 0)
+	<< ", \"peak_rss_bytes\": " << peak << ", \"base_rss_bytes\": " << base << "}" << std::flush;
+    First = false;
+  }
+
+private:
+  static std::string jsonString(const std::string &s)
+  {
+    std::string r;
+    for (size_t i = 0; i < s.size(); i++)
+      {
+      if (s[i] == '"' || s[i] == '\\')
+	r += '\\';
+      r += s[i];
+      }
+    return r;
+  }
+
+  std::ostream &Out;
+  int Repeats;
+  bool First;
+};
+
+// setting up filters without an IFT queue
+class NoSetup
+{
+public:
+  template <class TFilter>
+  void operator()(TFilter *) const {}
+  std::string Queue() const { return "null"; }
+};
+
+class QueueSetup
+{
+public:
+  QueueSetup(itk::IFTQueueStrategy::Type strategy) : Strategy(strategy) {}
+  template <class TFilter>
+  void operator()(TFilter *filter) const { filter->SetQueueStrategy(Strategy); }
+  std::string Queue() const { return std::string("\"") + itk::IFTQueueStrategy::GetName(Strategy) + "\""; }
+  itk::IFTQueueStrategy::Type Strategy;
+};
+
+////////////////////////////////////////////////////////
+// all the engines on one case
+template <class RawImType, class LabImType>
+void timeEngines(BenchmarkType &bench, const CaseType &c, RawImType *input, LabImType *marker)
+{
+  typedef typename RawImType::PixelType PixType;
+  typedef itk::IFTWatershedFromMarkersImageFilter<RawImType, LabImType> IFTType;
+
+  for (size_t q = 0; q < queues.size(); q++)
+    bench.Time<IFTType>("IFTWatershedFromMarkers", true, c, input, marker, QueueSetup(queues[q]));
+  typedef itk::DisSimMorphologicalWatershedFromMarkersImageFilter<RawImType, LabImType,
+    itk::Functor::DifPriority<PixType, typename itk::NumericTraits<PixType>::FloatType> > DisSimType;
+  typedef itk::MorphologicalWatershedFromMarkersImageFilter<RawImType, LabImType> MorphType;
+
+  bench.Time<DisSimType>("DisSimMorphologicalWatershedFromMarkers", true, c, input, marker, NoSetup());
+  bench.Time<DisSimType>("DisSimMorphologicalWatershedFromMarkers", false, c, input, marker, NoSetup());
+  bench.Time<MorphType>("MorphologicalWatershedFromMarkers", true, c, input, marker, NoSetup());
+}
+
+// single pixel markers at random, at least two
+template <class LabImType>
+typename LabImType::Pointer randomMarkers(const typename LabImType::RegionType &region,
+					  double density, unsigned long *count)
+{
+  typename LabImType::Pointer marker = LabImType::New();
+  marker->SetRegions(region);
+  marker->Allocate();
+  marker->FillBuffer(0);
+  const unsigned long pixels = region.GetNumberOfPixels();
+  *count = std::max<unsigned long>(2, static_cast<unsigned long>(pixels * density));
+  LabPixType *buf = marker->GetBufferPointer();
+  for (unsigned long m = 0; m < *count; m++)
+    {
+    buf[nextLargeRandom() % pixels] = 1 + m % 255;
+    }
+  return marker;
+}
+
+template <class PixType> const char *pixelName();
+template <> const char *pixelName<unsigned char>() { return "unsigned char"; }
+template <> const char *pixelName<short>() { return "short"; }
+template <> const char *pixelName<float>() { return "float"; }
+
+// smooth blobs plus noise, as in scaleIFT. The lowest plateau
+// fraction of the blobs is flattened to a single value.
+static double blobs(unsigned x, unsigned y, unsigned z)
+{
+  return std::sin(x * 0.11) + std::sin(y * 0.07) + std::sin(z * 0.05 + x * 0.03);
+}
+
+template <class PixType>
+void timeSynthetic(BenchmarkType &bench, unsigned size, double plateau,
+		   const std::vector<double> &densities)
+{
+  typedef itk::Image<PixType, 3> RawImType;
+  typedef itk::Image<LabPixType, 3> LabImType;
+
+  typename RawImType::RegionType region;
+  typename RawImType::SizeType sz;
+  sz.Fill(size);
+  region.SetSize(sz);
+
+  // the level below which the blobs are flat, from a sample
+  std::vector<double> sample(100000);
+  for (size_t i = 0; i < sample.size(); i++)
+    sample[i] = blobs(nextRandom() % size, nextRandom() % size, nextRandom() % size);
+  const size_t rank = static_cast<size_t>(plateau * (sample.size() - 1));
+  std::nth_element(sample.begin(), sample.begin() + rank, sample.end());
+  const double flat = plateau > 0 ? sample[rank] : -std::numeric_limits<double>::max();
+
+  // 0 to 250 for the integer types, to fit unsigned char
+  const bool integer = std::numeric_limits<PixType>::is_integer;
+  const double scale = integer ? 40 : 1;
+  const double noise = integer ? 1 : 0.01;
+
+  typename RawImType::Pointer input = RawImType::New();
+  input->SetRegions(region);
+  input->Allocate();
+  PixType *raw = input->GetBufferPointer();
+  unsigned long p = 0;
+  for (unsigned z = 0; z < size; z++)
+    {
+    for (unsigned y = 0; y < size; y++)
+      {
+      for (unsigned x = 0; x < size; x++, p++)
+	{
+	const double v = std::max(blobs(x, y, z), flat);
+	raw[p] = static_cast<PixType>(scale * (v + 3) + (v > flat ? noise * (nextRandom() % 8) : 0));
+	}
+      }
+    }
+
+  for (size_t d = 0; d < densities.size(); d++)
+    {
+    CaseType c;
+    c.Image = "synthetic";
+    c.Pixel = pixelName<PixType>();
+    c.Size.assign(3, size);
+    c.Density = densities[d];
+    c.Plateau = plateau;
+    typename LabImType::Pointer marker = randomMarkers<LabImType>(region, c.Density, &c.Markers);
+    timeEngines<RawImType, LabImType>(bench, c, input, marker);
+    }
+}
+
+template <int dim>
+void timeImage(BenchmarkType &bench, const std::string &image, const std::string &markerIm)
+{
+  typedef itk::Image<short, dim> RawImType;
+  typedef itk::Image<LabPixType, dim> LabImType;
+
+  typename RawImType::Pointer input = readIm<RawImType>(image);
+  if (!input)
+    return;
+  CaseType c;
+  c.Image = image;
+  c.Pixel = pixelName<short>();
+  c.Plateau = 0;
+  const typename RawImType::RegionType region = input->GetLargestPossibleRegion();
+  for (unsigned i = 0; i < dim; i++)
+    c.Size.push_back(region.GetSize()[i]);
+
+  typename LabImType::Pointer marker;
+  if (markerIm.empty())
+    {
+    c.Density = 1e-3;
+    marker = randomMarkers<LabImType>(region, c.Density, &c.Markers);
+    }
+  else
+    {
+    marker = readIm<LabImType>(markerIm);
+    if (!marker)
+      return;
+    c.Markers = 0;
+    const LabPixType *buf = marker->GetBufferPointer();
+    for (unsigned long i = 0; i < region.GetNumberOfPixels(); i++)
+      c.Markers += buf[i] != 0;
+    c.Density = double(c.Markers) / region.GetNumberOfPixels();
+    }
+  timeEngines<RawImType, LabImType>(bench, c, input, marker);
+}
+
+int main(int argc, char * argv[])
+{
+  std::string outName;
+  unsigned maxSize = 1024;
+  int repeats = 3;
+  std::vector<std::string> images;
+  for (int i = 1; i < argc; i++)
+    {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      outName = argv[++i];
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+      maxSize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      repeats = std::max(atoi(argv[++i]), 1);
+    else if (!strcmp(argv[i], "-q") && i + 1 < argc)
+      {
+      std::istringstream names(argv[++i]);
+      std::string name;
+      while (std::getline(names, name, ','))
+	{
+	itk::IFTQueueStrategy::Type strategy;
+	if (!itk::IFTQueueStrategy::FromName(name, strategy))
+	  {
+	  std::cerr << "Unknown queue " << name << std::endl;
+	  return(EXIT_FAILURE);
+	  }
+	queues.push_back(strategy);
+	}
+      }
+    else if (argv[i][0] == '-')
+      {
+      std::cerr << "usage: " << argv[0] << " [-o out.json] [-s max size] [-r repeats] [-q queue,...] [image[,marker]]..." << std::endl;
+      return(EXIT_FAILURE);
+      }
+    else
+      images.push_back(argv[i]);
+    }
+  if (queues.empty())
+    {
+    queues.push_back(itk::IFTQueueStrategy::Auto);
+    queues.push_back(itk::IFTQueueStrategy::QueueA);
+    }
+
+  std::ofstream outFile;
+  if (!outName.empty())
+    {
+    outFile.open(outName.c_str());
+    if (!outFile)
+      {
+      std::cerr << "Failed to open " << outName << std::endl;
+      return(EXIT_FAILURE);
+      }
+    }
+  BenchmarkType bench(outName.empty() ? std::cout : outFile, repeats);
+
+  for (size_t i = 0; i < images.size(); i++)
+    {
+    const size_t comma = images[i].find(',');
+    const std::string image = images[i].substr(0, comma);
+    const std::string markerIm = comma == std::string::npos ? "" : images[i].substr(comma + 1);
+    itk::ImageIOBase::IOComponentType componentType;
+    int dim = 0;
+    if (!readImageInfo(image, &componentType, &dim))
+      {
+      std::cerr << "Skipping " << image << ", can't read it" << std::endl;
+      continue;
+      }
+    if (dim == 2)
+      timeImage<2>(bench, image, markerIm);
+    else if (dim == 3)
+      timeImage<3>(bench, image, markerIm);
+    else
+      std::cerr << "Skipping " << image << ", unsupported dimension" << std::endl;
+    }
+
+  std::vector<double> densities;
+  densities.push_back(1e-5);
+  densities.push_back(1e-3);
+  std::vector<double> plateaus;
+  plateaus.push_back(0);
+  plateaus.push_back(0.5);
+  // input, marker and output, the cost and flags and the queue of the
+  // IFT filter, for a float input
+  const double bytesPerVoxel = sizeof(float) + 2 * sizeof(LabPixType) + sizeof(double) + 1 + 16;
+  const double memory = physicalMemory();
+  for (unsigned size = 64; size <= maxSize; size *= 2)
+    {
+    const double voxels = double(size) * size * size;
+    if (memory > 0 && voxels * bytesPerVoxel > 0.8 * memory)
+      {
+      std::cerr << "Skipping " << size << "^3, too large for memory" << std::endl;
+      break;
+      }
+    for (size_t p = 0; p < plateaus.size(); p++)
+      {
+      timeSynthetic<unsigned char>(bench, size, plateaus[p], densities);
+      timeSynthetic<short>(bench, size, plateaus[p], densities);
+      timeSynthetic<float>(bench, size, plateaus[p], densities);
+      }
+    }
+
+  return(EXIT_SUCCESS);
+}
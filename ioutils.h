@@ -8,20 +8,626 @@
 #include <itkNumericTraits.h>
 #include <itkOrientImageFilter.h>
 #include <itkSpatialOrientation.h>
+#include <itkSimpleFastMutexLock.h>
+#include "itkMemoryMappedImageContainer.h"
+#include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cctype>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+// What is known about an image file from its header. Uncompressed
+// NRRD and MetaImage files, with the data attached or in a separate
+// raw file, are parsed here, and if nothing stops it readIm maps their
+// data rather than reading it. Other files keep the ImageIO that read
+// their header, for the reader to use.
+typedef struct ImageFileHeader
+{
+  itk::ImageIOBase::Pointer IO;
+  itk::ImageIOBase::IOComponentType ComponentType;
+  int Dimension;
+  std::vector<itk::SizeValueType> Size;
+  // the rest is only set for files that can be mapped
+  bool Mappable;
+  std::string DataFile;
+  size_t DataOffset;
+  bool BigEndian;
+  std::vector<double> Spacing, Origin;
+  // the unit vector of each axis
+  std::vector<std::vector<double> > Direction;
+} ImageFileHeader;
+
+std::string headerTrim(const std::string &s)
+{
+  std::string::size_type b = s.find_first_not_of(" \t\r\n");
+  if (b == std::string::npos)
+    return "";
+  std::string::size_type e = s.find_last_not_of(" \t\r\n");
+  return s.substr(b, e - b + 1);
+}
+
+std::string headerLower(std::string s)
+{
+  for (size_t i = 0; i < s.size(); i++)
+    s[i] = std::tolower(s[i]);
+  return s;
+}
+
+// a data file named in a header is relative to the header's directory
+std::string headerDataPath(const std::string &header, const std::string &data)
+{
+  if (data.empty() || data[0] == '/')
+    return data;
+  std::string::size_type slash = header.rfind('/');
+  if (slash == std::string::npos)
+    return data;
+  return header.substr(0, slash + 1) + data;
+}
+
+size_t headerFileSize(const std::string &filename)
+{
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  f.seekg(0, std::ios::end);
+  return f ? static_cast<size_t>(f.tellg()) : 0;
+}
+
+bool hostBigEndian()
+{
+  const unsigned short one = 1;
+  return *reinterpret_cast<const unsigned char *>(&one) == 0;
+}
+
+int componentSize(itk::ImageIOBase::IOComponentType t)
+{
+  switch (t)
+    {
+    case itk::ImageIOBase::UCHAR:
+    case itk::ImageIOBase::CHAR:
+      return 1;
+    case itk::ImageIOBase::USHORT:
+    case itk::ImageIOBase::SHORT:
+      return 2;
+    case itk::ImageIOBase::UINT:
+    case itk::ImageIOBase::INT:
+    case itk::ImageIOBase::FLOAT:
+      return 4;
+    case itk::ImageIOBase::DOUBLE:
+      return 8;
+    default:
+      return 0;
+    }
+}
+
+// bytes of physical memory, or 0 where it can't be found
+double physicalMemory()
+{
+#if !defined(_WIN32)
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page > 0)
+    return double(pages) * page;
+#endif
+  return 0;
+}
+
+// the component type of a pixel type, for the types that are mapped
+template <class PixType>
+itk::ImageIOBase::IOComponentType componentType()
+{
+  return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+}
+template <> itk::ImageIOBase::IOComponentType componentType<unsigned char>() { return itk::ImageIOBase::UCHAR; }
+template <> itk::ImageIOBase::IOComponentType componentType<char>() { return itk::ImageIOBase::CHAR; }
+template <> itk::ImageIOBase::IOComponentType componentType<signed char>() { return itk::ImageIOBase::CHAR; }
+template <> itk::ImageIOBase::IOComponentType componentType<unsigned short>() { return itk::ImageIOBase::USHORT; }
+template <> itk::ImageIOBase::IOComponentType componentType<short>() { return itk::ImageIOBase::SHORT; }
+template <> itk::ImageIOBase::IOComponentType componentType<unsigned int>() { return itk::ImageIOBase::UINT; }
+template <> itk::ImageIOBase::IOComponentType componentType<int>() { return itk::ImageIOBase::INT; }
+template <> itk::ImageIOBase::IOComponentType componentType<float>() { return itk::ImageIOBase::FLOAT; }
+template <> itk::ImageIOBase::IOComponentType componentType<double>() { return itk::ImageIOBase::DOUBLE; }
+
+// numbers, ignoring brackets and commas, so "(1,0,0)" is three
+std::vector<double> headerNumbers(std::string s)
+{
+  for (size_t i = 0; i < s.size(); i++)
+    if (s[i] == '(' || s[i] == ')' || s[i] == ',')
+      s[i] = ' ';
+  std::istringstream in(s);
+  std::vector<double> v;
+  double x;
+  while (in >> x)
+    v.push_back(x);
+  return v;
+}
+
+itk::ImageIOBase::IOComponentType nrrdType(const std::string &t)
+{
+  if (t == "uchar" || t == "unsigned char" || t == "uint8" || t == "uint8_t")
+    return itk::ImageIOBase::UCHAR;
+  if (t == "signed char" || t == "int8" || t == "int8_t")
+    return itk::ImageIOBase::CHAR;
+  if (t == "short" || t == "short int" || t == "signed short" || t == "signed short int"
+      || t == "int16" || t == "int16_t")
+    return itk::ImageIOBase::SHORT;
+  if (t == "ushort" || t == "unsigned short" || t == "unsigned short int"
+      || t == "uint16" || t == "uint16_t")
+    return itk::ImageIOBase::USHORT;
+  if (t == "int" || t == "signed int" || t == "int32" || t == "int32_t")
+    return itk::ImageIOBase::INT;
+  if (t == "uint" || t == "unsigned int" || t == "uint32" || t == "uint32_t")
+    return itk::ImageIOBase::UINT;
+  if (t == "float")
+    return itk::ImageIOBase::FLOAT;
+  if (t == "double")
+    return itk::ImageIOBase::DOUBLE;
+  return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+}
+
+// Parse a raw encoded NRRD header. Anything the mapping doesn't
+// handle - other encodings, non spatial axes, lists of data files,
+// line skips - returns false and the file is left to ITK.
+bool parseNrrdHeader(const std::string &filename, ImageFileHeader &h)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  std::string line;
+  if (!std::getline(in, line) || line.compare(0, 4, "NRRD") != 0)
+    return false;
+  std::string encoding = "raw", dataFile, space;
+  std::vector<std::string> directions;
+  std::vector<double> origin, spacings, mins;
+  long byteSkip = 0;
+  bool endianSet = false, attached = false;
+  h.Dimension = 0;
+  h.ComponentType = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  while (std::getline(in, line))
+    {
+    line = headerTrim(line);
+    if (line.empty())
+      {
+      attached = true;
+      break;
+      }
+    if (line[0] == '#' || line.find(":=") != std::string::npos)
+      continue;
+    std::string::size_type colon = line.find(": ");
+    if (colon == std::string::npos)
+      return false;
+    std::string key = headerLower(line.substr(0, colon));
+    std::string value = headerTrim(line.substr(colon + 2));
+    if (key == "type")
+      h.ComponentType = nrrdType(headerLower(value));
+    else if (key == "dimension")
+      h.Dimension = atoi(value.c_str());
+    else if (key == "sizes")
+      {
+      std::vector<double> v = headerNumbers(value);
+      h.Size.assign(v.begin(), v.end());
+      }
+    else if (key == "encoding")
+      encoding = headerLower(value);
+    else if (key == "endian")
+      {
+      h.BigEndian = headerLower(value) == "big";
+      endianSet = true;
+      }
+    else if (key == "data file" || key == "datafile")
+      dataFile = value;
+    else if (key == "byte skip" || key == "byteskip")
+      byteSkip = atol(value.c_str());
+    else if (key == "line skip" || key == "lineskip")
+      {
+      if (atol(value.c_str()) != 0)
+	return false;
+      }
+    else if (key == "space")
+      space = headerLower(value);
+    else if (key == "space origin")
+      origin = headerNumbers(value);
+    else if (key == "space directions")
+      {
+      std::istringstream dirs(value);
+      std::string d;
+      while (dirs >> d)
+	directions.push_back(d);
+      }
+    else if (key == "spacings")
+      spacings = headerNumbers(value);
+    else if (key == "axis mins" || key == "axismins")
+      mins = headerNumbers(value);
+    else if (key == "kinds")
+      {
+      std::istringstream kinds(value);
+      std::string k;
+      while (kinds >> k)
+	{
+	k = headerLower(k);
+	if (k != "domain" && k != "space" && k != "none" && k != "???")
+	  return false;
+	}
+      }
+    }
+  const int dim = h.Dimension;
+  if (encoding != "raw" || h.ComponentType == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE
+      || dim < 1 || static_cast<int>(h.Size.size()) != dim)
+    return false;
+  if (!endianSet)
+    {
+    if (componentSize(h.ComponentType) > 1)
+      return false;
+    h.BigEndian = hostBigEndian();
+    }
+  // ITK works in LPS, and only these spaces are turned into it
+  double flip[2] = {1, 1};
+  if (space == "right-anterior-superior" || space == "ras")
+    flip[0] = flip[1] = -1;
+  else if (space == "left-anterior-superior" || space == "las")
+    flip[1] = -1;
+  else if (!space.empty() && space != "left-posterior-superior" && space != "lps")
+    return false;
+
+  h.Spacing.assign(dim, 1.0);
+  h.Origin.assign(dim, 0.0);
+  h.Direction.assign(dim, std::vector<double>(dim, 0.0));
+  for (int i = 0; i < dim; i++)
+    h.Direction[i][i] = 1.0;
+  if (!directions.empty())
+    {
+    if (static_cast<int>(directions.size()) != dim)
+      return false;
+    for (int i = 0; i < dim; i++)
+      {
+      std::vector<double> v = headerNumbers(directions[i]);
+      if (static_cast<int>(v.size()) != dim)
+	return false;
+      double norm = 0;
+      for (int j = 0; j < dim; j++)
+	{
+	if (j < 2)
+	  v[j] *= flip[j];
+	norm += v[j] * v[j];
+	}
+      norm = std::sqrt(norm);
+      if (norm == 0)
+	return false;
+      h.Spacing[i] = norm;
+      for (int j = 0; j < dim; j++)
+	h.Direction[i][j] = v[j] / norm;
+      }
+    if (static_cast<int>(origin.size()) == dim)
+      for (int j = 0; j < dim; j++)
+	h.Origin[j] = j < 2 ? origin[j] * flip[j] : origin[j];
+    }
+  else
+    {
+    for (int i = 0; i < dim && i < static_cast<int>(spacings.size()); i++)
+      if (spacings[i] == spacings[i])
+	h.Spacing[i] = spacings[i];
+    for (int i = 0; i < dim && i < static_cast<int>(mins.size()); i++)
+      if (mins[i] == mins[i])
+	h.Origin[i] = mins[i];
+    }
+
+  size_t bytes = componentSize(h.ComponentType);
+  for (int i = 0; i < dim; i++)
+    bytes *= h.Size[i];
+  if (!dataFile.empty())
+    {
+    // a format or a list of files isn't one block of data
+    if (dataFile.find(' ') != std::string::npos || headerLower(dataFile) == "list")
+      return false;
+    h.DataFile = headerDataPath(filename, dataFile);
+    h.DataOffset = 0;
+    }
+  else
+    {
+    if (!attached)
+      return false;
+    h.DataFile = filename;
+    h.DataOffset = static_cast<size_t>(in.tellg());
+    }
+  const size_t fileSize = headerFileSize(h.DataFile);
+  if (byteSkip == -1)
+    {
+    if (fileSize < bytes)
+      return false;
+    h.DataOffset = fileSize - bytes;
+    }
+  else if (byteSkip < 0)
+    return false;
+  else
+    h.DataOffset += byteSkip;
+  return h.DataOffset + bytes <= fileSize;
+}
+
+itk::ImageIOBase::IOComponentType metaType(const std::string &t)
+{
+  if (t == "MET_UCHAR")
+    return itk::ImageIOBase::UCHAR;
+  if (t == "MET_CHAR")
+    return itk::ImageIOBase::CHAR;
+  if (t == "MET_SHORT")
+    return itk::ImageIOBase::SHORT;
+  if (t == "MET_USHORT")
+    return itk::ImageIOBase::USHORT;
+  if (t == "MET_INT")
+    return itk::ImageIOBase::INT;
+  if (t == "MET_UINT")
+    return itk::ImageIOBase::UINT;
+  if (t == "MET_FLOAT")
+    return itk::ImageIOBase::FLOAT;
+  if (t == "MET_DOUBLE")
+    return itk::ImageIOBase::DOUBLE;
+  return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+}
+
+// Parse a MetaImage (.mha/.mhd) header, with the same limits as
+// parseNrrdHeader: one channel, uncompressed, one data file.
+bool parseMetaHeader(const std::string &filename, ImageFileHeader &h)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  std::string line, dataFile;
+  std::vector<double> size, spacing, elementSize, origin, matrix;
+  long headerSize = 0;
+  bool compressed = false, binary = true;
+  h.Dimension = 0;
+  h.BigEndian = false;
+  h.ComponentType = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  while (dataFile.empty() && std::getline(in, line))
+    {
+    std::string::size_type eq = line.find('=');
+    if (eq == std::string::npos)
+      return false;
+    std::string key = headerTrim(line.substr(0, eq));
+    std::string value = headerTrim(line.substr(eq + 1));
+    std::string lower = headerLower(value);
+    if (key == "NDims")
+      h.Dimension = atoi(value.c_str());
+    else if (key == "DimSize")
+      size = headerNumbers(value);
+    else if (key == "ElementType")
+      h.ComponentType = metaType(value);
+    else if (key == "ElementSpacing")
+      spacing = headerNumbers(value);
+    else if (key == "ElementSize")
+      elementSize = headerNumbers(value);
+    else if (key == "Offset" || key == "Origin" || key == "Position")
+      origin = headerNumbers(value);
+    else if (key == "TransformMatrix" || key == "Rotation" || key == "Orientation")
+      matrix = headerNumbers(value);
+    else if (key == "ElementNumberOfChannels")
+      {
+      if (atoi(value.c_str()) != 1)
+	return false;
+      }
+    else if (key == "CompressedData")
+      compressed = lower == "true";
+    else if (key == "BinaryData")
+      binary = lower == "true";
+    else if (key == "BinaryDataByteOrderMSB" || key == "ElementByteOrderMSB")
+      h.BigEndian = lower == "true";
+    else if (key == "HeaderSize")
+      headerSize = atol(value.c_str());
+    else if (key == "ElementDataFile")
+      dataFile = value;
+    }
+  const int dim = h.Dimension;
+  if (dataFile.empty() || compressed || !binary || dim < 1
+      || h.ComponentType == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE
+      || static_cast<int>(size.size()) != dim)
+    return false;
+  h.Size.assign(size.begin(), size.end());
+  h.Spacing.assign(dim, 1.0);
+  h.Origin.assign(dim, 0.0);
+  h.Direction.assign(dim, std::vector<double>(dim, 0.0));
+  const std::vector<double> &sp = spacing.empty() ? elementSize : spacing;
+  for (int i = 0; i < dim; i++)
+    {
+    if (i < static_cast<int>(sp.size()))
+      h.Spacing[i] = sp[i];
+    if (i < static_cast<int>(origin.size()))
+      h.Origin[i] = origin[i];
+    for (int j = 0; j < dim; j++)
+      {
+      if (static_cast<int>(matrix.size()) == dim * dim)
+	h.Direction[i][j] = matrix[i * dim + j];
+      else
+	h.Direction[i][j] = i == j;
+      }
+    }
+
+  size_t bytes = componentSize(h.ComponentType);
+  for (int i = 0; i < dim; i++)
+    bytes *= h.Size[i];
+  if (dataFile == "LOCAL")
+    {
+    if (headerSize > 0)
+      return false;
+    h.DataFile = filename;
+    h.DataOffset = static_cast<size_t>(in.tellg());
+    }
+  else
+    {
+    if (dataFile.find(' ') != std::string::npos || dataFile == "LIST" || headerSize < -1)
+      return false;
+    h.DataFile = headerDataPath(filename, dataFile);
+    h.DataOffset = headerSize > 0 ? headerSize : 0;
+    }
+  const size_t fileSize = headerFileSize(h.DataFile);
+  if (headerSize == -1)
+    {
+    if (fileSize < bytes)
+      return false;
+    h.DataOffset = fileSize - bytes;
+    }
+  return h.DataOffset + bytes <= fileSize;
+}
+
+// the header of filename into h, false if nothing can read it. Kind,
+// if given, is an ImageIO to try before asking every IO factory.
+bool readImageHeader(const std::string &filename, ImageFileHeader &h,
+		     const itk::ImageIOBase *kind)
+{
+  std::string ext = headerLower(filename.substr(filename.rfind('.') + 1));
+  if (ext == "nrrd" || ext == "nhdr")
+    h.Mappable = parseNrrdHeader(filename, h);
+  else if (ext == "mha" || ext == "mhd")
+    h.Mappable = parseMetaHeader(filename, h);
+  else
+    h.Mappable = false;
+
+  if (!h.Mappable)
+    {
+    if (kind)
+      {
+      itk::LightObject::Pointer io = kind->CreateAnother();
+      h.IO = dynamic_cast<itk::ImageIOBase *>(io.GetPointer());
+      if (h.IO.IsNotNull() && !h.IO->CanReadFile(filename.c_str()))
+	h.IO = 0;
+      }
+    if (h.IO.IsNull())
+      h.IO = itk::ImageIOFactory::CreateImageIO(filename.c_str(), itk::ImageIOFactory::ReadMode);
+    if (h.IO.IsNull())
+      return false;
+    h.IO->SetFileName(filename.c_str());
+    h.IO->ReadImageInformation();
+    h.ComponentType = h.IO->GetComponentType();
+    h.Dimension = h.IO->GetNumberOfDimensions();
+    h.Size.resize(h.Dimension);
+    for (int i = 0; i < h.Dimension; i++)
+      h.Size[i] = h.IO->GetDimensions(i);
+    }
+  return true;
+}
+
+// The headers read so far, by file name, under ImageHeadersLock so
+// batch workers and the service can ask about files from any
+// thread. The cache is emptied when it reaches MaxImageHeaders
+// entries, so a service asked about new files for as long as it runs
+// doesn't keep them all.
+static std::map<std::string, ImageFileHeader> ImageHeaders;
+static itk::SimpleFastMutexLock ImageHeadersLock;
+const size_t MaxImageHeaders = 256;
+
+void keepImageHeader(const std::string &filename, const ImageFileHeader &h)
+{
+  ImageHeadersLock.Lock();
+  if (ImageHeaders.size() >= MaxImageHeaders && ImageHeaders.find(filename) == ImageHeaders.end())
+    ImageHeaders.clear();
+  ImageHeaders[filename] = h;
+  ImageHeadersLock.Unlock();
+}
+
+// The header of filename into header, read the first time a file is
+// asked about and kept, so that readImageInfo and the readIm calls
+// that follow don't each read it again. False if nothing can read the
+// file. The header is a copy, so it stays valid when the cache is
+// emptied.
+bool getImageHeader(const std::string &filename, ImageFileHeader &header)
+{
+  ImageHeadersLock.Lock();
+  std::map<std::string, ImageFileHeader>::const_iterator it = ImageHeaders.find(filename);
+  const bool kept = it != ImageHeaders.end();
+  if (kept)
+    header = it->second;
+  ImageHeadersLock.Unlock();
+  if (kept)
+    return true;
+
+  // read without the lock, as the IO may throw. Two threads reading
+  // the same header at once both keep the same thing.
+  ImageFileHeader h;
+  if (!readImageHeader(filename, h, 0))
+    return false;
+  keepImageHeader(filename, h);
+  header = h;
+  return true;
+}
+
+// As getImageHeader, but reads the header again if it was kept, for a
+// file that may have been rewritten since. An ImageIO of the kind
+// that read it before is tried first, so the IO factories aren't all
+// asked about it again.
+bool rereadImageHeader(const std::string &filename, ImageFileHeader &header)
+{
+  itk::ImageIOBase::Pointer kind;
+  ImageHeadersLock.Lock();
+  std::map<std::string, ImageFileHeader>::iterator it = ImageHeaders.find(filename);
+  const bool kept = it != ImageHeaders.end();
+  if (kept)
+    {
+    kind = it->second.IO;
+    ImageHeaders.erase(it);
+    }
+  ImageHeadersLock.Unlock();
+  if (!kept)
+    return getImageHeader(filename, header);
+
+  ImageFileHeader h;
+  if (!readImageHeader(filename, h, kind))
+    return false;
+  keepImageHeader(filename, h);
+  header = h;
+  return true;
+}
 
 int readImageInfo(std::string filename, itk::ImageIOBase::IOComponentType *ComponentType, int *dim)
 {
-  itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(filename.c_str(), itk::ImageIOFactory::ReadMode);
-  if (imageIO.IsNull())
+  ImageFileHeader header;
+  if (!getImageHeader(filename, header))
     return 0;
 
+  *ComponentType = header.ComponentType;
+  *dim = header.Dimension;
+  return(1);
+}
 
-  imageIO->SetFileName(filename.c_str());
-  imageIO->ReadImageInformation();
+// An image whose buffer is a private mapping of the file's data, so
+// nothing is read until it is used and writing to it leaves the file
+// alone. Null if the data doesn't fit TImage as it is: another pixel
+// type or dimension, the other byte order, or data not aligned for
+// the pixel type, as an attached header can leave it.
+template <class TImage>
+typename TImage::Pointer mapIm(const ImageFileHeader &h)
+{
+  typedef typename TImage::PixelType PixType;
+  const unsigned dim = TImage::ImageDimension;
+  if (!h.Mappable || componentType<PixType>() != h.ComponentType
+      || h.Dimension != static_cast<int>(dim)
+      || (sizeof(PixType) > 1 && h.BigEndian != hostBigEndian())
+      || h.DataOffset % sizeof(PixType) != 0)
+    return 0;
 
-  *ComponentType = imageIO->GetComponentType();
-  *dim = imageIO->GetNumberOfDimensions();
-  return(1);
+  typename TImage::RegionType region;
+  typename TImage::SpacingType spacing;
+  typename TImage::PointType origin;
+  typename TImage::DirectionType direction;
+  for (unsigned i = 0; i < dim; i++)
+    {
+    region.SetSize(i, h.Size[i]);
+    spacing[i] = h.Spacing[i];
+    origin[i] = h.Origin[i];
+    for (unsigned j = 0; j < dim; j++)
+      direction[j][i] = h.Direction[i][j];
+    }
+
+  typedef itk::MemoryMappedImageContainer<itk::SizeValueType, PixType> ContainerType;
+  typename ContainerType::Pointer container = ContainerType::New();
+  if (!container->MapFile(h.DataFile, h.DataOffset, region.GetNumberOfPixels()))
+    return 0;
+
+  typename TImage::Pointer result = TImage::New();
+  result->SetRegions(region);
+  result->SetSpacing(spacing);
+  result->SetOrigin(origin);
+  result->SetDirection(direction);
+  result->SetPixelContainer(container);
+  return(result);
 }
 
 
@@ -66,12 +672,29 @@ void writeImScale(typename TImage::Pointer Im, std::string filename)
   writer->Update();
 }
 
+// Uncompressed NRRD and MetaImage files of the right type are mapped,
+// see mapIm, anything else is read and converted by ImageFileReader.
 template <class TImage>
 typename TImage::Pointer readIm(std::string filename)
 {
+  ImageFileHeader header;
+  const bool known = getImageHeader(filename, header);
+  if (known && header.Mappable)
+    {
+    typename TImage::Pointer mapped = mapIm<TImage>(header);
+    if (mapped)
+      return(mapped);
+    }
   typedef typename itk::ImageFileReader<TImage> ReaderType;
   typename ReaderType::Pointer reader = ReaderType::New();
   reader->SetFileName(filename.c_str());
+  if (known && header.IO)
+    {
+    // a new IO of the same kind, so that reads of a file, maybe from
+    // different threads, don't share one
+    itk::LightObject::Pointer io = header.IO->CreateAnother();
+    reader->SetImageIO(dynamic_cast<itk::ImageIOBase *>(io.GetPointer()));
+    }
   typename TImage::Pointer result = reader->GetOutput();
   try
     {
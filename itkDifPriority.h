@@ -0,0 +1,51 @@
+#ifndef __itkDifPriority_h
+#define __itkDifPriority_h
+
+#include "itkPriorityFunctorBatch.h"
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+namespace Functor
+{
+/** \class DifPriority
+ * \brief Dissimilarity priority, the absolute difference between a
+ * pixel and its neighbour.
+ *
+ * The functor markerWS gives the dissimilarity watershed, and the one
+ * benchmarkWS times it with.
+ */
+template< class TInput1, class TOutput = TInput1 >
+class DifPriority
+{
+public:
+  DifPriority() {}
+  ~DifPriority() {}
+  bool operator!=(const DifPriority &) const
+  {
+    return false;
+  }
+
+  bool operator==(const DifPriority & other) const
+  {
+    return !( *this != other );
+  }
+
+  // A is the centre pixel, B the neighbour
+  inline TOutput operator()(const TInput1 & A, const TInput1 & B) const
+  {
+    return static_cast< TOutput > (vcl_abs( B - A ));
+  }
+};
+} // end namespace Functor
+
+// cheap enough to evaluate for every neighbour at once
+template< class TInput1, class TOutput >
+class PriorityFunctorBatchTraits< Functor::DifPriority< TInput1, TOutput > >
+{
+public:
+  itkStaticConstMacro(Vectorizable, bool, true);
+};
+} // end namespace itk
+
+#endif
@@ -0,0 +1,176 @@
+
+#ifndef __itkDifferentialIFTWatershedFromMarkersImageFilter_h
+#define __itkDifferentialIFTWatershedFromMarkersImageFilter_h
+
+#include "itkIFTWatershedFromMarkersImageFilter.h"
+#include <vector>
+#include <utility>
+
+namespace itk
+{
+/** \class DifferentialIFTWatershedFromMarkersImageFilter
+ * \brief IFT watershed from markers that can be updated after
+ * adding or removing single markers, without redoing the whole image.
+ *
+ * The first update floods the whole image from the marker image,
+ * exactly as IFTWatershedFromMarkersBaseImageFilter does. The filter
+ * then keeps the forest it has built: the cost, the label and the
+ * predecessor of every pixel. Markers added with AddMarker and removed
+ * with RemoveMarker are applied at the next update by the
+ * differential IFT. The trees of removed markers are cleared and
+ * flooded again from the pixels around them, new markers flood
+ * outwards from themselves, and a pixel whose predecessor changes
+ * passes the change on to its own tree. Only the pixels whose cost
+ * or label may change are visited, so an edit costs time in
+ * proportion to the region it changes rather than to the image.
+ *
+ * The costs after an edit, and the pixels some marker reaches, are
+ * the same as those of a fresh run with the edited markers, which
+ * testDIFT checks. The labels are not. Where two markers reach a pixel
+ * at the same cost the label depends on the order pixels on a plateau
+ * are visited in, which depends on the edit history. With an integer
+ * valued input, such as a gradient of integer pixels, ties are
+ * everywhere and the labels on plateaus will generally differ from a
+ * full run, so expect most edits to move some boundaries. Only
+ * near continuous inputs give labels that rarely differ. Both results
+ * are valid optimum path forests.
+ *
+ * A change of the input image, the marker image or the connectivity
+ * is noticed and starts again from the marker image, with any
+ * pending edits applied on top. Other changes, such as to the
+ * priority functor, need ResetState(). The edits are not written
+ * back to the marker image.
+ *
+ * The output shares its buffer with the filter's label state, which
+ * the next update changes in place. Copy the output if an earlier
+ * result must be kept. The state takes a cost and a predecessor byte
+ * per pixel on top of the output. PackedState and ParallelFlood are
+ * ignored.
+ *
+ * "Interactive volume segmentation with differential image foresting
+ * transforms." Alexandre Falcao and Felipe Bergo, IEEE Transactions
+ * on Medical Imaging, 23(9), 2004
+ *
+ * \sa IFTWatershedFromMarkersBaseImageFilter
+ * \ingroup ImageEnhancement  MathematicalMorphologyImageFilters
+ */
+template< class TInputImage, class TLabelImage,
+	  class TPriorityFunction = Functor::IFTPriority<
+	    typename TInputImage::PixelType,
+	    typename NumericTraits< typename TInputImage::PixelType >::RealType >,
+	  class TCost = typename IFTPriorityFunctorTraits< TPriorityFunction,
+							   typename TInputImage::PixelType >::CostType >
+class ITK_EXPORT DifferentialIFTWatershedFromMarkersImageFilter:
+    public IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage,
+						   TPriorityFunction, TCost >
+{
+public:
+  /** Standard class typedefs. */
+  typedef DifferentialIFTWatershedFromMarkersImageFilter Self;
+  typedef IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage,
+						  TPriorityFunction, TCost > Superclass;
+  typedef SmartPointer< Self >                           Pointer;
+  typedef SmartPointer< const Self >                     ConstPointer;
+
+  typedef typename Superclass::InputImageType         InputImageType;
+  typedef typename Superclass::LabelImageType         LabelImageType;
+  typedef typename Superclass::InputImageConstPointer InputImageConstPointer;
+  typedef typename Superclass::InputImagePixelType    InputImagePixelType;
+  typedef typename Superclass::LabelImagePointer      LabelImagePointer;
+  typedef typename Superclass::LabelImageConstPointer LabelImageConstPointer;
+  typedef typename Superclass::LabelImagePixelType    LabelImagePixelType;
+  typedef typename Superclass::IndexType              IndexType;
+  typedef typename Superclass::PriorityFunctorType    PriorityFunctorType;
+  typedef typename Superclass::CostType               CostType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TInputImage::ImageDimension);
+
+  typedef Image< CostType, itkGetStaticConstMacro(ImageDimension) > CostImageType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Runtime information support. */
+  itkTypeMacro(DifferentialIFTWatershedFromMarkersImageFilter,
+               IFTWatershedFromMarkersBaseImageFilter);
+
+  /** Make the pixel at index a marker with the given, non zero,
+   * label at the next update. A marker already there is relabelled. */
+  void AddMarker(const IndexType & index, LabelImagePixelType label);
+
+  /** Stop the pixel at index being a marker at the next
+   * update. Pixels that aren't markers are left alone. */
+  void RemoveMarker(const IndexType & index);
+
+  /** Drop the kept state, so that the next update floods the whole
+   * image from the marker image. Pending edits are kept. */
+  void ResetState();
+
+  /** The cost of every pixel after the last update, or null before
+   * the first one. Pixels no marker reaches have an undefined cost
+   * and the watershed label. */
+  const CostImageType * GetCostImage() const
+  {
+    return m_CostImage.GetPointer();
+  }
+
+  /** The number of pixels flooded from by the last update, which is
+   * the measure of how much of the image an edit touched. */
+  itkGetConstMacro(NumberOfVisitedPixels, SizeValueType);
+
+protected:
+  DifferentialIFTWatershedFromMarkersImageFilter();
+  ~DifferentialIFTWatershedFromMarkersImageFilter() {}
+  void PrintSelf(std::ostream & os, Indent indent) const;
+
+  /** Floods the whole image when there is no valid state, then
+   * applies the pending edits. */
+  void GenerateData();
+
+private:
+  //purposely not implemented
+  DifferentialIFTWatershedFromMarkersImageFilter(const Self &);
+  void operator=(const Self &); //purposely not implemented
+
+  typedef CostType                                           PriorityType;
+  typedef Image< unsigned char, itkGetStaticConstMacro(ImageDimension) > PredecessorImageType;
+  typedef std::pair< IndexType, LabelImagePixelType >        EditType;
+
+  // The predecessor byte of a pixel holds the index, in the flat
+  // neighbourhood, of the neighbour its path comes from, or one of the
+  // two values below. The top bit flags the boundary shell.
+  static const unsigned char RootPredecessor = 0x7E;
+  static const unsigned char NoPredecessor = 0x7F;
+  static const unsigned char PredecessorMask = 0x7F;
+  static const unsigned char BoundaryFlag = 0x80;
+
+  std::vector< EditType > m_MarkerEdits;
+
+  // the forest, and what it was built from
+  LabelImagePointer                       m_LabelImage;
+  typename CostImageType::Pointer         m_CostImage;
+  typename PredecessorImageType::Pointer  m_PredecessorImage;
+  InputImageConstPointer                  m_StateInput;
+  LabelImageConstPointer                  m_StateMarker;
+  bool                                    m_StateFullyConnected;
+  TimeStamp                               m_StateTime;
+
+  SizeValueType m_NumberOfVisitedPixels;
+
+  /** Pick the offset type and connectivity for UpdateOffsets */
+  template< class TOffset >
+  void UpdateWithConnectivity(ProgressReporter & progress, bool full);
+
+  /** Rebuild the forest from the marker image if full is set, then
+   * apply the edits */
+  template< class TOffset, bool VFullyConnected >
+  void UpdateOffsets(ProgressReporter & progress, bool full);
+}; // end of class
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkDifferentialIFTWatershedFromMarkersImageFilter.hxx"
+#endif
+
+#endif
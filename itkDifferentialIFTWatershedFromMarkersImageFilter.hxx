@@ -0,0 +1,389 @@
+#ifndef __itkDifferentialIFTWatershedFromMarkersImageFilter_hxx
+#define __itkDifferentialIFTWatershedFromMarkersImageFilter_hxx
+
+#include "itkDifferentialIFTWatershedFromMarkersImageFilter.h"
+#include "itkProgressReporter.h"
+#include <algorithm>
+#include <map>
+
+
+namespace itk
+{
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::DifferentialIFTWatershedFromMarkersImageFilter()
+{
+  m_StateFullyConnected = false;
+  m_NumberOfVisitedPixels = 0;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::AddMarker(const IndexType & index, LabelImagePixelType label)
+{
+  if ( label == NumericTraits< LabelImagePixelType >::Zero )
+    {
+    itkExceptionMacro(<< "Markers can't have the watershed label.");
+    }
+  m_MarkerEdits.push_back( EditType(index, label) );
+  this->Modified();
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::RemoveMarker(const IndexType & index)
+{
+  m_MarkerEdits.push_back( EditType(index, NumericTraits< LabelImagePixelType >::Zero) );
+  this->Modified();
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ResetState()
+{
+  m_LabelImage = 0;
+  m_CostImage = 0;
+  m_PredecessorImage = 0;
+  m_StateInput = 0;
+  m_StateMarker = 0;
+  this->Modified();
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::GenerateData()
+{
+  LabelImageConstPointer markerImage = this->GetMarkerImage();
+  InputImageConstPointer inputImage = this->GetInput();
+
+  // mask and marker must have the same size
+  if ( markerImage->GetRequestedRegion().GetSize() != inputImage->GetRequestedRegion().GetSize() )
+    {
+    itkExceptionMacro(<< "Marker and input must have the same size.");
+    }
+
+  // start again if anything other than the edits has changed since
+  // the forest was built
+  const bool full = m_LabelImage.IsNull()
+    || m_StateInput != inputImage || m_StateMarker != markerImage
+    || inputImage->GetMTime() > m_StateTime.GetMTime()
+    || markerImage->GetMTime() > m_StateTime.GetMTime()
+    || m_StateFullyConnected != this->GetFullyConnected();
+
+  if ( full )
+    {
+    LabelImagePointer outputImage = this->GetOutput();
+    m_LabelImage = LabelImageType::New();
+    m_LabelImage->CopyInformation(outputImage);
+    m_LabelImage->SetRegions( markerImage->GetLargestPossibleRegion() );
+    m_LabelImage->Allocate();
+    m_CostImage = CostImageType::New();
+    m_CostImage->SetRegions( markerImage->GetLargestPossibleRegion() );
+    m_CostImage->Allocate();
+    m_PredecessorImage = PredecessorImageType::New();
+    m_PredecessorImage->SetRegions( markerImage->GetLargestPossibleRegion() );
+    m_PredecessorImage->Allocate();
+    m_StateInput = inputImage;
+    m_StateMarker = markerImage;
+    m_StateFullyConnected = this->GetFullyConnected();
+    }
+
+  const SizeValueType numberOfPixels = m_LabelImage->GetBufferedRegion().GetNumberOfPixels();
+  ProgressReporter progress(this, 0, numberOfPixels);
+
+  m_NumberOfVisitedPixels = 0;
+  if ( numberOfPixels <= static_cast< SizeValueType >( NumericTraits< unsigned int >::max() ) )
+    {
+    this->template UpdateWithConnectivity< unsigned int >(progress, full);
+    }
+  else
+    {
+    this->template UpdateWithConnectivity< SizeValueType >(progress, full);
+    }
+  m_StateTime.Modified();
+
+  // no copy: the output is the label state
+  this->GraftOutput(m_LabelImage);
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::UpdateWithConnectivity(ProgressReporter & progress, bool full)
+{
+  if ( m_StateFullyConnected )
+    {
+    this->template UpdateOffsets< TOffset, true >(progress, full);
+    }
+  else
+    {
+    this->template UpdateOffsets< TOffset, false >(progress, full);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, bool VFullyConnected >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::UpdateOffsets(ProgressReporter & progress, bool full)
+{
+  // the label used to mark the watershed line in the output image
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  typedef FlatNeighborhood< LabelImageType, VFullyConnected > NeighborhoodType;
+  if ( NeighborhoodType::Size >= RootPredecessor )
+    {
+    itkExceptionMacro(<< "Too many neighbours to keep predecessors in a byte.");
+    }
+  NeighborhoodType neighbors;
+  neighbors.Initialize(m_LabelImage.GetPointer());
+  const OffsetValueType *strides;
+
+  // opposite[i] is the neighbour in the opposite direction to i, so
+  // that the pixel at p + stride i has p as neighbour opposite[i]
+  unsigned char opposite[NeighborhoodType::Size];
+  for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+    {
+    for ( unsigned int j = 0; j < NeighborhoodType::Size; j++ )
+      {
+      bool isOpposite = true;
+      for ( unsigned d = 0; d < ImageDimension; d++ )
+	{
+	isOpposite = isOpposite && neighbors.GetOffset(j)[d] == -neighbors.GetOffset(i)[d];
+	}
+      if ( isOpposite )
+	{
+	opposite[i] = static_cast< unsigned char >( j );
+	}
+      }
+    }
+
+  const InputImagePixelType *inputBuf = this->GetInput()->GetBufferPointer();
+  const LabelImagePixelType *markerBuf = this->GetMarkerImage()->GetBufferPointer();
+  LabelImagePixelType       *labelBuf = m_LabelImage->GetBufferPointer();
+  PriorityType              *costBuf = m_CostImage->GetBufferPointer();
+  unsigned char             *predBuf = m_PredecessorImage->GetBufferPointer();
+
+  const TOffset numberOfPixels =
+    static_cast< TOffset >( m_LabelImage->GetBufferedRegion().GetNumberOfPixels() );
+
+  // Entries aren't moved when a pixel gets cheaper, it is pushed
+  // again and the entries that no longer match its cost are skipped
+  // when popped. The first run is then the plain IFT, with the same
+  // FIFO order as the base filter.
+  HierarchicalQueue< PriorityType, TOffset > fah;
+
+  if ( full )
+    {
+    // markers are roots, everything else unreached
+    const TOffset rowLength = static_cast< TOffset >( neighbors.GetRowLength() );
+    for ( TOffset rowStart = 0; rowStart < numberOfPixels; rowStart += rowLength )
+      {
+      const bool boundaryRow = neighbors.IsBoundaryRow(rowStart);
+      for ( TOffset p = rowStart; p < rowStart + rowLength; ++p )
+	{
+	const bool boundary = boundaryRow || p == rowStart || p == rowStart + rowLength - 1;
+	const unsigned char flag = boundary ? BoundaryFlag : 0;
+	labelBuf[p] = markerBuf[p];
+	if ( markerBuf[p] != wsLabel )
+	  {
+	  costBuf[p] = 0;
+	  predBuf[p] = RootPredecessor | flag;
+	  }
+	else
+	  {
+	  predBuf[p] = NoPredecessor | flag;
+	  }
+	}
+      }
+    // seed from the markers with background neighbours, in offset
+    // order
+    for ( TOffset p = 0; p < numberOfPixels; ++p )
+      {
+      if ( markerBuf[p] != wsLabel )
+	{
+	strides = neighbors.GetStrides(p, predBuf[p] & BoundaryFlag);
+	for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	  {
+	  if ( markerBuf[p + strides[i]] == wsLabel )
+	    {
+	    fah.Push(0, p);
+	    break;
+	    }
+	  }
+	}
+      }
+    }
+
+  // the edits, one per pixel, the last one winning
+  typedef std::map< TOffset, LabelImagePixelType > EditMapType;
+  EditMapType edits;
+  for ( typename std::vector< EditType >::const_iterator eIt = m_MarkerEdits.begin();
+	eIt != m_MarkerEdits.end(); ++eIt )
+    {
+    if ( !m_LabelImage->GetBufferedRegion().IsInside(eIt->first) )
+      {
+      m_MarkerEdits.clear();
+      itkExceptionMacro(<< "Marker edit at " << eIt->first << " is outside the image.");
+      }
+    edits[ static_cast< TOffset >( m_LabelImage->ComputeOffset(eIt->first) ) ] = eIt->second;
+    }
+  m_MarkerEdits.clear();
+
+  // Removals first: clear the tree of each removed marker, walking
+  // down from the root through the pixels whose predecessor is the
+  // pixel being cleared. Reached pixels next to a cleared tree are on
+  // its frontier and flood it again from their current cost.
+  std::vector< TOffset > tree;
+  std::vector< TOffset > frontier;
+  for ( typename EditMapType::const_iterator eIt = edits.begin(); eIt != edits.end(); ++eIt )
+    {
+    const TOffset s = eIt->first;
+    if ( eIt->second != wsLabel || ( predBuf[s] & PredecessorMask ) != RootPredecessor )
+      {
+      continue;
+      }
+    labelBuf[s] = wsLabel;
+    predBuf[s] = NoPredecessor | ( predBuf[s] & BoundaryFlag );
+    tree.push_back(s);
+    while ( !tree.empty() )
+      {
+      const TOffset p = tree.back();
+      tree.pop_back();
+      strides = neighbors.GetStrides(p, predBuf[p] & BoundaryFlag);
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	if ( strides[i] == 0 )
+	  {
+	  continue;
+	  }
+	const TOffset q = static_cast< TOffset >( p + strides[i] );
+	const unsigned char pred = predBuf[q] & PredecessorMask;
+	if ( pred == opposite[i] )
+	  {
+	  labelBuf[q] = wsLabel;
+	  predBuf[q] = NoPredecessor | ( predBuf[q] & BoundaryFlag );
+	  tree.push_back(q);
+	  }
+	else if ( pred != NoPredecessor )
+	  {
+	  frontier.push_back(q);
+	  }
+	}
+      }
+    }
+  // a pixel can border several cleared pixels, or have been cleared
+  // by a later tree
+  std::sort( frontier.begin(), frontier.end() );
+  frontier.erase( std::unique( frontier.begin(), frontier.end() ), frontier.end() );
+  for ( typename std::vector< TOffset >::const_iterator fIt = frontier.begin();
+	fIt != frontier.end(); ++fIt )
+    {
+    if ( ( predBuf[*fIt] & PredecessorMask ) != NoPredecessor )
+      {
+      fah.Push(costBuf[*fIt], *fIt);
+      }
+    }
+
+  // then the new markers, which flood from themselves
+  for ( typename EditMapType::const_iterator eIt = edits.begin(); eIt != edits.end(); ++eIt )
+    {
+    const TOffset s = eIt->first;
+    if ( eIt->second == wsLabel
+	 || ( ( predBuf[s] & PredecessorMask ) == RootPredecessor && labelBuf[s] == eIt->second ) )
+      {
+      continue;
+      }
+    costBuf[s] = 0;
+    labelBuf[s] = eIt->second;
+    predBuf[s] = RootPredecessor | ( predBuf[s] & BoundaryFlag );
+    fah.Push(0, s);
+    }
+
+  // The flood. A neighbour is taken over when it is unreached or
+  // the path through the centre is cheaper, as in the IFT. A
+  // neighbour whose path already comes through the centre follows any
+  // change of the centre's cost or label, which is how edits reach
+  // down existing trees. Markers never change.
+  typedef PriorityFunctorBatch< TPriorityFunction > BatchType;
+  InputImagePixelType NeighVals[NeighborhoodType::Size];
+  bool                NeighOpen[NeighborhoodType::Size];
+  PriorityType        StepCosts[NeighborhoodType::Size];
+  PriorityFunctorType &functor = this->GetFunctor();
+  SizeValueType visited = 0;
+
+  while ( !fah.empty() )
+    {
+    fah.NextLevel();
+    const PriorityType level = fah.CurrentPriority();
+    while ( !fah.CurrentEmpty() )
+      {
+      const TOffset p = fah.PopCurrent();
+      if ( costBuf[p] != level || ( predBuf[p] & PredecessorMask ) == NoPredecessor )
+	{
+	// superseded by a cheaper entry, or cleared
+	continue;
+	}
+      ++visited;
+      progress.CompletedPixel();
+
+      PriorityType CentreCost = costBuf[p];
+      InputImagePixelType CentrePix = inputBuf[p];
+      LabelImagePixelType CentreLab = labelBuf[p];
+      strides = neighbors.GetStrides(p, predBuf[p] & BoundaryFlag);
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	TOffset q = static_cast< TOffset >( p + strides[i] );
+	NeighVals[i] = inputBuf[q];
+	NeighOpen[i] = strides[i] != 0 && ( predBuf[q] & PredecessorMask ) != RootPredecessor;
+	}
+      BatchType::Evaluate(functor, CentrePix, NeighVals, NeighOpen, StepCosts);
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	if ( !NeighOpen[i] )
+	  {
+	  continue;
+	  }
+	TOffset q = static_cast< TOffset >( p + strides[i] );
+	PriorityType NewCost = std::max(CentreCost, StepCosts[i]);
+	const unsigned char pred = predBuf[q] & PredecessorMask;
+	if ( pred == NoPredecessor || NewCost < costBuf[q]
+	     || ( pred == opposite[i] && ( NewCost != costBuf[q] || labelBuf[q] != CentreLab ) ) )
+	  {
+	  costBuf[q] = NewCost;
+	  labelBuf[q] = CentreLab;
+	  predBuf[q] = opposite[i] | ( predBuf[q] & BoundaryFlag );
+	  if ( NewCost == CentreCost )
+	    {
+	    fah.PushCurrent(q);
+	    }
+	  else
+	    {
+	    fah.Push(NewCost, q);
+	    }
+	  }
+	}
+      }
+    }
+  m_NumberOfVisitedPixels = visited;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+DifferentialIFTWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "Pending marker edits: " << m_MarkerEdits.size() << std::endl;
+  os << indent << "NumberOfVisitedPixels: " << m_NumberOfVisitedPixels << std::endl;
+}
+} // end namespace itk
+#endif
@@ -19,6 +19,12 @@
 #define __itkDisSimMorphologicalWatershedFromMarkersImageFilter_h
 
 #include "itkImageToImageFilter.h"
+#include "itkProgressReporter.h"
+#include "itkMultiThreader.h"
+#include "itkWatershedFloodStatistics.h"
+#include "itkWatershedMemoryEstimate.h"
+#include <vector>
+#include <utility>
 
 namespace itk
 {
@@ -124,6 +130,61 @@ public:
   itkSetMacro(MarkWatershedLine, bool);
   itkGetConstReferenceMacro(MarkWatershedLine, bool);
   itkBooleanMacro(MarkWatershedLine);
+
+  /**
+   * Set/Get whether the output buffer and the internal status image
+   * are kept after an update, and used again by the next update of an
+   * image of the same size rather than allocated again. The next
+   * update overwrites the output of this one, even if it has been
+   * disconnected from the filter. Default is false.
+   */
+  itkSetMacro(ReuseBuffers, bool);
+  itkGetConstReferenceMacro(ReuseBuffers, bool);
+  itkBooleanMacro(ReuseBuffers);
+
+  /**
+   * Set/Get whether the flood counts what it does, for
+   * GetStatistics. The counting is compiled into a separate flood, so
+   * there is no cost when it is off. Default is false.
+   */
+  itkSetMacro(CollectStatistics, bool);
+  itkGetConstReferenceMacro(CollectStatistics, bool);
+  itkBooleanMacro(CollectStatistics);
+
+  /**
+   * The seeds, pops, peak queue size, priority levels and phase times
+   * of the last update, if CollectStatistics was on. The queue has no
+   * decrease-key, so there are no updates or rejected relaxations.
+   */
+  const WatershedFloodStatistics & GetStatistics() const { return m_Statistics; }
+
+  /**
+   * The peak memory of an update of region. The worst case has every
+   * pixel queued, in as many priority levels as the pixel type allows,
+   * each of which may hold a part used chunk of the queue. For integer
+   * pixels with a bounded IFTBucketKeyRange that is the pixel values
+   * or their differences, as with the functors in markerWS, and the
+   * bound is a few bytes a pixel. For other pixel types it is a level
+   * per pixel, about a kilobyte each.
+   */
+  static WatershedMemoryEstimate EstimateMemory(const LabelImageRegionType & region,
+						bool fullyConnected,
+						bool markWatershedLine = true);
+
+  /**
+   * Set/Get the memory, in bytes, an update may use. The update fails
+   * before anything is allocated if the estimate is over it, as there
+   * is no leaner way to run the flood. That is the worst case for
+   * integer pixels with a bounded IFTBucketKeyRange, and the typical
+   * case otherwise, as a level per pixel isn't reached in practice.
+   * The input and marker images aren't counted. Default is 0, no
+   * limit.
+   */
+  itkSetMacro(MemoryLimit, SizeValueType);
+  itkGetConstMacro(MemoryLimit, SizeValueType);
+
+  /** The estimate for the last update */
+  const WatershedMemoryEstimate & GetMemoryEstimate() const { return m_MemoryEstimate; }
 protected:
   DisSimMorphologicalWatershedFromMarkersImageFilter();
   ~DisSimMorphologicalWatershedFromMarkersImageFilter() {}
@@ -139,9 +200,15 @@ protected:
    * \sa ProcessObject::EnlargeOutputRequestedRegion() */
   void EnlargeOutputRequestedRegion( DataObject *itkNotUsed(output) );
 
-  /** The filter is single threaded. */
+  /** The initialisation pass, which copies the markers and finds the
+   * seeds of the flood, is split between threads. The flood itself is
+   * single threaded. Pixels are addressed by 32 bit buffer offsets,
+   * or 64 bit ones for images of more than 4G pixels. */
   void GenerateData();
 
+  /** Sets the output up on the kept buffer with ReuseBuffers */
+  void AllocateOutputs();
+
 private:
   //purposely not implemented
   DisSimMorphologicalWatershedFromMarkersImageFilter(const Self &);
@@ -150,7 +217,59 @@ private:
   bool m_FullyConnected;
 
   bool m_MarkWatershedLine;
+
+  bool m_ReuseBuffers;
   PriorityFunctorType m_PriorityFunctor;
+
+  bool                     m_CollectStatistics;
+  WatershedFloodStatistics m_Statistics;
+
+  SizeValueType           m_MemoryLimit;
+  WatershedMemoryEstimate m_MemoryEstimate;
+
+  // kept with ReuseBuffers
+  typedef Image< unsigned char, ImageDimension > StatusImageType;
+  typename StatusImageType::Pointer              m_StatusBuffer;
+  typename LabelImageType::PixelContainerPointer m_OutputBuffer;
+
+  /** Pick the connectivity for FloodOffsets */
+  template< class TOffset >
+  void FloodWithConnectivity(ProgressReporter & progress);
+
+  /** Pick the flood with or without statistics */
+  template< class TOffset, bool VFullyConnected >
+  void FloodWithStatistics(ProgressReporter & progress);
+
+  /** Both algorithms, working on linear offsets of type TOffset into
+   * the raw image buffers, with the neighbourhood fixed at compile
+   * time. VStatistics compiles the counting in. */
+  template< class TOffset, bool VFullyConnected, bool VStatistics >
+  void FloodOffsets(ProgressReporter & progress);
+
+  // What the threads of the initialisation pass share. Each thread
+  // keeps its own list of seeds (priority and offset), in offset
+  // order, and count of completed pixels.
+  template< class TOffset, class TNeighborhood >
+  struct SeedThreadStruct {
+    Self                *Filter;
+    const TNeighborhood *Neighbors;
+    unsigned char       *StatusBuf;
+    std::vector< std::vector< std::pair< PriorityType, TOffset > > > Seeds;
+    std::vector< SizeValueType > Completed;
+  };
+
+  /** Runs ThreadedSeed on a piece of the output */
+  template< class TSeedStruct >
+  static ITK_THREAD_RETURN_TYPE SeedThreaderCallback(void *arg);
+
+  /** The initialisation pass over one piece of the output: copy the
+   * markers, set the status of its pixels and list the seeds. For
+   * Meyer's algorithm the seeds are the background neighbours of the
+   * markers, which may be listed more than once. */
+  template< class TOffset, class TNeighborhood >
+  void ThreadedSeed(const LabelImageRegionType & region,
+		    SeedThreadStruct< TOffset, TNeighborhood > & str,
+		    ThreadIdType threadId);
 }; // end of class
 } // end namespace itk
 
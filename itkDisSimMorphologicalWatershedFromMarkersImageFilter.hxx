@@ -19,16 +19,13 @@
 #define __itkDisSimMorphologicalWatershedFromMarkersImageFilter_hxx
 
 #include <algorithm>
-#include <queue>
 #include <list>
 #include "itkDisSimMorphologicalWatershedFromMarkersImageFilter.h"
 #include "itkProgressReporter.h"
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
-#include "itkConstShapedNeighborhoodIterator.h"
-#include "itkConstantBoundaryCondition.h"
-#include "itkSize.h"
-#include "itkConnectedComponentAlgorithm.h"
+#include "itkFlatNeighborhood.h"
+#include "itkHierarchicalQueue.h"
+#include "itkPriorityFunctorBatch.h"
+#include "itkIFTQueue.h"
 
 namespace itk
 {
@@ -39,6 +36,9 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
   this->SetNumberOfRequiredInputs(2);
   m_FullyConnected = false;
   m_MarkWatershedLine = true;
+  m_ReuseBuffers = false;
+  m_CollectStatistics = false;
+  m_MemoryLimit = 0;
 }
 
 template< class TInputImage, class TLabelImage, class TPriorityFunction >
@@ -78,31 +78,49 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
 template< class TInputImage, class TLabelImage, class TPriorityFunction >
 void
 DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
-::GenerateData()
+::AllocateOutputs()
 {
-  // there is 2 possible cases: with or without watershed lines.
-  // the algorithm with watershed lines is from Meyer
-  // the algorithm without watershed lines is from beucher
-  // The 2 algorithms are very similar and so are integrated in the same filter.
-
-  //---------------------------------------------------------------------------
-  // declare the vars common to the 2 algorithms: constants, iterators,
-  // hierarchical queue, progress reporter, and status image
-  // also allocate output images and verify preconditions
-  //---------------------------------------------------------------------------
+  LabelImageType *output = this->GetOutput();
+  if ( m_ReuseBuffers && m_OutputBuffer )
+    {
+    // Allocate only replaces it if it is too small
+    output->SetPixelContainer(m_OutputBuffer);
+    }
+  output->SetBufferedRegion( output->GetRequestedRegion() );
+  output->Allocate();
+  m_OutputBuffer = m_ReuseBuffers ? output->GetPixelContainer() : 0;
+}
 
-  // the label used to find background in the marker image
-  static const LabelImagePixelType bgLabel =
-    NumericTraits< LabelImagePixelType >::Zero;
-  // the label used to mark the watershed line in the output image
-  static const LabelImagePixelType wsLabel =
-    NumericTraits< LabelImagePixelType >::Zero;
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+void
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::GenerateData()
+{
+  m_Statistics.Reset();
+  m_MemoryEstimate = Self::EstimateMemory(this->GetOutput()->GetRequestedRegion(), m_FullyConnected,
+					  m_MarkWatershedLine);
+  // with unbounded priorities the worst case has a level per queued
+  // pixel, which no real image gets near, so it is the typical
+  // estimate that has to fit
+  const SizeValueType needed = IFTBucketKeyRange< InputImagePixelType >::Bounded ? m_MemoryEstimate.Worst
+    : m_MemoryEstimate.Typical;
+  if ( m_MemoryLimit > 0 && needed > m_MemoryLimit )
+    {
+    itkExceptionMacro(<< "The flood may need " << needed
+		      << " bytes, over the memory limit of " << m_MemoryLimit << ".");
+    }
 
+  TimeProbe allocationTime;
+  allocationTime.Start();
   this->AllocateOutputs();
+  allocationTime.Stop();
+  if ( m_CollectStatistics )
+    {
+    m_Statistics.AllocationTime = allocationTime.GetTotal();
+    }
 
   LabelImageConstPointer markerImage = this->GetMarkerImage();
   InputImageConstPointer inputImage = this->GetInput();
-  LabelImagePointer      outputImage = this->GetOutput();
 
   // Set up the progress reporter
   // we can't found the exact number of pixel to process in the 2nd pass, so we
@@ -116,164 +134,362 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
     itkExceptionMacro(<< "Marker and input must have the same size.");
     }
 
-  // FAH (in french: File d'Attente Hierarchique)
-  typedef std::queue< IndexType >                    QueueType;
-  typedef std::map< InputImagePixelType, QueueType > MapType;
-  MapType fah;
-
-  // the radius which will be used for all the shaped iterators
-  Size< ImageDimension > radius;
-  radius.Fill(1);
-
-  // iterator for the marker image
-  typedef ConstShapedNeighborhoodIterator< LabelImageType > MarkerIteratorType;
-  typename MarkerIteratorType::ConstIterator nmIt;
-  MarkerIteratorType
-  markerIt( radius, markerImage, markerImage->GetRequestedRegion() );
-  // add a boundary constant to avoid adding pixels on the border in the fah
-  ConstantBoundaryCondition< LabelImageType > lcbc;
-  lcbc.SetConstant( NumericTraits< LabelImagePixelType >::max() );
-  markerIt.OverrideBoundaryCondition(&lcbc);
-  setConnectivity(&markerIt, m_FullyConnected);
-
-  // iterator for the input image
-  typedef ConstShapedNeighborhoodIterator< InputImageType > InputIteratorType;
-  InputIteratorType
-  inputIt( radius, inputImage, inputImage->GetRequestedRegion() );
-  typename InputIteratorType::ConstIterator niIt;
-  setConnectivity(&inputIt, m_FullyConnected);
-
-  // iterator for the output image
-  typedef ShapedNeighborhoodIterator< LabelImageType > OutputIteratorType;
-  typedef typename OutputIteratorType::OffsetType      OffsetType;
-  typename OutputIteratorType::Iterator noIt;
-  OutputIteratorType
-  outputIt( radius, outputImage, outputImage->GetRequestedRegion() );
-  setConnectivity(&outputIt, m_FullyConnected);
+  // queue entries are buffer offsets, so use the smallest type that
+  // can address every pixel
+  if ( this->GetOutput()->GetBufferedRegion().GetNumberOfPixels()
+       <= static_cast< SizeValueType >( NumericTraits< unsigned int >::max() ) )
+    {
+    this->template FloodWithConnectivity< unsigned int >(progress);
+    }
+  else
+    {
+    this->template FloodWithConnectivity< SizeValueType >(progress);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+WatershedMemoryEstimate
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::EstimateMemory(const LabelImageRegionType & region, bool fullyConnected, bool markWatershedLine)
+{
+  const double numberOfPixels = static_cast< double >( region.GetNumberOfPixels() );
+  const bool   smallOffsets = numberOfPixels <= static_cast< double >( NumericTraits< unsigned int >::max() );
+  const double neighbors = fullyConnected ? FlatNeighborhood< LabelImageType, true >::Size
+    : FlatNeighborhood< LabelImageType, false >::Size;
+
+  // the seeds are a priority and an offset each
+  const double seedBytes = smallOffsets ? sizeof( std::pair< PriorityType, unsigned int > )
+    : sizeof( std::pair< PriorityType, SizeValueType > );
+  // the output and the status image
+  const double images = numberOfPixels * ( sizeof( LabelImagePixelType ) + 1 );
+
+  // the priority levels are bounded by the pixel values, or their
+  // differences, for integer pixels, and by the queued pixels
+  // otherwise. A typical front is taken to have 32 pixels a level.
+  typedef IFTBucketKeyRange< InputImagePixelType > KeyRange;
+  const double keys = KeyRange::Bounded ? KeyRange::Max() - KeyRange::Min() + 1 : numberOfPixels;
+
+  double bytes[2];
+  const double queued[2] = { numberOfPixels, WatershedMemoryEstimate::TypicalQueued( numberOfPixels ) };
+  const double levels[2] = { std::min( keys, queued[0] ), std::min( keys, std::max( 1.0, queued[1] / 32 ) ) };
+  for ( unsigned int i = 0; i < 2; ++i )
+    {
+    // the seed lists, which may have grown to twice what they hold. At
+    // worst Meyer's algorithm lists a background pixel once per marker
+    // neighbour, and there are no more marker and background pairs
+    // than pairs of neighbours.
+    const double seeds = ( i == 0 && markWatershedLine ) ? queued[i] * neighbors / 2 : queued[i];
+    bytes[i] = images + 2 * seeds * seedBytes
+      + ( smallOffsets ? HierarchicalQueue< PriorityType, unsigned int >::Footprint( queued[i], levels[i] )
+	  : HierarchicalQueue< PriorityType, SizeValueType >::Footprint( queued[i], levels[i] ) );
+    }
+  return WatershedMemoryEstimate( bytes[0], bytes[1] );
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TOffset >
+void
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::FloodWithConnectivity(ProgressReporter & progress)
+{
+  if ( m_FullyConnected )
+    {
+    this->template FloodWithStatistics< TOffset, true >(progress);
+    }
+  else
+    {
+    this->template FloodWithStatistics< TOffset, false >(progress);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TOffset, bool VFullyConnected >
+void
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::FloodWithStatistics(ProgressReporter & progress)
+{
+  if ( m_CollectStatistics )
+    {
+    this->template FloodOffsets< TOffset, VFullyConnected, true >(progress);
+    }
+  else
+    {
+    this->template FloodOffsets< TOffset, VFullyConnected, false >(progress);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TSeedStruct >
+ITK_THREAD_RETURN_TYPE
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::SeedThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast< MultiThreader::ThreadInfoStruct * >( arg );
+  TSeedStruct *str = static_cast< TSeedStruct * >( info->UserData );
+  const ThreadIdType threadId = info->ThreadID;
+
+  LabelImageRegionType splitRegion;
+  const ThreadIdType total =
+    str->Filter->SplitRequestedRegion(threadId, info->NumberOfThreads, splitRegion);
+  if ( threadId < total )
+    {
+    str->Filter->ThreadedSeed(splitRegion, *str, threadId);
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TOffset, class TNeighborhood >
+void
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::ThreadedSeed(const LabelImageRegionType & region,
+               SeedThreadStruct< TOffset, TNeighborhood > & str,
+               ThreadIdType threadId)
+{
+  static const LabelImagePixelType bgLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const unsigned char DoneFlag = 1;
+  static const unsigned char BoundaryFlag = 2;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+  typedef std::pair< PriorityType, TOffset >       SeedType;
+
+  const LabelImagePixelType *markerBuf = this->GetMarkerImage()->GetBufferPointer();
+  const InputImagePixelType *inputBuf = this->GetInput()->GetBufferPointer();
+  LabelImagePixelType       *outputBuf = this->GetOutput()->GetBufferPointer();
+  unsigned char             *statusBuf = str.StatusBuf;
+  const TNeighborhood       &neighbors = *str.Neighbors;
+  std::vector< SeedType >   &seeds = str.Seeds[threadId];
+  SizeValueType             completed = 0;
+  OffsetValueType           scratch[TNeighborhood::Size];
+
+  // markers are already processed in Meyer's algorithm
+  const unsigned char markerFlag = m_MarkWatershedLine ? DoneFlag : 0;
+
+  // the output is split along its last dimension, so each piece is a
+  // contiguous range of offsets. Work through it a row at a time, as
+  // all but the ends of a row are on the boundary shell or none are.
+  const TOffset begin = static_cast< TOffset >( this->GetOutput()->ComputeOffset( region.GetIndex() ) );
+  const TOffset end = static_cast< TOffset >( begin + region.GetNumberOfPixels() );
+  const TOffset rowLength = static_cast< TOffset >( neighbors.GetRowLength() );
+  for ( TOffset rowBegin = begin; rowBegin < end; )
+    {
+    const TOffset rowStart = rowBegin - rowBegin % rowLength;
+    const TOffset rowEnd = std::min( static_cast< TOffset >( rowStart + rowLength ), end );
+    const bool    boundaryRow = neighbors.IsBoundaryRow(rowStart);
+
+    // copy the markers to the output, with the watershed label
+    // elsewhere, and set the status. Pixels that are never reached
+    // keep the watershed label.
+    for ( TOffset p = rowBegin; p < rowEnd; ++p )
+      {
+      const LabelImagePixelType markerPixel = markerBuf[p];
+      const bool boundary = boundaryRow || p == rowStart || p == rowStart + rowLength - 1;
+      outputBuf[p] = markerPixel != bgLabel ? markerPixel : wsLabel;
+      statusBuf[p] = static_cast< unsigned char >( ( boundary ? BoundaryFlag : 0 )
+                                                   | ( markerPixel != bgLabel ? markerFlag : 0 ) );
+      }
+
+    // then look for the marker borders
+    for ( TOffset p = rowBegin; p < rowEnd; ++p )
+      {
+      if ( markerBuf[p] != bgLabel )
+        {
+        const OffsetValueType *strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag, scratch);
+        if ( m_MarkWatershedLine )
+          {
+          // the background neighbours are the seeds
+          for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
+            {
+            TOffset q = static_cast< TOffset >( p + strides[i] );
+            if ( markerBuf[q] == bgLabel )
+              {
+              PriorityType priority = m_PriorityFunctor(inputBuf[p], inputBuf[q]);
+              seeds.push_back( SeedType(priority, q) );
+              }
+            }
+          // this pixel will not be used in the flooding stage
+          ++completed;
+          }
+        else
+          {
+          // search if it has background pixel in its neighborhood
+          bool haveBgNeighbor = false;
+          for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
+            {
+            if ( markerBuf[p + strides[i]] == bgLabel )
+              {
+              haveBgNeighbor = true;
+              break;
+              }
+            }
+          if ( haveBgNeighbor )
+            {
+            seeds.push_back( SeedType(0, p) );
+            }
+          else
+            {
+            // this pixel will not be used in the flooding stage
+            ++completed;
+            }
+          }
+        }
+      ++completed;
+      }
+    rowBegin = rowEnd;
+    }
+  str.Completed[threadId] = completed;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TOffset, bool VFullyConnected, bool VStatistics >
+void
+DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+::FloodOffsets(ProgressReporter & progress)
+{
+  WatershedFloodCounter< VStatistics > counter(m_Statistics);
+
+  // there is 2 possible cases: with or without watershed lines.
+  // the algorithm with watershed lines is from Meyer
+  // the algorithm without watershed lines is from beucher
+  // The 2 algorithms are very similar and so are integrated in the same filter.
 
   //---------------------------------------------------------------------------
-  // Meyer's algorithm
+  // declare the vars common to the 2 algorithms: constants, neighbour
+  // offsets, hierarchical queue and raw buffers
   //---------------------------------------------------------------------------
-  if ( m_MarkWatershedLine )
+
+  // the label used to mark the watershed line in the output image
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  // bits of the status image
+  static const unsigned char DoneFlag = 1;
+  static const unsigned char BoundaryFlag = 2;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  LabelImageConstPointer markerImage = this->GetMarkerImage();
+  InputImageConstPointer inputImage = this->GetInput();
+  LabelImagePointer      outputImage = this->GetOutput();
+
+  // FAH (in french: File d'Attente Hierarchique), keyed on the
+  // priority
+  HierarchicalQueue< PriorityType, TOffset > fah;
+
+  // neighbours as buffer offsets, in the order the shaped iterators
+  // used to visit them. Neighbours outside the image are replaced by
+  // the pixel itself, which is what the boundary conditions used to
+  // achieve
+  typedef FlatNeighborhood< LabelImageType, VFullyConnected > NeighborhoodType;
+  NeighborhoodType neighbors;
+  neighbors.Initialize(outputImage);
+  const OffsetValueType *strides;
+
+  // create a temporary image to store the state of each pixel. Pixels
+  // on the boundary shell are flagged, as only they need their
+  // neighbours checked against the image bounds. Meyer's algorithm
+  // also flags the pixels it has processed.
+  typename StatusImageType::Pointer statusImage = m_StatusBuffer;
+  if ( !m_ReuseBuffers || !statusImage
+       || statusImage->GetBufferedRegion() != markerImage->GetLargestPossibleRegion() )
     {
-    // first stage:
-    //  - set markers pixels to already processed status
-    //  - copy markers pixels to output image
-    //  - init FAH with indexes of background pixels with marker pixel(s) in
-    //    their neighborhood
-
-    ConstantBoundaryCondition< LabelImageType > lcbc2;
-    // outside pixel are watershed so they won't be use to find real watershed
-    // pixels
-    lcbc2.SetConstant(wsLabel);
-    outputIt.OverrideBoundaryCondition(&lcbc2);
-
-    // create a temporary image to store the state of each pixel (processed or
-    // not)
-    typedef Image< bool, ImageDimension > StatusImageType;
-    typename StatusImageType::Pointer statusImage = StatusImageType::New();
+    statusImage = StatusImageType::New();
     statusImage->SetRegions( markerImage->GetLargestPossibleRegion() );
     statusImage->Allocate();
-
-    // iterator for the status image
-    typedef ShapedNeighborhoodIterator< StatusImageType > StatusIteratorType;
-    typename StatusIteratorType::Iterator nsIt;
-    StatusIteratorType
-                                                 statusIt( radius, statusImage, outputImage->GetRequestedRegion() );
-    ConstantBoundaryCondition< StatusImageType > bcbc;
-    bcbc.SetConstant(true);    // outside pixel are already processed
-    statusIt.OverrideBoundaryCondition(&bcbc);
-    setConnectivity(&statusIt, m_FullyConnected);
-
-    // the status image must be initialized before the first stage. In the
-    // first stage, the set to true are the neighbors of the marker (and the
-    // marker) so it's difficult (impossible ?) to init the status image at
-    // the same time
-    // the overhead should be small
-    statusImage->FillBuffer(false);
-
-    for ( markerIt.GoToBegin(), statusIt.GoToBegin(), outputIt.GoToBegin(), inputIt.GoToBegin();
-          !markerIt.IsAtEnd();
-          ++markerIt, ++outputIt )
+    }
+  m_StatusBuffer = m_ReuseBuffers ? statusImage.GetPointer() : 0;
+
+  // all buffers cover the same region, so share offsets
+  const InputImagePixelType *inputBuf = inputImage->GetBufferPointer();
+  LabelImagePixelType       *outputBuf = outputImage->GetBufferPointer();
+  unsigned char             *statusBuf = statusImage->GetBufferPointer();
+  counter.EndPhase( WatershedFloodStatistics::AllocationPhase );
+
+  // the neighbours of the pixel being flooded from. Vectorizable
+  // priority functors are evaluated for all of them, others only for
+  // the ones that will be queued
+  typedef PriorityFunctorBatch< TPriorityFunction > BatchType;
+  InputImagePixelType NeighVals[NeighborhoodType::Size];
+  bool                NeighOpen[NeighborhoodType::Size];
+  PriorityType        Priorities[NeighborhoodType::Size];
+
+  // init stage, split between threads:
+  //  - copy the markers to the output image, with the watershed label
+  //    elsewhere
+  //  - set the status of every pixel
+  //  - list the seeds of the fah
+  typedef SeedThreadStruct< TOffset, NeighborhoodType > SeedStructType;
+  SeedStructType str;
+  str.Filter = this;
+  str.Neighbors = &neighbors;
+  str.StatusBuf = statusBuf;
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  const ThreadIdType numberOfThreads = this->GetMultiThreader()->GetNumberOfThreads();
+  str.Seeds.resize(numberOfThreads);
+  str.Completed.resize(numberOfThreads, 0);
+  this->GetMultiThreader()->SetSingleMethod(&Self::template SeedThreaderCallback< SeedStructType >, &str);
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // the pieces are in offset order, so queueing the seeds a thread at
+  // a time gives the same fah as a serial scan
+  for ( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    const std::vector< std::pair< PriorityType, TOffset > > & seeds = str.Seeds[t];
+    for ( typename std::vector< std::pair< PriorityType, TOffset > >::const_iterator sIt = seeds.begin();
+          sIt != seeds.end(); ++sIt )
       {
-      LabelImagePixelType markerPixel = markerIt.GetCenterPixel();
-      if ( markerPixel != bgLabel )
+      const TOffset q = sIt->second;
+      if ( m_MarkWatershedLine )
         {
-        IndexType idx = markerIt.GetIndex();
-
-        // move the iterators to the right place
-        OffsetType shift = idx - statusIt.GetIndex();
-        statusIt += shift;
-        inputIt += shift;
-
-        // this pixel belongs to a marker
-        // mark it as already processed
-        statusIt.SetCenterPixel(true);
-        // copy it to the output image
-        outputIt.SetCenterPixel(markerPixel);
-        // and increase progress because this pixel will not be used in the
-        // flooding stage.
-        progress.CompletedPixel();
-
-        // search the background pixels in the neighborhood
-        for ( nmIt = markerIt.Begin(), nsIt = statusIt.Begin(), niIt = inputIt.Begin();
-              nmIt != markerIt.End();
-              nmIt++, nsIt++, niIt++ )
+        // a background pixel next to several markers is only queued
+        // with the priority from the first one
+        if ( !( statusBuf[q] & DoneFlag ) )
           {
-          if ( !nsIt.Get() && nmIt.Get() == bgLabel )
-            {
-            // this neighbor is a background pixel and is not already
-            // processed; add its index to fah
-	    PriorityType priority = m_PriorityFunctor(inputIt.GetCenterPixel(), niIt.Get());
-            fah[priority].push( markerIt.GetIndex()
-                                  + nmIt.GetNeighborhoodOffset() );
-            // mark it as already in the fah to avoid adding it several times
-            nsIt.Set(true);
-            }
+          fah.Push(sIt->first, q);
+          counter.Seed();
+          // mark it as already in the fah to avoid adding it several times
+          statusBuf[q] |= DoneFlag;
           }
         }
       else
         {
-        // Some pixels may be never processed so, by default, non marked pixels
-        // must be marked as watershed
-        outputIt.SetCenterPixel(wsLabel);
+        fah.Push(sIt->first, q);
+        counter.Seed();
         }
-      // one more pixel done in the init stage
+      }
+    for ( SizeValueType c = 0; c < str.Completed[t]; c++ )
+      {
       progress.CompletedPixel();
       }
-    // flooding
-    // init all the iterators
-    outputIt.GoToBegin();
-    statusIt.GoToBegin();
-    inputIt.GoToBegin();
+    }
+  counter.EndPhase( WatershedFloodStatistics::SeedPhase );
 
-    // and start flooding
+  //---------------------------------------------------------------------------
+  // Meyer's algorithm
+  //---------------------------------------------------------------------------
+  if ( m_MarkWatershedLine )
+    {
+    // flooding
     while ( !fah.empty() )
       {
-      // store the current vars
-      InputImagePixelType currentValue = fah.begin()->first;
-      QueueType           currentQueue = fah.begin()->second;
-      // and remove them from the fah
-      fah.erase( fah.begin() );
+      // move the lowest level out of the fah
+      fah.NextLevel();
 
-      while ( !currentQueue.empty() )
+      while ( !fah.CurrentEmpty() )
         {
-        IndexType idx = currentQueue.front();
-        currentQueue.pop();
-
-        // move the iterators to the right place
-        OffsetType shift = idx - outputIt.GetIndex();
-        outputIt += shift;
-        statusIt += shift;
-        inputIt += shift;
+        TOffset p = fah.PopCurrent();
+        counter.Pop( fah.CurrentPriority() );
+        strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag);
 
         // iterate over the neighbors. If there is only one marker value, give
         // that value to the pixel, else keep it as is (watershed line)
         LabelImagePixelType marker = wsLabel;
         bool                collision = false;
-        for ( noIt = outputIt.Begin(); noIt != outputIt.End(); noIt++ )
+        for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
           {
-          LabelImagePixelType o = noIt.Get();
+          LabelImagePixelType o = outputBuf[p + strides[i]];
           if ( o != wsLabel )
             {
             if ( marker != wsLabel && o != marker )
@@ -288,30 +504,34 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
         if ( !collision )
           {
           // set the marker value
-          outputIt.SetCenterPixel(marker);
+          outputBuf[p] = marker;
           // and propagate to the neighbors
-          for ( niIt = inputIt.Begin(), nsIt = statusIt.Begin();
-                niIt != inputIt.End();
-                niIt++, nsIt++ )
+          for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
             {
-            if ( !nsIt.Get() )
+            TOffset q = static_cast< TOffset >( p + strides[i] );
+            NeighVals[i] = inputBuf[q];
+            NeighOpen[i] = !( statusBuf[q] & DoneFlag );
+            }
+          BatchType::Evaluate(m_PriorityFunctor, inputBuf[p], NeighVals, NeighOpen, Priorities);
+          for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+            {
+            TOffset q = static_cast< TOffset >( p + strides[i] );
+            if ( NeighOpen[i] )
               {
               // the pixel is not yet processed. add it to the fah
-              //InputImagePixelType GrayVal = niIt.Get();
-	      PriorityType priority = m_PriorityFunctor(inputIt.GetCenterPixel(), niIt.Get());
+	      PriorityType priority = Priorities[i];
 
               if ( priority <= 0 )
                 {
-                currentQueue.push( inputIt.GetIndex()
-                                   + niIt.GetNeighborhoodOffset() );
+                fah.PushCurrent(q);
                 }
               else
                 {
-                fah[priority].push( inputIt.GetIndex()
-                                   + niIt.GetNeighborhoodOffset() );
+                fah.Push(priority, q);
                 }
+              counter.Insert();
               // mark it as already in the fah
-              nsIt.Set(true);
+              statusBuf[q] |= DoneFlag;
               }
             }
           }
@@ -326,114 +546,54 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
   //---------------------------------------------------------------------------
   else
     {
-    // first stage:
-    //  - copy markers pixels to output image
-    //  - init FAH with indexes of pixels with background pixel in their
-    //    neighborhood
-
-    ConstantBoundaryCondition< LabelImageType > lcbc2;
-    // outside pixel are watershed so they won't be use to find real watershed
-    // pixels
-    lcbc2.SetConstant( NumericTraits< LabelImagePixelType >::max() );
-    outputIt.OverrideBoundaryCondition(&lcbc2);
-
-    for ( markerIt.GoToBegin(), outputIt.GoToBegin(), inputIt.GoToBegin();
-          !markerIt.IsAtEnd();
-          ++markerIt, ++outputIt )
-      {
-      LabelImagePixelType markerPixel = markerIt.GetCenterPixel();
-      if ( markerPixel != bgLabel )
-        {
-        IndexType  idx = markerIt.GetIndex();
-        OffsetType shift = idx - inputIt.GetIndex();
-        inputIt += shift;
-
-        // this pixels belongs to a marker
-        // copy it to the output image
-        outputIt.SetCenterPixel(markerPixel);
-        // search if it has background pixel in its neighborhood
-        bool haveBgNeighbor = false;
-        for ( nmIt = markerIt.Begin(); nmIt != markerIt.End(); nmIt++ )
-          {
-          if ( nmIt.Get() == bgLabel )
-            {
-            haveBgNeighbor = true;
-            break;
-            }
-          }
-        if ( haveBgNeighbor )
-          {
-          // there is a background pixel in the neighborhood; add to fah
-          fah[0].push( markerIt.GetIndex() );
-          }
-        else
-          {
-          // increase progress because this pixel will not be used in the
-          // flooding stage.
-          progress.CompletedPixel();
-          }
-        }
-      else
-        {
-        outputIt.SetCenterPixel(wsLabel);
-        }
-      progress.CompletedPixel();
-      }
-    // end of init stage
-
     // flooding
-    // init all the iterators
-    outputIt.GoToBegin();
-    inputIt.GoToBegin();
-
-    // and start flooding
     while ( !fah.empty() )
       {
-      // store the current vars
-      InputImagePixelType currentValue = fah.begin()->first;
-      QueueType           currentQueue = fah.begin()->second;
-      // and remove them from the fah
-      fah.erase( fah.begin() );
+      // move the lowest level out of the fah
+      fah.NextLevel();
 
-      while ( !currentQueue.empty() )
+      while ( !fah.CurrentEmpty() )
         {
-        IndexType idx = currentQueue.front();
-        currentQueue.pop();
-
-        // move the iterators to the right place
-        OffsetType shift = idx - outputIt.GetIndex();
-        outputIt += shift;
-        inputIt += shift;
+        TOffset p = fah.PopCurrent();
+        counter.Pop( fah.CurrentPriority() );
+        strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag);
 
-        LabelImagePixelType currentMarker = outputIt.GetCenterPixel();
+        LabelImagePixelType currentMarker = outputBuf[p];
+        for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+          {
+          TOffset q = static_cast< TOffset >( p + strides[i] );
+          NeighVals[i] = inputBuf[q];
+          NeighOpen[i] = ( outputBuf[q] == wsLabel );
+          }
+        BatchType::Evaluate(m_PriorityFunctor, inputBuf[p], NeighVals, NeighOpen, Priorities);
         // get the current value of the pixel
         // iterate over neighbors to propagate the marker
-        for ( noIt = outputIt.Begin(), niIt = inputIt.Begin();
-              noIt != outputIt.End();
-              noIt++, niIt++ )
+        for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
           {
-          if ( noIt.Get() == wsLabel )
+          TOffset q = static_cast< TOffset >( p + strides[i] );
+          if ( NeighOpen[i] )
             {
             // the pixel is not yet processed. It can be labeled with the
             // current label
-            noIt.Set(currentMarker);
-            PriorityType priority = m_PriorityFunctor(inputIt.GetCenterPixel(), niIt.Get());
+            outputBuf[q] = currentMarker;
+            PriorityType priority = Priorities[i];
             if ( priority <= 0 )
               {
-              currentQueue.push( inputIt.GetIndex()
-                                 + noIt.GetNeighborhoodOffset() );
+              fah.PushCurrent(q);
               }
             else
               {
-              fah[priority].push( inputIt.GetIndex()
-				  + noIt.GetNeighborhoodOffset() );
+              fah.Push(priority, q);
               }
+            counter.Insert();
             progress.CompletedPixel();
             }
           }
         }
       }
     }
+  counter.EndPhase( WatershedFloodStatistics::FloodPhase );
+  counter.Finish();
 }
 
 template< class TInputImage, class TLabelImage, class TPriorityFunction >
@@ -445,6 +605,12 @@ DisSimMorphologicalWatershedFromMarkersImageFilter< TInputImage, TLabelImage, TP
 
   os << indent << "FullyConnected: "  << m_FullyConnected << std::endl;
   os << indent << "MarkWatershedLine: "  << m_MarkWatershedLine << std::endl;
+  os << indent << "ReuseBuffers: "  << m_ReuseBuffers << std::endl;
+  os << indent << "CollectStatistics: "  << m_CollectStatistics << std::endl;
+  m_Statistics.Print(os, indent);
+  os << indent << "MemoryLimit: "  << m_MemoryLimit << std::endl;
+  os << indent << "MemoryEstimate: "  << m_MemoryEstimate.Typical << " typical, "
+     << m_MemoryEstimate.Worst << " worst" << std::endl;
 }
 } // end namespace itk
 #endif
@@ -0,0 +1,227 @@
+#ifndef __itkFlatNeighborhood_h
+#define __itkFlatNeighborhood_h
+
+#include "itkConstShapedNeighborhoodIterator.h"
+#include "itkConnectedComponentAlgorithm.h"
+
+namespace itk
+{
+/** \class FlatNeighborhoodSize
+ * \brief The number of neighbours setConnectivity selects in a radius
+ * 1 neighbourhood: 2 per dimension when face connected, 3^d - 1 when
+ * fully connected.
+ */
+template< unsigned int VDimension, bool VFullyConnected >
+class FlatNeighborhoodSize
+{
+public:
+  itkStaticConstMacro(Cube, unsigned int,
+		      3 * ( FlatNeighborhoodSize< VDimension - 1, VFullyConnected >::Cube ));
+  itkStaticConstMacro(Value, unsigned int,
+		      VFullyConnected ? Cube - 1 : 2 * VDimension);
+};
+
+template< bool VFullyConnected >
+class FlatNeighborhoodSize< 0, VFullyConnected >
+{
+public:
+  itkStaticConstMacro(Cube, unsigned int, 1);
+  itkStaticConstMacro(Value, unsigned int, 0);
+};
+
+/** \class FlatNeighborhood
+ * \brief The neighbours selected by setConnectivity, as linear
+ * buffer offsets.
+ *
+ * The flooding loops address pixels by their offset in the image
+ * buffer rather than by index, so that queue entries are single
+ * integers and no neighbourhood iterators need to be moved around
+ * the image. This class holds the buffer strides of the active
+ * neighbours of a radius 1 shaped neighbourhood, in the same order
+ * as the shaped iterators visit them, and enough of the buffer
+ * geometry to check whether a neighbour is inside the buffer.
+ *
+ * The connectivity is a template parameter so that the number of
+ * neighbours, and the size of the tables, are compile time constants
+ * and the loops over the neighbours can be unrolled. The filters
+ * instantiate their flooding code for both settings of
+ * FullyConnected.
+ *
+ * Only pixels in the one pixel thick shell at the edge of the buffer
+ * have neighbours outside it. The filters mark that shell in a
+ * status image, a row at a time (IsBoundaryRow), so that interior
+ * pixels use the stride table directly and only the shell takes the
+ * checked path (GetInsideStrides).
+ *
+ * \author Richard Beare. Department of Medicine, Monash University,
+ * Melbourne, Australia.
+ */
+template< class TImage, bool VFullyConnected >
+class FlatNeighborhood
+{
+public:
+  typedef typename TImage::OffsetType     OffsetType;
+  typedef typename TImage::IndexType      IndexType;
+  typedef typename TImage::RegionType     RegionType;
+  typedef typename TImage::OffsetValueType OffsetValueType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int, TImage::ImageDimension);
+
+  /** The number of neighbours: 4/8 in 2D, 6/26 in 3D */
+  itkStaticConstMacro(Size, unsigned int,
+		      ( FlatNeighborhoodSize< TImage::ImageDimension, VFullyConnected >::Value ));
+
+  /** Set up the neighbour table for the buffered region of image */
+  void Initialize(const TImage *image)
+  {
+    itk::Size< ImageDimension > radius;
+    radius.Fill(1);
+    ConstShapedNeighborhoodIterator< TImage >
+      it( radius, image, image->GetBufferedRegion() );
+    setConnectivity(&it, VFullyConnected);
+
+    const OffsetValueType *offsetTable = image->GetOffsetTable();
+    for ( unsigned d = 0; d < ImageDimension; d++ )
+      {
+      m_Size[d] = image->GetBufferedRegion().GetSize()[d];
+      m_OffsetTable[d] = offsetTable[d];
+      }
+
+    unsigned int i = 0;
+    typename ConstShapedNeighborhoodIterator< TImage >::IndexListType::const_iterator li;
+    for ( li = it.GetActiveIndexList().begin(); li != it.GetActiveIndexList().end(); ++li, ++i )
+      {
+      OffsetType off = it.GetOffset(*li);
+      OffsetValueType stride = 0;
+      for ( unsigned d = 0; d < ImageDimension; d++ )
+        {
+        stride += off[d] * m_OffsetTable[d];
+        }
+      m_Offsets[i] = off;
+      m_Strides[i] = stride;
+      }
+  }
+
+  /** Buffer offset of neighbour i relative to the centre */
+  OffsetValueType GetStride(unsigned int i) const
+  {
+    return m_Strides[i];
+  }
+
+  /** The Size buffer offsets of the neighbours of the pixel at
+   * p. Interior pixels get the stride table without any checks,
+   * pixels flagged as being on the boundary shell the result of
+   * GetInsideStrides. The returned table is only valid until the next
+   * call. */
+  template< class TOffset >
+  const OffsetValueType * GetStrides(TOffset p, bool onBoundary)
+  {
+    if ( !onBoundary )
+      {
+      return m_Strides;
+      }
+    GetInsideStrides(p, m_BoundaryStrides);
+    return m_BoundaryStrides;
+  }
+
+  /** As above, but using the caller's scratch space for boundary
+   * pixels, so that several threads can share the neighbourhood */
+  template< class TOffset >
+  const OffsetValueType * GetStrides(TOffset p, bool onBoundary, OffsetValueType scratch[]) const
+  {
+    if ( !onBoundary )
+      {
+      return m_Strides;
+      }
+    GetInsideStrides(p, scratch);
+    return scratch;
+  }
+
+  /** Offset of neighbour i relative to the centre */
+  const OffsetType & GetOffset(unsigned int i) const
+  {
+    return m_Offsets[i];
+  }
+
+  /** Position of the pixel at buffer offset p, relative to the start
+   * of the buffer */
+  template< class TOffset >
+  void ComputePosition(TOffset p, OffsetValueType pos[]) const
+  {
+    OffsetValueType rem = static_cast< OffsetValueType >( p );
+    for ( int d = ImageDimension - 1; d > 0; d-- )
+      {
+      pos[d] = rem / m_OffsetTable[d];
+      rem -= pos[d] * m_OffsetTable[d];
+      }
+    pos[0] = rem;
+  }
+
+  /** Whether neighbour i of the pixel at pos is inside the buffer */
+  bool IsInside(const OffsetValueType pos[], unsigned int i) const
+  {
+    const OffsetType & off = m_Offsets[i];
+    for ( unsigned d = 0; d < ImageDimension; d++ )
+      {
+      OffsetValueType n = pos[d] + off[d];
+      if ( n < 0 || n >= m_Size[d] )
+        {
+        return false;
+        }
+      }
+    return true;
+  }
+
+  /** The buffer offsets of the neighbours of the pixel at buffer
+   * offset p, in neighbourhood order, with 0 in place of those outside
+   * the buffer. A stride of 0 visits the pixel itself, which has no
+   * effect in the flooding loops as the centre is always done, or a
+   * marker, or unlabelled when its neighbours are visited. strides must
+   * have room for Size values. */
+  template< class TOffset >
+  void GetInsideStrides(TOffset p, OffsetValueType strides[]) const
+  {
+    OffsetValueType pos[ImageDimension];
+    ComputePosition(p, pos);
+    for ( unsigned int i = 0; i < Size; i++ )
+      {
+      strides[i] = IsInside(pos, i) ? m_Strides[i] : 0;
+      }
+  }
+
+  /** The number of pixels in a row of the buffer, along the first
+   * dimension */
+  OffsetValueType GetRowLength() const
+  {
+    return m_Size[0];
+  }
+
+  /** Whether the whole row starting at buffer offset rowStart is on
+   * the boundary shell, i.e. is on a face of the buffer in one of the
+   * other dimensions. The first and last pixels of every row are on
+   * the shell anyway. */
+  template< class TOffset >
+  bool IsBoundaryRow(TOffset rowStart) const
+  {
+    OffsetValueType pos[ImageDimension];
+    ComputePosition(rowStart, pos);
+    for ( unsigned d = 1; d < ImageDimension; d++ )
+      {
+      if ( pos[d] == 0 || pos[d] == m_Size[d] - 1 )
+        {
+        return true;
+        }
+      }
+    return false;
+  }
+
+private:
+  OffsetType      m_Offsets[Size];
+  OffsetValueType m_Strides[Size];
+  OffsetValueType m_BoundaryStrides[Size];
+  OffsetValueType m_Size[ImageDimension];
+  OffsetValueType m_OffsetTable[ImageDimension];
+};
+} // end namespace itk
+
+#endif
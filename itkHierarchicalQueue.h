@@ -0,0 +1,336 @@
+#ifndef __itkHierarchicalQueue_h
+#define __itkHierarchicalQueue_h
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <cmath>
+
+namespace itk
+{
+/** \class HierarchicalQueue
+ * \brief The hierarchical queue (FAH, file d'attente hierarchique)
+ * used by the morphological watershed, keyed on the priority.
+ *
+ * Each priority level is a FIFO. Levels with small integer
+ * priorities live in a contiguous, growing array of buckets indexed
+ * by the priority. Any other priority (fractional, or too far from
+ * the others for the array) goes into a sorted index of levels. The
+ * FIFOs are chains of fixed size chunks taken from storage shared by
+ * all levels, so that moving a level around only moves a few
+ * integers and emptied chunks are reused.
+ *
+ * The shared storage is allocated from TAllocator in blocks of
+ * chunks, so it can be put somewhere other than the heap, and growing
+ * it never moves the values already stored.
+ *
+ * Levels are consumed one at a time: NextLevel() moves the lowest
+ * level into the current FIFO, which is then drained with
+ * PopCurrent() and can be extended with PushCurrent(). Pushing to the
+ * level being processed starts a new level of that priority, as with
+ * the map of queues it replaces.
+ *
+ * \author Richard Beare. Department of Medicine, Monash University,
+ * Melbourne, Australia.
+ */
+template< class TPriority, class TValue, class TAllocator = std::allocator< TValue > >
+class HierarchicalQueue
+{
+public:
+  explicit HierarchicalQueue(const TAllocator & allocator = TAllocator()) :
+    m_Allocator(allocator), m_FreeChunk(NoChunk), m_Base(0), m_Lowest(0),
+    m_NumberOfLevels(0), m_CurrentPriority()
+  {}
+
+  ~HierarchicalQueue()
+  {
+    for ( size_t b = 0; b < m_Blocks.size(); ++b )
+      {
+      m_Allocator.deallocate(m_Blocks[b], BlockChunks * ChunkSize);
+      }
+  }
+
+  /** true when no level is waiting, ignoring the current FIFO */
+  bool empty() const
+  {
+    return m_NumberOfLevels == 0;
+  }
+
+  /** add a value to the end of a priority level */
+  void Push(TPriority priority, TValue value)
+  {
+    long bucket;
+    if ( IsBucket(priority, bucket) )
+      {
+      Fifo & level = m_Buckets[bucket];
+      if ( level.Size == 0 )
+        {
+        ++m_NumberOfLevels;
+        if ( bucket < m_Lowest )
+          {
+          m_Lowest = bucket;
+          }
+        }
+      PushBack(level, value);
+      }
+    else
+      {
+      Fifo & level = m_Sorted[priority];
+      if ( level.Size == 0 )
+        {
+        ++m_NumberOfLevels;
+        }
+      PushBack(level, value);
+      }
+  }
+
+  /** make the lowest level the current FIFO, removing it from the
+   * queue. Any values left in the current FIFO are discarded. */
+  void NextLevel()
+  {
+    Release(m_Current);
+    // lowest non empty bucket
+    const long nb = static_cast< long >( m_Buckets.size() );
+    while ( m_Lowest < nb && m_Buckets[m_Lowest].Size == 0 )
+      {
+      ++m_Lowest;
+      }
+    const bool haveBucket = m_Lowest < nb;
+    const bool haveSorted = !m_Sorted.empty();
+    if ( haveBucket
+         && ( !haveSorted || BucketPriority(m_Lowest) < m_Sorted.begin()->first ) )
+      {
+      m_Current = m_Buckets[m_Lowest];
+      m_CurrentPriority = BucketPriority(m_Lowest);
+      m_Buckets[m_Lowest] = Fifo();
+      }
+    else
+      {
+      typename SortedType::iterator it = m_Sorted.begin();
+      m_Current = it->second;
+      m_CurrentPriority = it->first;
+      m_Sorted.erase(it);
+      }
+    --m_NumberOfLevels;
+  }
+
+  bool CurrentEmpty() const
+  {
+    return m_Current.Size == 0;
+  }
+
+  /** the priority of the current FIFO, valid after NextLevel() */
+  TPriority CurrentPriority() const
+  {
+    return m_CurrentPriority;
+  }
+
+  /** take the value at the front of the current FIFO */
+  TValue PopCurrent()
+  {
+    Fifo & f = m_Current;
+    TValue value = Chunk(f.Head)[f.HeadPos];
+    ++f.HeadPos;
+    --f.Size;
+    if ( f.Size == 0 )
+      {
+      Release(f);
+      }
+    else if ( f.HeadPos == ChunkSize )
+      {
+      unsigned int next = m_NextChunk[f.Head];
+      FreeChunk(f.Head);
+      f.Head = next;
+      f.HeadPos = 0;
+      }
+    return value;
+  }
+
+  /** add a value to the end of the current FIFO */
+  void PushCurrent(TValue value)
+  {
+    PushBack(m_Current, value);
+  }
+
+  /** bytes used with entries values queued at once, in at most
+   * levels priority levels. Every level may hold a part used chunk,
+   * and its FIFO is a node of the sorted index at worst. */
+  static double Footprint(double entries, double levels)
+  {
+    const double chunks = std::ceil( entries / ChunkSize ) + levels;
+    return chunks * ( ChunkSize * sizeof( TValue ) + sizeof( unsigned int ) )
+      + levels * ( 4 * sizeof( void * ) + sizeof( TPriority ) + sizeof( Fifo ) );
+  }
+
+private:
+  // purposely not implemented
+  HierarchicalQueue(const HierarchicalQueue &);
+  void operator=(const HierarchicalQueue &);
+
+  // values per chunk
+  static const unsigned int ChunkSize = 256;
+  // chunks per block of storage
+  static const unsigned int BlockShift = 6;
+  static const unsigned int BlockChunks = 1 << BlockShift;
+  static const unsigned int NoChunk = static_cast< unsigned int >( -1 );
+  // widest range of integer priorities kept in the bucket array
+  static const long MaxBuckets = 1L << 20;
+
+  // a FIFO is a chain of chunks. Values are read at HeadPos in the
+  // head chunk and written at TailPos in the tail chunk.
+  struct Fifo {
+    Fifo() : Head(NoChunk), Tail(NoChunk), HeadPos(0), TailPos(0), Size(0) {}
+    unsigned int Head;
+    unsigned int Tail;
+    unsigned int HeadPos;
+    unsigned int TailPos;
+    size_t       Size;
+  };
+
+  typedef std::map< TPriority, Fifo > SortedType;
+
+  TAllocator                  m_Allocator;
+  std::vector< TValue * >     m_Blocks;
+  std::vector< unsigned int > m_NextChunk;
+  unsigned int                m_FreeChunk;
+
+  // bucket i holds priority m_Base + i
+  std::vector< Fifo > m_Buckets;
+  long                m_Base;
+  long                m_Lowest;
+  SortedType          m_Sorted;
+  size_t              m_NumberOfLevels;
+  Fifo                m_Current;
+  TPriority           m_CurrentPriority;
+
+  TPriority BucketPriority(long bucket) const
+  {
+    return static_cast< TPriority >( m_Base + bucket );
+  }
+
+  // whether priority goes into the bucket array, growing it if
+  // needed, and which bucket
+  bool IsBucket(TPriority priority, long & bucket)
+  {
+    const double p = static_cast< double >( priority );
+    if ( !( p == std::floor(p) ) || std::fabs(p) > static_cast< double >( MaxBuckets ) )
+      {
+      return false;
+      }
+    const long key = static_cast< long >( p );
+    if ( m_Buckets.empty() )
+      {
+      m_Base = key;
+      m_Lowest = 0;
+      }
+    if ( key < m_Base )
+      {
+      // grow downwards, which should be rare
+      const long extra = m_Base - key;
+      if ( extra + static_cast< long >( m_Buckets.size() ) > MaxBuckets )
+        {
+        return false;
+        }
+      m_Buckets.insert( m_Buckets.begin(), extra, Fifo() );
+      m_Base = key;
+      m_Lowest += extra;
+      }
+    bucket = key - m_Base;
+    if ( bucket >= static_cast< long >( m_Buckets.size() ) )
+      {
+      if ( bucket >= MaxBuckets )
+        {
+        return false;
+        }
+      size_t n = m_Buckets.size() * 2;
+      if ( n <= static_cast< size_t >( bucket ) )
+        {
+        n = bucket + 1;
+        }
+      m_Buckets.resize(n);
+      }
+    return true;
+  }
+
+  TValue * Chunk(unsigned int c) const
+  {
+    return m_Blocks[c >> BlockShift] + ( c & ( BlockChunks - 1 ) ) * ChunkSize;
+  }
+
+  unsigned int NewChunk()
+  {
+    unsigned int c;
+    if ( m_FreeChunk != NoChunk )
+      {
+      c = m_FreeChunk;
+      m_FreeChunk = m_NextChunk[c];
+      }
+    else
+      {
+      c = static_cast< unsigned int >( m_NextChunk.size() );
+      if ( ( c >> BlockShift ) == m_Blocks.size() )
+        {
+        m_Blocks.push_back( m_Allocator.allocate(BlockChunks * ChunkSize) );
+        }
+      m_NextChunk.push_back(NoChunk);
+      }
+    m_NextChunk[c] = NoChunk;
+    return c;
+  }
+
+  void FreeChunk(unsigned int c)
+  {
+    m_NextChunk[c] = m_FreeChunk;
+    m_FreeChunk = c;
+  }
+
+  void PushBack(Fifo & f, TValue value)
+  {
+    if ( f.Tail == NoChunk )
+      {
+      f.Head = f.Tail = NewChunk();
+      f.HeadPos = f.TailPos = 0;
+      }
+    else if ( f.TailPos == ChunkSize )
+      {
+      unsigned int c = NewChunk();
+      m_NextChunk[f.Tail] = c;
+      f.Tail = c;
+      f.TailPos = 0;
+      }
+    Chunk(f.Tail)[f.TailPos] = value;
+    ++f.TailPos;
+    ++f.Size;
+  }
+
+  // give all chunks of a FIFO back and empty it
+  void Release(Fifo & f)
+  {
+    unsigned int c = f.Head;
+    while ( c != NoChunk )
+      {
+      unsigned int next = m_NextChunk[c];
+      FreeChunk(c);
+      if ( c == f.Tail )
+        {
+        break;
+        }
+      c = next;
+      }
+    f = Fifo();
+  }
+};
+
+template< class TPriority, class TValue, class TAllocator >
+const unsigned int HierarchicalQueue< TPriority, TValue, TAllocator >::ChunkSize;
+template< class TPriority, class TValue, class TAllocator >
+const unsigned int HierarchicalQueue< TPriority, TValue, TAllocator >::BlockShift;
+template< class TPriority, class TValue, class TAllocator >
+const unsigned int HierarchicalQueue< TPriority, TValue, TAllocator >::BlockChunks;
+template< class TPriority, class TValue, class TAllocator >
+const unsigned int HierarchicalQueue< TPriority, TValue, TAllocator >::NoChunk;
+template< class TPriority, class TValue, class TAllocator >
+const long HierarchicalQueue< TPriority, TValue, TAllocator >::MaxBuckets;
+} // end namespace itk
+
+#endif
@@ -0,0 +1,458 @@
+#ifndef __itkIFTGradientPriority_h
+#define __itkIFTGradientPriority_h
+
+#include "itkIFTWatershedFromMarkersBaseImageFilter.h"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+namespace itk
+{
+namespace Functor
+{
+/** \class IFTGradientPriority
+ * \brief Watershed priority on a gradient magnitude worked out from
+ * the input as the flood reaches it.
+ *
+ * Replaces a gradient filter in front of the IFT watershed with
+ * IFTWSPriority: the cost of a step is the gradient magnitude of the
+ * pixel stepped to, but no gradient image is made. IFTFloodValues
+ * computes the gradient a tile at a time, the first time the flood
+ * needs a pixel of the tile, and drops the tile once all its pixels
+ * are done. Tiles the flood doesn't reach, or only holding the
+ * insides of markers, are never computed.
+ *
+ * Gaussian is a derivative of Gaussian gradient at scale Sigma, in
+ * physical units, with the kernels cut off at 4 sigma. It is close to
+ * GradientMagnitudeRecursiveGaussianImageFilter but not the same, as
+ * that is a recursive approximation run over the whole image.
+ * Morphological is a dilation less an erosion by a box of Radius
+ * pixels, which is what MorphologicalGradientImageFilter gives with a
+ * box kernel.
+ */
+template< class TInput1, class TOutput = TInput1 >
+class IFTGradientPriority
+{
+public:
+  typedef enum { Gaussian, Morphological } MethodType;
+
+  IFTGradientPriority() : m_Method(Gaussian), m_Sigma(1), m_Radius(1) {}
+  ~IFTGradientPriority() {}
+  bool operator!=(const IFTGradientPriority & other) const
+  {
+    return m_Method != other.m_Method || m_Sigma != other.m_Sigma || m_Radius != other.m_Radius;
+  }
+
+  bool operator==(const IFTGradientPriority & other) const
+  {
+    return !( *this != other );
+  }
+
+  // A is the centre pixel, B the neighbour, both gradient magnitudes
+  inline TOutput operator()(const TInput1 &, const TInput1 & B) const
+  {
+    return static_cast< TOutput >( B );
+  }
+
+  void SetMethod(MethodType method) { m_Method = method; }
+  MethodType GetMethod() const { return m_Method; }
+
+  void SetSigma(double sigma) { m_Sigma = sigma; }
+  double GetSigma() const { return m_Sigma; }
+
+  void SetRadius(unsigned int radius) { m_Radius = radius; }
+  unsigned int GetRadius() const { return m_Radius; }
+
+private:
+  MethodType   m_Method;
+  double       m_Sigma;
+  unsigned int m_Radius;
+};
+}
+
+// the gradient magnitudes are cast to the pixel type, as the
+// gradient filters write them
+template< class TInput1, class TOutput, class TInputPixel >
+class IFTPriorityFunctorTraits< Functor::IFTGradientPriority< TInput1, TOutput >, TInputPixel >
+{
+public:
+  typedef TInput1 CostType;
+};
+
+/** The gradient magnitudes of IFTGradientPriority, kept in tiles of
+ * whole rows that are computed when first asked for and dropped when
+ * all their pixels are done. Each tile is worked out from the input
+ * around it, clamped at the image edges, by separable passes. */
+template< class TInput1, class TOutput, class TInputImage >
+class IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+{
+public:
+  typedef Functor::IFTGradientPriority< TInput1, TOutput > FunctorType;
+  typedef typename TInputImage::PixelType                  ValueType;
+  typedef typename TInputImage::RegionType                 RegionType;
+  itkStaticConstMacro(OnDemand, bool, true);
+  itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension);
+
+  IFTFloodValues(const TInputImage *image, const FunctorType & functor);
+
+  ValueType operator[](SizeValueType p)
+  {
+    const SizeValueType row = p / m_RowLength;
+    if ( !m_Rows[row] )
+      {
+      this->Compute( m_RowTile[row] );
+      }
+    return m_Rows[row][p - row * m_RowLength];
+  }
+
+  void SetDone(SizeValueType p)
+  {
+    const unsigned int tile = m_RowTile[p / m_RowLength];
+    if ( --m_Open[tile] == 0 )
+      {
+      this->Release(tile);
+      }
+  }
+
+  /** every tile in memory at once, and the tables, give or take the
+   * scratch of one tile */
+  static double Footprint(const RegionType & region)
+  {
+    const double numberOfPixels = static_cast< double >( region.GetNumberOfPixels() );
+    const double rows = numberOfPixels / region.GetSize(0);
+    return numberOfPixels * sizeof( ValueType )
+      + rows * ( sizeof( ValueType * ) + sizeof( unsigned int ) + sizeof( std::vector< ValueType > ) );
+  }
+
+  /** the tiles computed so far, counting those computed again */
+  SizeValueType GetNumberOfComputedTiles() const { return m_NumberOfComputedTiles; }
+  SizeValueType GetNumberOfTiles() const { return m_Tiles.size(); }
+
+private:
+  typedef std::vector< double > BufferType;
+
+  // a weighted sum along an axis, and the maximum and minimum
+  class SumPass {
+  public:
+    explicit SumPass(const std::vector< double > & weights) : m_Weights( weights ) {}
+    void First(double *out, const double *in, SizeValueType n) const
+    {
+      const double w = m_Weights[0];
+      for ( SizeValueType j = 0; j < n; j++ ) { out[j] = w * in[j]; }
+    }
+    void Next(double *out, const double *in, SizeValueType n, unsigned int k) const
+    {
+      const double w = m_Weights[k];
+      for ( SizeValueType j = 0; j < n; j++ ) { out[j] += w * in[j]; }
+    }
+  private:
+    const std::vector< double > & m_Weights;
+  };
+
+  class MaxPass {
+  public:
+    void First(double *out, const double *in, SizeValueType n) const
+    {
+      std::copy( in, in + n, out );
+    }
+    void Next(double *out, const double *in, SizeValueType n, unsigned int) const
+    {
+      for ( SizeValueType j = 0; j < n; j++ ) { out[j] = std::max( out[j], in[j] ); }
+    }
+  };
+
+  class MinPass {
+  public:
+    void First(double *out, const double *in, SizeValueType n) const
+    {
+      std::copy( in, in + n, out );
+    }
+    void Next(double *out, const double *in, SizeValueType n, unsigned int) const
+    {
+      for ( SizeValueType j = 0; j < n; j++ ) { out[j] = std::min( out[j], in[j] ); }
+    }
+  };
+
+  // out is in combined over the 2 radius + 1 values around each
+  // along axis d, which shrinks by 2 radius
+  template< class TPass >
+  static void Pass(const BufferType & in, SizeValueType *size, unsigned int d, unsigned int radius,
+		   const TPass & pass, BufferType & out)
+  {
+    SizeValueType inner = 1, outer = 1;
+    for ( unsigned int e = 0; e < d; e++ ) { inner *= size[e]; }
+    for ( unsigned int e = d + 1; e < ImageDimension; e++ ) { outer *= size[e]; }
+    const SizeValueType length = size[d] - 2 * radius;
+    out.resize( outer * length * inner );
+    for ( SizeValueType o = 0; o < outer; o++ )
+      {
+      for ( SizeValueType i = 0; i < length; i++ )
+	{
+	double       *dst = &out[( o * length + i ) * inner];
+	const double *src = &in[( o * size[d] + i ) * inner];
+	pass.First( dst, src, inner );
+	for ( unsigned int k = 1; k <= 2 * radius; k++ )
+	  {
+	  pass.Next( dst, src + k * inner, inner, k );
+	  }
+	}
+      }
+    size[d] = length;
+  }
+
+  void Compute(unsigned int tile);
+  void Release(unsigned int tile);
+
+  // the first row, and the number of rows along each axis, of a tile
+  void TileRows(unsigned int tile, SizeValueType *start, SizeValueType *size) const;
+
+  // point the rows of a tile at its values, or at nothing
+  void PointRows(unsigned int tile, const ValueType *values);
+
+  const ValueType *m_Input;
+  FunctorType      m_Functor;
+  SizeValueType    m_Size[ImageDimension];
+  SizeValueType    m_RowLength;
+  unsigned int     m_Radius[ImageDimension];
+  SizeValueType    m_TileSize[ImageDimension];
+  SizeValueType    m_TileCount[ImageDimension];
+  // the gaussian and its derivative along each axis
+  std::vector< double > m_Gaussian[ImageDimension];
+  std::vector< double > m_Derivative[ImageDimension];
+
+  std::vector< const ValueType * >      m_Rows;
+  std::vector< unsigned int >           m_RowTile;
+  std::vector< std::vector< ValueType > > m_Tiles;
+  std::vector< SizeValueType >          m_Open;
+  SizeValueType                         m_NumberOfComputedTiles;
+};
+
+template< class TInput1, class TOutput, class TInputImage >
+IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+::IFTFloodValues(const TInputImage *image, const FunctorType & functor) :
+  m_Input( image->GetBufferPointer() ), m_Functor( functor ), m_NumberOfComputedTiles(0)
+{
+  const RegionType region = image->GetBufferedRegion();
+  for ( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_Size[d] = region.GetSize(d);
+    if ( m_Functor.GetMethod() == FunctorType::Morphological )
+      {
+      m_Radius[d] = m_Functor.GetRadius();
+      continue;
+      }
+    // the kernels, cut off at 4 sigma. The derivative gives 1 on a
+    // ramp of one unit per pixel, and is scaled to physical units.
+    const double sigma = m_Functor.GetSigma() / image->GetSpacing()[d];
+    m_Radius[d] = std::max( static_cast< unsigned int >( std::ceil( 4 * sigma ) ), 1u );
+    const int r = m_Radius[d];
+    std::vector< double > & g = m_Gaussian[d];
+    std::vector< double > & dg = m_Derivative[d];
+    g.resize( 2 * r + 1 );
+    dg.resize( 2 * r + 1 );
+    double sum = 0, moment = 0;
+    for ( int k = -r; k <= r; k++ )
+      {
+      g[k + r] = std::exp( -0.5 * k * k / ( sigma * sigma ) );
+      sum += g[k + r];
+      moment += k * k * g[k + r];
+      }
+    for ( int k = -r; k <= r; k++ )
+      {
+      dg[k + r] = k * g[k + r] / ( moment * image->GetSpacing()[d] );
+      g[k + r] /= sum;
+      }
+    }
+  m_RowLength = m_Size[0];
+
+  // tiles of whole rows, at least 16 along the other axes, or twice
+  // the radius so that the input read around a tile, the tile and the
+  // radius on either side, is at most twice its size along each. Along
+  // the rows only the radius is added to the whole row.
+  SizeValueType numberOfTiles = 1, numberOfRows = 1;
+  m_TileSize[0] = m_Size[0];
+  m_TileCount[0] = 1;
+  for ( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    m_TileSize[d] = std::min( m_Size[d], std::max( static_cast< SizeValueType >( 16 ),
+						   static_cast< SizeValueType >( 2 * m_Radius[d] ) ) );
+    m_TileCount[d] = ( m_Size[d] + m_TileSize[d] - 1 ) / m_TileSize[d];
+    numberOfTiles *= m_TileCount[d];
+    numberOfRows *= m_Size[d];
+    }
+
+  m_Rows.assign( numberOfRows, 0 );
+  m_RowTile.resize( numberOfRows );
+  m_Tiles.resize( numberOfTiles );
+  m_Open.assign( numberOfTiles, 0 );
+  for ( SizeValueType row = 0; row < numberOfRows; row++ )
+    {
+    SizeValueType rest = row, tile = 0, scale = 1;
+    for ( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      tile += ( rest % m_Size[d] ) / m_TileSize[d] * scale;
+      rest /= m_Size[d];
+      scale *= m_TileCount[d];
+      }
+    m_RowTile[row] = static_cast< unsigned int >( tile );
+    m_Open[tile] += m_RowLength;
+    }
+}
+
+template< class TInput1, class TOutput, class TInputImage >
+void
+IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+::TileRows(unsigned int tile, SizeValueType *start, SizeValueType *size) const
+{
+  start[0] = 0;
+  size[0] = m_Size[0];
+  SizeValueType rest = tile;
+  for ( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    start[d] = rest % m_TileCount[d] * m_TileSize[d];
+    size[d] = std::min( m_TileSize[d], m_Size[d] - start[d] );
+    rest /= m_TileCount[d];
+    }
+}
+
+template< class TInput1, class TOutput, class TInputImage >
+void
+IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+::PointRows(unsigned int tile, const ValueType *values)
+{
+  SizeValueType start[ImageDimension], size[ImageDimension], index[ImageDimension];
+  this->TileRows( tile, start, size );
+  std::fill( index, index + ImageDimension, 0 );
+  SizeValueType numberOfRows = 1;
+  for ( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    numberOfRows *= size[d];
+    }
+  for ( SizeValueType r = 0; r < numberOfRows; r++ )
+    {
+    SizeValueType row = 0, stride = 1;
+    for ( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      row += ( start[d] + index[d] ) * stride;
+      stride *= m_Size[d];
+      }
+    m_Rows[row] = values ? values + r * m_RowLength : 0;
+    for ( unsigned int d = 1; d < ImageDimension && ++index[d] == size[d]; d++ )
+      {
+      index[d] = 0;
+      }
+    }
+}
+
+template< class TInput1, class TOutput, class TInputImage >
+void
+IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+::Compute(unsigned int tile)
+{
+  SizeValueType start[ImageDimension], size[ImageDimension], block[ImageDimension];
+  this->TileRows( tile, start, size );
+
+  // the input around the tile, the edge pixels repeated outside the
+  // image
+  SizeValueType blockPixels = 1, tilePixels = 1;
+  for ( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    block[d] = size[d] + 2 * m_Radius[d];
+    blockPixels *= block[d];
+    tilePixels *= size[d];
+    }
+  BufferType input( blockPixels );
+  SizeValueType index[ImageDimension];
+  std::fill( index, index + ImageDimension, 0 );
+  for ( SizeValueType b = 0; b < blockPixels; b += block[0] )
+    {
+    SizeValueType offset = 0, stride = m_Size[0];
+    for ( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      const OffsetValueType i = static_cast< OffsetValueType >( start[d] + index[d] )
+	- static_cast< OffsetValueType >( m_Radius[d] );
+      offset += std::min( static_cast< SizeValueType >( std::max( i, OffsetValueType(0) ) ), m_Size[d] - 1 ) * stride;
+      stride *= m_Size[d];
+      }
+    for ( SizeValueType x = 0; x < block[0]; x++ )
+      {
+      const OffsetValueType i = static_cast< OffsetValueType >( x ) - static_cast< OffsetValueType >( m_Radius[0] );
+      input[b + x] = m_Input[offset + std::min( static_cast< SizeValueType >( std::max( i, OffsetValueType(0) ) ),
+						m_Size[0] - 1 )];
+      }
+    for ( unsigned int d = 1; d < ImageDimension && ++index[d] == block[d]; d++ )
+      {
+      index[d] = 0;
+      }
+    }
+
+  std::vector< ValueType > & values = m_Tiles[tile];
+  values.resize( tilePixels );
+  BufferType    a;
+  SizeValueType s[ImageDimension];
+  if ( m_Functor.GetMethod() == FunctorType::Morphological )
+    {
+    std::copy( block, block + ImageDimension, s );
+    BufferType top = input;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      Pass( top, s, d, m_Radius[d], MaxPass(), a );
+      top.swap( a );
+      }
+    std::copy( block, block + ImageDimension, s );
+    BufferType & bottom = input;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      Pass( bottom, s, d, m_Radius[d], MinPass(), a );
+      bottom.swap( a );
+      }
+    for ( SizeValueType p = 0; p < tilePixels; p++ )
+      {
+      values[p] = static_cast< ValueType >( static_cast< ValueType >( top[p] ) - static_cast< ValueType >( bottom[p] ) );
+      }
+    }
+  else
+    {
+    // the derivative along each axis, with the gaussian along the
+    // others
+    BufferType squares( tilePixels, 0.0 );
+    BufferType b;
+    for ( unsigned int axis = 0; axis < ImageDimension; axis++ )
+      {
+      std::copy( block, block + ImageDimension, s );
+      b = input;
+      for ( unsigned int d = 0; d < ImageDimension; d++ )
+	{
+	Pass( b, s, d, m_Radius[d], SumPass( d == axis ? m_Derivative[d] : m_Gaussian[d] ), a );
+	b.swap( a );
+	}
+      for ( SizeValueType p = 0; p < tilePixels; p++ )
+	{
+	squares[p] += b[p] * b[p];
+	}
+      }
+    for ( SizeValueType p = 0; p < tilePixels; p++ )
+      {
+      values[p] = static_cast< ValueType >( std::sqrt( squares[p] ) );
+      }
+    }
+
+  this->PointRows( tile, &values[0] );
+  ++m_NumberOfComputedTiles;
+}
+
+template< class TInput1, class TOutput, class TInputImage >
+void
+IFTFloodValues< Functor::IFTGradientPriority< TInput1, TOutput >, TInputImage >
+::Release(unsigned int tile)
+{
+  if ( m_Tiles[tile].empty() )
+    {
+    return;
+    }
+  this->PointRows( tile, 0 );
+  std::vector< ValueType >().swap( m_Tiles[tile] );
+}
+} // end namespace itk
+
+#endif
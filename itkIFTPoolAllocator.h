@@ -0,0 +1,253 @@
+/* Node allocation for the tree based IFT queues (IFTQueueA and
+* IFTQueueB). Every insert and erase on those queues allocates or
+* frees std::map and std::list nodes, which on large images means a
+* lot of malloc traffic. The arena below carves nodes out of large
+* slabs, recycles freed nodes through per size free lists and gives
+* all the memory back in one go when it is destroyed.
+*/
+
+#ifndef _itk_IFTPoolAllocator_h_
+#define _itk_IFTPoolAllocator_h_
+
+#include <vector>
+#include <cstddef>
+#include <new>
+
+// counters describing what an arena has done, for reporting
+class IFTArenaStatistics {
+public:
+  IFTArenaStatistics() :
+    NumberOfAllocations(0), NumberOfDeallocations(0),
+    NumberOfSlabAllocations(0), PeakSize(0) {}
+
+  // allocate/deallocate calls made by the containers
+  size_t NumberOfAllocations;
+  size_t NumberOfDeallocations;
+  // calls to the system allocator to get new slabs
+  size_t NumberOfSlabAllocations;
+  // largest number of bytes held in slabs
+  size_t PeakSize;
+};
+
+class IFTNodeArena {
+public:
+  IFTNodeArena() : SlabNodes(1024), Size(0) {}
+
+  ~IFTNodeArena(){
+    Release();
+  }
+
+  // set the number of nodes per slab from the number of values
+  // (pixels) that may be queued. Queues normally only hold the flood
+  // front, so a fraction of the pixel count is used.
+  inline void Reserve( size_t numberOfValues ){
+    size_t n = numberOfValues / 64;
+    if ( n < 1024 )
+      {
+      n = 1024;
+      }
+    if ( n > (1 << 20) )
+      {
+      n = (1 << 20);
+      }
+    SlabNodes = n;
+  }
+
+  // a node of the given size
+  inline void * allocate( size_t bytes ){
+    ++Stats.NumberOfAllocations;
+    Pool & pool = GetPool( bytes );
+    if ( !pool.FreeList )
+      {
+      grow( pool );
+      }
+    FreeNode * node = pool.FreeList;
+    pool.FreeList = node->Next;
+    return node;
+  }
+
+  // give a node back to its free list
+  inline void deallocate( void * p, size_t bytes ){
+    ++Stats.NumberOfDeallocations;
+    Pool & pool = GetPool( bytes );
+    FreeNode * node = static_cast<FreeNode *>( p );
+    node->Next = pool.FreeList;
+    pool.FreeList = node;
+  }
+
+  // free all slabs at once. Nodes handed out are invalid afterwards.
+  inline void Release(){
+    for (size_t i = 0; i < Slabs.size(); ++i)
+      {
+      ::operator delete( Slabs[i] );
+      }
+    Slabs.clear();
+    Pools.clear();
+    Size = 0;
+  }
+
+  // bytes currently held in slabs
+  inline size_t GetSize() const {
+    return Size;
+  }
+
+  inline const IFTArenaStatistics & GetStatistics() const {
+    return Stats;
+  }
+
+private:
+  // freed nodes are threaded through their own storage
+  struct FreeNode {
+    FreeNode * Next;
+  };
+
+  // a free list per node size. Containers only use a couple of node
+  // types, so a linear search is fine.
+  struct Pool {
+    size_t NodeSize;
+    FreeNode * FreeList;
+  };
+
+  size_t SlabNodes;
+  size_t Size;
+  std::vector<void *> Slabs;
+  std::vector<Pool> Pools;
+  IFTArenaStatistics Stats;
+
+  // keep nodes aligned for anything the containers may store
+  static size_t RoundUp( size_t bytes ){
+    const size_t align = 2 * sizeof(void *) > sizeof(double) ? 2 * sizeof(void *) : sizeof(double);
+    if ( bytes < sizeof(FreeNode) )
+      {
+      bytes = sizeof(FreeNode);
+      }
+    return ( ( bytes + align - 1 ) / align ) * align;
+  }
+
+  inline Pool & GetPool( size_t bytes ){
+    bytes = RoundUp( bytes );
+    for (size_t i = 0; i < Pools.size(); ++i)
+      {
+      if ( Pools[i].NodeSize == bytes )
+        {
+        return Pools[i];
+        }
+      }
+    Pool pool;
+    pool.NodeSize = bytes;
+    pool.FreeList = 0;
+    Pools.push_back( pool );
+    return Pools.back();
+  }
+
+  void grow( Pool & pool ){
+    const size_t bytes = pool.NodeSize * SlabNodes;
+    char * slab = static_cast<char *>( ::operator new( bytes ) );
+    Slabs.push_back( slab );
+    ++Stats.NumberOfSlabAllocations;
+    Size += bytes;
+    if ( Size > Stats.PeakSize )
+      {
+      Stats.PeakSize = Size;
+      }
+    // thread the new nodes onto the free list, lowest address first
+    for (size_t i = SlabNodes; i > 0; --i)
+      {
+      FreeNode * node = reinterpret_cast<FreeNode *>( slab + ( i - 1 ) * pool.NodeSize );
+      node->Next = pool.FreeList;
+      pool.FreeList = node;
+      }
+  }
+};
+
+// standard allocator interface on top of an IFTNodeArena. Single
+// objects (container nodes) come from the arena, anything else, or
+// everything when no arena has been given, from operator new.
+template< typename T >
+class IFTPoolAllocator {
+public:
+  typedef T              value_type;
+  typedef T *            pointer;
+  typedef const T *      const_pointer;
+  typedef T &            reference;
+  typedef const T &      const_reference;
+  typedef size_t         size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template< typename U >
+  struct rebind {
+    typedef IFTPoolAllocator<U> other;
+  };
+
+  IFTPoolAllocator() : Arena(0) {}
+
+  explicit IFTPoolAllocator( IFTNodeArena * arena ) : Arena(arena) {}
+
+  template< typename U >
+  IFTPoolAllocator( const IFTPoolAllocator<U> & other ) : Arena(other.GetArena()) {}
+
+  inline pointer address( reference x ) const { return &x; }
+  inline const_pointer address( const_reference x ) const { return &x; }
+
+  inline pointer allocate( size_type n, const void * = 0 ){
+    if ( Arena && n == 1 )
+      {
+      return static_cast<pointer>( Arena->allocate( sizeof(T) ) );
+      }
+    return static_cast<pointer>( ::operator new( n * sizeof(T) ) );
+  }
+
+  inline void deallocate( pointer p, size_type n ){
+    if ( Arena && n == 1 )
+      {
+      Arena->deallocate( p, sizeof(T) );
+      return;
+      }
+    ::operator delete( p );
+  }
+
+  inline size_type max_size() const {
+    return size_type(-1) / sizeof(T);
+  }
+
+  inline void construct( pointer p, const T & val ){
+    new( static_cast<void *>( p ) ) T( val );
+  }
+
+  inline void destroy( pointer p ){
+    p->~T();
+  }
+
+  inline IFTNodeArena * GetArena() const {
+    return Arena;
+  }
+
+private:
+  IFTNodeArena * Arena;
+};
+
+template< typename T, typename U >
+inline bool operator==( const IFTPoolAllocator<T> & a, const IFTPoolAllocator<U> & b ){
+  return a.GetArena() == b.GetArena();
+}
+
+template< typename T, typename U >
+inline bool operator!=( const IFTPoolAllocator<T> & a, const IFTPoolAllocator<U> & b ){
+  return a.GetArena() != b.GetArena();
+}
+
+// how a queue makes an allocator for its own arena. Allocators
+// other than IFTPoolAllocator ignore the arena.
+template< typename TAllocator >
+class IFTAllocatorForArena {
+public:
+  static TAllocator New( IFTNodeArena * ) { return TAllocator(); }
+};
+
+template< typename T >
+class IFTAllocatorForArena< IFTPoolAllocator<T> > {
+public:
+  static IFTPoolAllocator<T> New( IFTNodeArena * arena ) { return IFTPoolAllocator<T>( arena ); }
+};
+
+#endif
@@ -19,9 +19,23 @@
 
 #include <map>
 #include <list>
+#include <vector>
+#include <algorithm>
 #include <iostream>
+#include <cstring>
+#include "itkIFTPoolAllocator.h"
 
-template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey>, typename TValueComp=std::less<TValue> >
+// rough sizes of the nodes of std::map and std::list holding a T, for
+// the Footprint of the queues: a red-black tree node has a colour and
+// three links, a list node two links
+template< typename T >
+inline double IFTTreeNodeBytes() { return 4 * sizeof(void *) + sizeof(T); }
+
+template< typename T >
+inline double IFTListNodeBytes() { return 2 * sizeof(void *) + sizeof(T); }
+
+template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey>, typename TValueComp=std::less<TValue>,
+          typename TAllocator=std::allocator<TValue> >
 class IFTQueueA {
 public:
   // this is modified from "mutable_priority_queue" that I found
@@ -31,24 +45,34 @@ public:
   // different to the map of queues used in the standard watershed implementation.
   // Also, values are image locations, which are unique, and therefore
   // we don't need the multimap for the reverse lookup.
+  // Map nodes come from TAllocator, rebound to the node types. With
+  // IFTPoolAllocator they are carved out of an arena owned by the
+  // queue and released with it.
 
-  typedef typename std::map<TKey,TValue,TKeyComp>::iterator iterator;
-  typedef typename std::map<TKey,TValue,TKeyComp>::const_iterator const_iterator;
+  typedef typename TAllocator::template rebind< std::pair<const TKey,TValue> >::other KeyAllocator;
+  typedef typename TAllocator::template rebind< std::pair<const TValue,TKey> >::other ValueAllocator;
+  typedef std::map<TKey,TValue,TKeyComp,KeyAllocator> KeyMapType;
+  typedef std::map<TValue,TKey,TValueComp,ValueAllocator> ValueMapType;
+
+  typedef typename KeyMapType::iterator iterator;
+  typedef typename KeyMapType::const_iterator const_iterator;
 
   // default constructor, uses std::greater and std::less for key and value comparisons
-  IFTQueueA() : KeyMap(TKeyComp()), ValueMap(TValueComp()) { }
+  IFTQueueA() : KeyMap(TKeyComp(), NewKeyAllocator()), ValueMap(TValueComp(), NewValueAllocator()) { }
 
   // constructor with key comparison predicate
-  IFTQueueA( const TKeyComp &keyComp ) : KeyMap(TKeyComp()), ValueMap(TValueComp()){ }
+  IFTQueueA( const TKeyComp &keyComp ) : KeyMap(TKeyComp(), NewKeyAllocator()), ValueMap(TValueComp(), NewValueAllocator()){ }
 
   // constructor with value comparison predicate
-  IFTQueueA( const TValueComp &valComp ) : KeyMap(TKeyComp()), ValueMap(valComp) { }
+  IFTQueueA( const TValueComp &valComp ) : KeyMap(TKeyComp(), NewKeyAllocator()), ValueMap(valComp, NewValueAllocator()) { }
 
   // constructor with both comparison predicates
-  IFTQueueA( const TKeyComp &keyComp, const TValueComp &valComp ) : KeyMap(keyComp), ValueMap(valComp) { }
+  IFTQueueA( const TKeyComp &keyComp, const TValueComp &valComp ) : KeyMap(keyComp, NewKeyAllocator()), ValueMap(valComp, NewValueAllocator()) { }
 
-  // copy constructor
-  IFTQueueA( const IFTQueueA<TKey,TValue,TKeyComp,TValueComp> &x ) : KeyMap(x.KeyMap), ValueMap(x.ValueMap) {}
+  // copy constructor - the copy gets its own arena
+  IFTQueueA( const IFTQueueA &x ) :
+    KeyMap(x.KeyMap.begin(), x.KeyMap.end(), x.KeyMap.key_comp(), NewKeyAllocator()),
+    ValueMap(x.ValueMap.begin(), x.ValueMap.end(), x.ValueMap.key_comp(), NewValueAllocator()) {}
 
   // destructor, clears both maps
   ~IFTQueueA(){
@@ -57,7 +81,7 @@ public:
   }
 
   // assignment operator
-  inline void operator=( IFTQueueA<TKey,TValue,TKeyComp,TValueComp> x ){
+  inline void operator=( IFTQueueA x ){
     KeyMap = x.KeyMap;
     ValueMap = x.ValueMap;
   }
@@ -80,7 +104,7 @@ public:
 
   // removes from both maps the value val
   inline void erase( TValue val ){
-    typename std::map<TValue,TKey,TValueComp>::iterator iter=ValueMap.find( val );
+    typename ValueMapType::iterator iter=ValueMap.find( val );
     if( iter != ValueMap.end() ){
     KeyMap.erase( KeyMap.find(iter->second) );
     ValueMap.erase( iter );
@@ -136,6 +160,24 @@ public:
     return KeyMap.size();
   }
 
+  // bytes used with entries of the numberOfValues values queued at
+  // once, keys of them being distinct. Each entry is a node of both
+  // maps.
+  static double Footprint( double, double entries, double ){
+    return entries * ( IFTTreeNodeBytes< std::pair<const TKey,TValue> >()
+		       + IFTTreeNodeBytes< std::pair<const TValue,TKey> >() );
+  }
+
+  // size the arena slabs for up to numberOfValues queued values
+  inline void reserve( size_t numberOfValues ){
+    Arena.Reserve( numberOfValues );
+  }
+
+  // the arena used by IFTPoolAllocator. Unused by other allocators.
+  inline const IFTNodeArena & GetArena() const {
+    return Arena;
+  }
+
   void PrintKeyMap()
   {
     for (iterator kit = KeyMap.begin(); kit != KeyMap.end();++kit)
@@ -147,17 +189,28 @@ public:
 private:
   // Keys will be priorities, Values be image locations, in some form.
   // Priorities will be gray level/iteration number pairs
-  std::map<TKey, TValue, TKeyComp> KeyMap;  
-  std::map<TValue, TKey, TValueComp> ValueMap;
+  // The arena must be declared first so that it outlives the maps
+  IFTNodeArena Arena;
+  KeyMapType KeyMap;  
+  ValueMapType ValueMap;
+
+  inline KeyAllocator NewKeyAllocator(){
+    return IFTAllocatorForArena<KeyAllocator>::New( &Arena );
+  }
+
+  inline ValueAllocator NewValueAllocator(){
+    return IFTAllocatorForArena<ValueAllocator>::New( &Arena );
+  }
 
-  inline void sperase( typename std::map<TKey,TValue,TKeyComp>::iterator it ){
+  inline void sperase( iterator it ){
     ValueMap.erase( it->second );
     KeyMap.erase( it );
   }
 
 };
 
-template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey>, typename TValueComp=std::less<TValue> >
+template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey>, typename TValueComp=std::less<TValue>,
+          typename TAllocator=std::allocator<TValue> >
 class IFTQueueB {
 private:
   // Keys will be priorities, Values be image locations, in some form.
@@ -165,12 +218,21 @@ private:
   // normally this would
   // be a queue, but we
   // need to erase elements
-  typedef typename std::list<TValue> ListType; 
-  std::map<TKey, ListType, TKeyComp> KeyMap;  
-  std::map<TValue, TKey, TValueComp> ValueMap;
+  // All nodes, including those of the lists, come from TAllocator
+  // rebound to the node types. The arena used by IFTPoolAllocator
+  // is declared first so that it outlives the maps
+  typedef typename TAllocator::template rebind< TValue >::other ListAllocator;
+  typedef typename std::list<TValue, ListAllocator> ListType; 
+  typedef typename TAllocator::template rebind< std::pair<const TKey,ListType> >::other KeyAllocator;
+  typedef typename TAllocator::template rebind< std::pair<const TValue,TKey> >::other ValueAllocator;
+  typedef std::map<TKey, ListType, TKeyComp, KeyAllocator> KeyMapType;
+  typedef std::map<TValue, TKey, TValueComp, ValueAllocator> ValueMapType;
+  IFTNodeArena Arena;
+  KeyMapType KeyMap;  
+  ValueMapType ValueMap;
 
-  typedef typename std::map<TKey, ListType, TKeyComp>::iterator iterator;
-  typedef typename std::map<TValue, TKey, TValueComp>::const_iterator const_iterator;
+  typedef typename KeyMapType::iterator iterator;
+  typedef typename ValueMapType::const_iterator const_iterator;
 
   TValueComp valComp;
 
@@ -181,19 +243,28 @@ public:
   // particular value we want to get rid of 
 
   // default constructor, uses std::greater and std::less for key and value comparisons
-  IFTQueueB() : KeyMap(TKeyComp()), ValueMap(TValueComp()) { }
+  IFTQueueB() : KeyMap(TKeyComp(), NewAllocator<KeyAllocator>()), ValueMap(TValueComp(), NewAllocator<ValueAllocator>()) { }
 
   // constructor with key comparison predicate
-  IFTQueueB( const TKeyComp &keyComp ) : KeyMap(TKeyComp()), ValueMap(TValueComp()){ }
+  IFTQueueB( const TKeyComp &keyComp ) : KeyMap(TKeyComp(), NewAllocator<KeyAllocator>()), ValueMap(TValueComp(), NewAllocator<ValueAllocator>()){ }
 
   // constructor with value comparison predicate
-  IFTQueueB( const TValueComp &valComp ) : KeyMap(TKeyComp()), ValueMap(TValueComp()) { }
+  IFTQueueB( const TValueComp &valComp ) : KeyMap(TKeyComp(), NewAllocator<KeyAllocator>()), ValueMap(TValueComp(), NewAllocator<ValueAllocator>()) { }
 
   // constructor with both comparison predicates
-  IFTQueueB( const TKeyComp &keyComp, const TValueComp &valComp ) : KeyMap(keyComp), ValueMap(valComp) { }
+  IFTQueueB( const TKeyComp &keyComp, const TValueComp &valComp ) : KeyMap(keyComp, NewAllocator<KeyAllocator>()), ValueMap(valComp, NewAllocator<ValueAllocator>()) { }
 
-  // copy constructor
-  IFTQueueB( const IFTQueueB<TKey,TValue,TKeyComp,TValueComp> &x ) : KeyMap(x.KeyMap), ValueMap(x.ValueMap) {}
+  // copy constructor - the copy gets its own arena
+  IFTQueueB( const IFTQueueB &x ) :
+    KeyMap(x.KeyMap.key_comp(), NewAllocator<KeyAllocator>()),
+    ValueMap(x.ValueMap.begin(), x.ValueMap.end(), x.ValueMap.key_comp(), NewAllocator<ValueAllocator>())
+  {
+    for (typename KeyMapType::const_iterator kit = x.KeyMap.begin(); kit != x.KeyMap.end(); ++kit)
+      {
+      ListType & l = list_at( kit->first );
+      l.insert( l.end(), kit->second.begin(), kit->second.end() );
+      }
+  }
 
   // destructor, clears both maps
   ~IFTQueueB(){
@@ -201,9 +272,15 @@ public:
     ValueMap.clear();
   }
 
-  // assignment operator
-  inline void operator=( IFTQueueB<TKey,TValue,TKeyComp,TValueComp> x ){
-    KeyMap = x.KeyMap;
+  // assignment operator. The lists are rebuilt rather than copied so
+  // that they use this queue's allocator
+  inline void operator=( IFTQueueB x ){
+    clear();
+    for (typename KeyMapType::const_iterator kit = x.KeyMap.begin(); kit != x.KeyMap.end(); ++kit)
+      {
+      ListType & l = list_at( kit->first );
+      l.insert( l.end(), kit->second.begin(), kit->second.end() );
+      }
     ValueMap = x.ValueMap;
   }
 
@@ -225,11 +302,11 @@ public:
 
   // removes from both maps the value val
   inline void erase( TValue val ){
-    typename std::map<TValue,TKey,TValueComp>::iterator iter=ValueMap.find( val );
+    typename ValueMapType::iterator iter=ValueMap.find( val );
     if( iter != ValueMap.end() )
       {
-      typename std::map<TKey, ListType, TKeyComp>::iterator i2 = KeyMap.find(iter->second);
-      typename std::list<TValue>::iterator lit;
+      iterator i2 = KeyMap.find(iter->second);
+      typename ListType::iterator lit;
       for (lit = i2->second.begin(); lit != i2->second.end(); ++lit)
 	{
 	if ((!valComp(*lit, val)) && (!valComp(val, *lit))) 
@@ -279,7 +356,7 @@ public:
   // keys per value
   inline void insert( TValue val, TKey key ){
     erase( val );
-    KeyMap[key].push_back(val);
+    list_at(key).push_back(val);
     ValueMap.insert( std::pair<TValue,TKey>( val, key ) );
   }
 
@@ -299,12 +376,29 @@ public:
     return KeyMap.size();
   }
 
+  // as for IFTQueueA. Each entry is a list node and a node of the
+  // value map, and each distinct key a node of the key map.
+  static double Footprint( double, double entries, double keys ){
+    return entries * ( IFTListNodeBytes<TValue>() + IFTTreeNodeBytes< std::pair<const TValue,TKey> >() )
+      + keys * IFTTreeNodeBytes< std::pair<const TKey,ListType> >();
+  }
+
+  // size the arena slabs for up to numberOfValues queued values
+  inline void reserve( size_t numberOfValues ){
+    Arena.Reserve( numberOfValues );
+  }
+
+  // the arena used by IFTPoolAllocator. Unused by other allocators.
+  inline const IFTNodeArena & GetArena() const {
+    return Arena;
+  }
+
   void PrintKeyMap()
   {
     for (iterator kit = KeyMap.begin(); kit != KeyMap.end();++kit)
       {
       std::cout << kit->first << " ";
-      typename std::list<TValue>::iterator lit;
+      typename ListType::iterator lit;
       for (lit = kit->second.begin(); lit != kit->second.end(); ++lit)
 	{
 	std::cout << *lit << " " ;
@@ -328,7 +422,24 @@ private:
   // typedef typename ValueMap::const_iterator const_iterator;
 
 
-  inline void sperase( typename std::map<TKey,ListType,TKeyComp>::iterator it ){
+  template< typename TAlloc >
+  inline TAlloc NewAllocator(){
+    return IFTAllocatorForArena<TAlloc>::New( &Arena );
+  }
+
+  // the list for a key, created with the queue's allocator if it
+  // isn't there. KeyMap[key] would default construct the list's
+  // allocator, bypassing the arena.
+  inline ListType & list_at( const TKey & key ){
+    iterator it = KeyMap.lower_bound( key );
+    if ( it == KeyMap.end() || KeyMap.key_comp()( key, it->first ) )
+      {
+      it = KeyMap.insert( it, std::pair<const TKey, ListType>( key, ListType( NewAllocator<ListAllocator>() ) ) );
+      }
+    return it->second;
+  }
+
+  inline void sperase( iterator it ){
     ValueMap.erase( *(it->second.begin()) );
     it->second.erase(it->second.begin());
     if (it->second.empty())
@@ -340,4 +451,956 @@ private:
 };
 
 
+template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey>, unsigned int VArity=4 >
+class IFTHeapQueue {
+public:
+  // An indexed d-ary heap. This follows option 3) above - the values
+  // must be non-negative integral offsets (e.g. the linear offset of
+  // a pixel in the buffer) smaller than the number of values the
+  // queue was set up with. The position of each value in the heap is
+  // kept in a flat array, so a change of key is a sift up/down in
+  // place rather than an erase followed by an insert, and nothing is
+  // allocated per entry once the heap has grown.
+  // Every entry carries an insertion counter that breaks ties between
+  // equal keys, so entries of equal priority come out in the order
+  // they were (re)inserted. This is the same fifo ordering on plateaus
+  // that the GlobalTime gives IFTQueueA.
+
+  IFTHeapQueue() : Time(0), less(TKeyComp()) { }
+
+  IFTHeapQueue( size_t numberOfValues ) : Time(0), less(TKeyComp())
+  {
+    SetNumberOfValues( numberOfValues );
+  }
+
+  IFTHeapQueue( size_t numberOfValues, const TKeyComp &keyComp ) : Time(0), less(keyComp)
+  {
+    SetNumberOfValues( numberOfValues );
+  }
+
+  // must be called before the first insert. Values must lie in
+  // [0, numberOfValues)
+  inline void SetNumberOfValues( size_t numberOfValues ){
+    Heap.clear();
+    Position.assign( numberOfValues, NotInQueue() );
+    Time = 0;
+  }
+
+  // empties the queue
+  inline void clear(){
+    for (size_t i = 0; i < Heap.size(); ++i)
+      {
+      Position[Heap[i].Value] = NotInQueue();
+      }
+    Heap.clear();
+    Time = 0;
+  }
+
+  // removes the value val if it is in the queue
+  inline void erase( TValue val ){
+    TValue pos = Position[val];
+    if ( pos == NotInQueue() )
+      {
+      return;
+      }
+    Position[val] = NotInQueue();
+    HeapEntry last = Heap.back();
+    Heap.pop_back();
+    if ( static_cast<size_t>(pos) < Heap.size() )
+      {
+      Heap[pos] = last;
+      Position[last.Value] = pos;
+      sift_up( pos );
+      sift_down( Position[last.Value] );
+      }
+  }
+
+  // returns true if the queue is empty
+  inline bool empty() const {
+    return Heap.empty();
+  }
+
+  // returns true if val is currently in the queue
+  inline bool contains( TValue val ) const {
+    return Position[val] != NotInQueue();
+  }
+
+  // returns the value at the front of the queue
+  inline TValue front_value() const {
+    return Heap.front().Value;
+  }
+
+  // returns the key at the front of the queue
+  inline TKey front_key() const {
+    return Heap.front().Key;
+  }
+
+  // removes the front entry in the queue
+  inline void pop(){
+    Position[Heap.front().Value] = NotInQueue();
+    HeapEntry last = Heap.back();
+    Heap.pop_back();
+    if ( !Heap.empty() )
+      {
+      Heap[0] = last;
+      Position[last.Value] = 0;
+      sift_down( 0 );
+      }
+  }
+
+  // push an entry onto the queue
+  inline void push( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // adds a value key pair to the queue. If the value is already
+  // queued its key is changed in place and it moves to the back of
+  // the entries with the same key.
+  inline void insert( TValue val, TKey key ){
+    HeapEntry e;
+    e.Key = key;
+    e.Time = Time++;
+    e.Value = val;
+    TValue pos = Position[val];
+    if ( pos == NotInQueue() )
+      {
+      Heap.push_back( e );
+      Position[val] = static_cast<TValue>( Heap.size() - 1 );
+      sift_up( Heap.size() - 1 );
+      }
+    else
+      {
+      Heap[pos] = e;
+      sift_up( pos );
+      sift_down( Position[val] );
+      }
+  }
+
+  // update the key associated with a value,
+  // simply a convenience function that calls
+  // insert()
+  inline void update( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // returns the number of elements in the queue
+  inline size_t size() const {
+    return Heap.size();
+  }
+
+  // as for IFTQueueA: the positions, and the heap, which may have
+  // grown to twice the entries
+  static double Footprint( double numberOfValues, double entries, double ){
+    return numberOfValues * sizeof(TValue) + 2 * entries * sizeof(HeapEntry);
+  }
+
+  void PrintKeyMap()
+  {
+    std::vector<HeapEntry> sorted( Heap );
+    std::sort( sorted.begin(), sorted.end(), less );
+    for (size_t i = 0; i < sorted.size(); ++i)
+      {
+      std::cout << sorted[i].Key << " " << sorted[i].Value << std::endl;
+      }
+  }
+
+private:
+  typedef unsigned long TimeType;
+
+  class HeapEntry {
+  public:
+    TKey Key;
+    TimeType Time;
+    TValue Value;
+  };
+
+  class EntryCompare {
+  public:
+    EntryCompare( const TKeyComp & comp ) : keyComp(comp) {}
+    inline bool operator()( const HeapEntry & A, const HeapEntry & B ) const
+    {
+      if ( keyComp(A.Key, B.Key) ) return true;
+      if ( keyComp(B.Key, A.Key) ) return false;
+      return ( A.Time < B.Time );
+    }
+    TKeyComp keyComp;
+  };
+
+  std::vector<HeapEntry> Heap;
+  std::vector<TValue> Position;
+  TimeType Time;
+  EntryCompare less;
+
+  static inline TValue NotInQueue() {
+    return static_cast<TValue>( -1 );
+  }
+
+  inline void sift_up( size_t i ){
+    HeapEntry e = Heap[i];
+    while ( i > 0 )
+      {
+      size_t parent = ( i - 1 ) / VArity;
+      if ( !less( e, Heap[parent] ) )
+        {
+        break;
+        }
+      Heap[i] = Heap[parent];
+      Position[Heap[i].Value] = static_cast<TValue>( i );
+      i = parent;
+      }
+    Heap[i] = e;
+    Position[e.Value] = static_cast<TValue>( i );
+  }
+
+  inline void sift_down( size_t i ){
+    const size_t n = Heap.size();
+    HeapEntry e = Heap[i];
+    for (;;)
+      {
+      size_t first = i * VArity + 1;
+      if ( first >= n )
+        {
+        break;
+        }
+      size_t last = std::min( first + VArity, n );
+      size_t best = first;
+      for ( size_t c = first + 1; c < last; ++c )
+        {
+        if ( less( Heap[c], Heap[best] ) )
+          {
+          best = c;
+          }
+        }
+      if ( !less( Heap[best], e ) )
+        {
+        break;
+        }
+      Heap[i] = Heap[best];
+      Position[Heap[i].Value] = static_cast<TValue>( i );
+      i = best;
+      }
+    Heap[i] = e;
+    Position[e.Value] = static_cast<TValue>( i );
+  }
+
+};
+
+
+template< typename TKey, typename TValue >
+class IFTBucketQueue {
+public:
+  // A bucket (Dial style) queue for keys that are integers in a known,
+  // modest range. There is one bucket per possible key and each bucket
+  // is a fifo list threaded through per value next/prev arrays, so
+  // values must be non-negative integral offsets, as for
+  // IFTHeapQueue. Removing an entry, or moving it to another bucket,
+  // is O(1) and nothing is allocated after Initialize. Entries
+  // (re)inserted with the same key come out in the order they went
+  // in, as with IFTQueueB.
+  // Keys may be a floating point type, provided they only ever hold
+  // integer values in [minKey, maxKey].
+
+  IFTBucketQueue() : MinKey(0), Current(0), Count(0) { }
+
+  IFTBucketQueue( size_t numberOfValues, long minKey, long maxKey )
+  {
+    Initialize( numberOfValues, minKey, maxKey );
+  }
+
+  // must be called before the first insert.
+  inline void Initialize( size_t numberOfValues, long minKey, long maxKey ){
+    MinKey = minKey;
+    Head.assign( maxKey - minKey + 1, NoValue() );
+    Tail.assign( maxKey - minKey + 1, NoValue() );
+    Next.assign( numberOfValues, NoValue() );
+    Prev.assign( numberOfValues, NoValue() );
+    Bucket.assign( numberOfValues, NotInQueue() );
+    Current = 0;
+    Count = 0;
+  }
+
+  // empties the queue
+  inline void clear(){
+    while ( !empty() )
+      {
+      pop();
+      }
+  }
+
+  // removes the value val if it is in the queue
+  inline void erase( TValue val ){
+    BucketIndexType b = Bucket[val];
+    if ( b == NotInQueue() )
+      {
+      return;
+      }
+    unlink( val, b );
+    if ( b == Current )
+      {
+      advance();
+      }
+  }
+
+  // returns true if the queue is empty
+  inline bool empty() const {
+    return Count == 0;
+  }
+
+  // returns true if val is currently in the queue
+  inline bool contains( TValue val ) const {
+    return Bucket[val] != NotInQueue();
+  }
+
+  // returns the value at the front of the queue
+  inline TValue front_value() const {
+    return Head[Current];
+  }
+
+  // returns the key at the front of the queue
+  inline TKey front_key() const {
+    return static_cast<TKey>( MinKey + static_cast<long>(Current) );
+  }
+
+  // removes the front entry in the queue
+  inline void pop(){
+    unlink( Head[Current], Current );
+    advance();
+  }
+
+  // push an entry onto the queue
+  inline void push( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // adds a value key pair to the queue, moving the value if it is
+  // already queued
+  inline void insert( TValue val, TKey key ){
+    BucketIndexType b = static_cast<BucketIndexType>( static_cast<long>(key) - MinKey );
+    if ( Bucket[val] != NotInQueue() )
+      {
+      unlink( val, Bucket[val] );
+      }
+    Bucket[val] = b;
+    Next[val] = NoValue();
+    Prev[val] = Tail[b];
+    if ( Tail[b] == NoValue() )
+      {
+      Head[b] = val;
+      }
+    else
+      {
+      Next[Tail[b]] = val;
+      }
+    Tail[b] = val;
+    if ( Count == 0 || b < Current )
+      {
+      Current = b;
+      }
+    ++Count;
+    // the front bucket may have been emptied by the unlink
+    advance();
+  }
+
+  // update the key associated with a value,
+  // simply a convenience function that calls
+  // insert()
+  inline void update( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // returns the number of elements in the queue
+  inline size_t size() const {
+    return Count;
+  }
+
+  // as for IFTQueueA, keys being maxKey - minKey + 1. Everything is
+  // allocated by Initialize.
+  static double Footprint( double numberOfValues, double, double keys ){
+    return ( 2 * keys + 2 * numberOfValues ) * sizeof(TValue) + numberOfValues * sizeof(BucketIndexType);
+  }
+
+  void PrintKeyMap()
+  {
+    for (size_t b = 0; b < Head.size(); ++b)
+      {
+      if ( Head[b] == NoValue() )
+        {
+        continue;
+        }
+      std::cout << MinKey + static_cast<long>(b) << " ";
+      for ( TValue v = Head[b]; v != NoValue(); v = Next[v] )
+        {
+        std::cout << v << " ";
+        }
+      std::cout << std::endl;
+      }
+  }
+
+private:
+  typedef unsigned int BucketIndexType;
+
+  long MinKey;
+  // first and last entry of each bucket
+  std::vector<TValue> Head;
+  std::vector<TValue> Tail;
+  // per value links and bucket
+  std::vector<TValue> Next;
+  std::vector<TValue> Prev;
+  std::vector<BucketIndexType> Bucket;
+  // lowest non empty bucket, when the queue isn't empty
+  BucketIndexType Current;
+  size_t Count;
+
+  static inline TValue NoValue() {
+    return static_cast<TValue>( -1 );
+  }
+
+  static inline BucketIndexType NotInQueue() {
+    return static_cast<BucketIndexType>( -1 );
+  }
+
+  inline void unlink( TValue val, BucketIndexType b ){
+    if ( Prev[val] == NoValue() )
+      {
+      Head[b] = Next[val];
+      }
+    else
+      {
+      Next[Prev[val]] = Next[val];
+      }
+    if ( Next[val] == NoValue() )
+      {
+      Tail[b] = Prev[val];
+      }
+    else
+      {
+      Prev[Next[val]] = Prev[val];
+      }
+    Bucket[val] = NotInQueue();
+    --Count;
+  }
+
+  // move Current up to the next non empty bucket
+  inline void advance(){
+    if ( Count == 0 )
+      {
+      return;
+      }
+    while ( Head[Current] == NoValue() )
+      {
+      ++Current;
+      }
+  }
+
+};
+
+template< typename TKey, typename TValue, typename TKeyComp=std::less<TKey> >
+class IFTLazyQueue {
+public:
+  // A binary heap without any reverse lookup. Changing the key of a
+  // value simply pushes it again, leaving the old entry in the
+  // heap. It is up to the user to recognise stale entries when they
+  // reach the front (in the IFT the popped key will no longer match
+  // the cost image) and throw them away with discard() rather than
+  // pop(), which keeps a count of them. Entries are ordered by key
+  // and then by insertion, so the live entries come out in the same
+  // order as from IFTQueueA.
+
+  IFTLazyQueue() : Time(0), Stale(0), less(TKeyComp()) { }
+
+  IFTLazyQueue( const TKeyComp &keyComp ) : Time(0), Stale(0), less(keyComp) { }
+
+  // empties the queue
+  inline void clear(){
+    Heap.clear();
+    Time = 0;
+    Stale = 0;
+  }
+
+  // returns true if the queue is empty
+  inline bool empty() const {
+    return Heap.empty();
+  }
+
+  // returns the value at the front of the queue
+  inline TValue front_value() const {
+    return Heap.front().Value;
+  }
+
+  // returns the key at the front of the queue
+  inline TKey front_key() const {
+    return Heap.front().Key;
+  }
+
+  // removes the front entry in the queue
+  inline void pop(){
+    std::pop_heap( Heap.begin(), Heap.end(), less );
+    Heap.pop_back();
+  }
+
+  // removes the front entry in the queue, counting it as stale
+  inline void discard(){
+    pop();
+    ++Stale;
+  }
+
+  // push an entry onto the queue
+  inline void push( TValue val, TKey key ){
+    HeapEntry e;
+    e.Key = key;
+    e.Time = Time++;
+    e.Value = val;
+    Heap.push_back( e );
+    std::push_heap( Heap.begin(), Heap.end(), less );
+  }
+
+  // there is no erase, so inserting is the same as pushing
+  inline void insert( TValue val, TKey key ){
+    push( val, key );
+  }
+
+  // returns the number of entries in the queue, including stale ones
+  inline size_t size() const {
+    return Heap.size();
+  }
+
+  // the number of entries thrown away with discard()
+  inline unsigned long stale_count() const {
+    return Stale;
+  }
+
+  // as for IFTQueueA, with entries counting the stale ones too
+  static double Footprint( double, double entries, double ){
+    return 2 * entries * sizeof(HeapEntry);
+  }
+
+  void PrintKeyMap()
+  {
+    std::vector<HeapEntry> sorted( Heap );
+    std::sort( sorted.begin(), sorted.end(), EntryOrder(less) );
+    for (size_t i = 0; i < sorted.size(); ++i)
+      {
+      std::cout << sorted[i].Key << " " << sorted[i].Value << std::endl;
+      }
+  }
+
+private:
+  typedef unsigned long TimeType;
+
+  class HeapEntry {
+  public:
+    TKey Key;
+    TimeType Time;
+    TValue Value;
+  };
+
+  // ordering for std::push_heap and friends, which keep the largest
+  // element at the front, so this is "later than"
+  class EntryCompare {
+  public:
+    EntryCompare( const TKeyComp & comp ) : keyComp(comp) {}
+    inline bool operator()( const HeapEntry & A, const HeapEntry & B ) const
+    {
+      if ( keyComp(B.Key, A.Key) ) return true;
+      if ( keyComp(A.Key, B.Key) ) return false;
+      return ( B.Time < A.Time );
+    }
+    TKeyComp keyComp;
+  };
+
+  class EntryOrder {
+  public:
+    EntryOrder( const EntryCompare & comp ) : later(comp) {}
+    inline bool operator()( const HeapEntry & A, const HeapEntry & B ) const
+    {
+      return later( B, A );
+    }
+    EntryCompare later;
+  };
+
+  std::vector<HeapEntry> Heap;
+  TimeType Time;
+  unsigned long Stale;
+  EntryCompare less;
+
+};
+
+// Order preserving maps from keys to unsigned integers for the radix
+// queue. Floating point keys are handled by flipping the sign bit of
+// positive values and all the bits of negative values.
+template< typename TKey >
+class IFTRadixKeyTraits {
+public:
+  // integer keys: flipping the sign bit of the widened key keeps the
+  // order of negative and positive keys
+  static unsigned long long ToBits( TKey key )
+  {
+    return static_cast<unsigned long long>( static_cast<long long>( key ) ) ^ 0x8000000000000000ull;
+  }
+};
+
+template<>
+class IFTRadixKeyTraits<float> {
+public:
+  static unsigned long long ToBits( float key )
+  {
+    unsigned int bits;
+    std::memcpy( &bits, &key, sizeof(bits) );
+    bits = ( bits & 0x80000000u ) ? ~bits : ( bits | 0x80000000u );
+    return bits;
+  }
+};
+
+template<>
+class IFTRadixKeyTraits<double> {
+public:
+  static unsigned long long ToBits( double key )
+  {
+    unsigned long long bits;
+    std::memcpy( &bits, &key, sizeof(bits) );
+    bits = ( bits & 0x8000000000000000ull ) ? ~bits : ( bits | 0x8000000000000000ull );
+    return bits;
+  }
+};
+
+template< typename TKey, typename TValue >
+class IFTRadixQueue {
+public:
+  // A radix heap. This only works for monotone use: a key may never
+  // be lower than the key most recently popped. That holds in the IFT
+  // because a neighbour's cost is the maximum of the popped cost and
+  // the step cost. Entries are placed in buckets according to the
+  // highest bit in which they differ from the last popped entry, so
+  // push is O(1) and pop is amortised O(number of key bits).
+  // Keys are mapped to bits with IFTRadixKeyTraits and an insertion
+  // counter is appended below them, which gives fifo ordering on
+  // plateaus and makes every entry unique. Values are offsets, as
+  // for IFTHeapQueue, so that the bucket and slot of each value can
+  // be kept in flat arrays and a change of key is O(1).
+
+  IFTRadixQueue() : Time(0), LastKey(0), LastTime(0), Count(0) { }
+
+  IFTRadixQueue( size_t numberOfValues ) : Time(0), LastKey(0), LastTime(0), Count(0)
+  {
+    SetNumberOfValues( numberOfValues );
+  }
+
+  // must be called before the first insert. Values must lie in
+  // [0, numberOfValues)
+  inline void SetNumberOfValues( size_t numberOfValues ){
+    for (unsigned b = 0; b < NumberOfBuckets; ++b)
+      {
+      Buckets[b].clear();
+      }
+    BucketOf.assign( numberOfValues, NotInQueue() );
+    Slot.assign( numberOfValues, 0 );
+    Time = 0;
+    LastKey = 0;
+    LastTime = 0;
+    Count = 0;
+  }
+
+  // empties the queue
+  inline void clear(){
+    for (unsigned b = 0; b < NumberOfBuckets; ++b)
+      {
+      for (size_t i = 0; i < Buckets[b].size(); ++i)
+        {
+        BucketOf[Buckets[b][i].Value] = NotInQueue();
+        }
+      Buckets[b].clear();
+      }
+    Time = 0;
+    LastKey = 0;
+    LastTime = 0;
+    Count = 0;
+  }
+
+  // removes the value val if it is in the queue
+  inline void erase( TValue val ){
+    if ( BucketOf[val] == NotInQueue() )
+      {
+      return;
+      }
+    unlink( val );
+  }
+
+  // returns true if the queue is empty
+  inline bool empty() const {
+    return Count == 0;
+  }
+
+  // returns true if val is currently in the queue
+  inline bool contains( TValue val ) const {
+    return BucketOf[val] != NotInQueue();
+  }
+
+  // returns the value at the front of the queue
+  inline TValue front_value(){
+    settle();
+    return Buckets[0].front().Value;
+  }
+
+  // returns the key at the front of the queue
+  inline TKey front_key(){
+    settle();
+    return Buckets[0].front().Key;
+  }
+
+  // removes the front entry in the queue
+  inline void pop(){
+    settle();
+    unlink( Buckets[0].front().Value );
+  }
+
+  // push an entry onto the queue
+  inline void push( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // adds a value key pair to the queue, replacing the key if the
+  // value is already queued. key must not be lower than the key
+  // most recently at the front of the queue.
+  inline void insert( TValue val, TKey key ){
+    if ( BucketOf[val] != NotInQueue() )
+      {
+      unlink( val );
+      }
+    RadixEntry e;
+    e.Bits = IFTRadixKeyTraits<TKey>::ToBits( key );
+    e.Time = Time++;
+    e.Key = key;
+    e.Value = val;
+    place( e );
+    ++Count;
+  }
+
+  // update the key associated with a value,
+  // simply a convenience function that calls
+  // insert()
+  inline void update( TValue val, TKey key ){
+    insert( val, key );
+  }
+
+  // returns the number of elements in the queue
+  inline size_t size() const {
+    return Count;
+  }
+
+  // as for IFTQueueA: the bucket and slot of every value, and the
+  // buckets, which keep their capacity as entries move between them
+  static double Footprint( double numberOfValues, double entries, double ){
+    return numberOfValues * ( 1 + sizeof(TValue) ) + 2 * entries * sizeof(RadixEntry);
+  }
+
+  void PrintKeyMap()
+  {
+    for (unsigned b = 0; b < NumberOfBuckets; ++b)
+      {
+      for (size_t i = 0; i < Buckets[b].size(); ++i)
+        {
+        std::cout << b << ": " << Buckets[b][i].Key << " " << Buckets[b][i].Value << std::endl;
+        }
+      }
+  }
+
+private:
+  typedef unsigned long long BitsType;
+
+  class RadixEntry {
+  public:
+    BitsType Bits;
+    BitsType Time;
+    TKey Key;
+    TValue Value;
+  };
+
+  // bucket 0 holds the entry equal to the last one popped, buckets
+  // 1-64 entries differing from it only in the insertion counter and
+  // 65-128 entries differing in the key bits
+  static const unsigned NumberOfBuckets = 129;
+
+  std::vector<RadixEntry> Buckets[NumberOfBuckets];
+  std::vector<unsigned char> BucketOf;
+  std::vector<TValue> Slot;
+  BitsType Time;
+  BitsType LastKey;
+  BitsType LastTime;
+  size_t Count;
+
+  static inline unsigned char NotInQueue() {
+    return 255;
+  }
+
+  static inline unsigned HighestBit( BitsType x ){
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll( x );
+#else
+    unsigned b = 0;
+    while ( x >>= 1 )
+      {
+      ++b;
+      }
+    return b;
+#endif
+  }
+
+  inline unsigned bucket( const RadixEntry & e ) const {
+    if ( e.Bits != LastKey )
+      {
+      return 65 + HighestBit( e.Bits ^ LastKey );
+      }
+    if ( e.Time != LastTime )
+      {
+      return 1 + HighestBit( e.Time ^ LastTime );
+      }
+    return 0;
+  }
+
+  inline void place( const RadixEntry & e ){
+    unsigned b = bucket( e );
+    BucketOf[e.Value] = static_cast<unsigned char>( b );
+    Slot[e.Value] = static_cast<TValue>( Buckets[b].size() );
+    Buckets[b].push_back( e );
+  }
+
+  // order within a bucket doesn't matter, because the minimum is
+  // searched for, so removal swaps with the last entry
+  inline void unlink( TValue val ){
+    std::vector<RadixEntry> & bucket = Buckets[BucketOf[val]];
+    TValue slot = Slot[val];
+    if ( static_cast<size_t>(slot) + 1 != bucket.size() )
+      {
+      bucket[slot] = bucket.back();
+      Slot[bucket[slot].Value] = slot;
+      }
+    bucket.pop_back();
+    BucketOf[val] = NotInQueue();
+    --Count;
+  }
+
+  // make sure that the minimum entry is in bucket 0 by redistributing
+  // the first non empty bucket about its minimum. This is only done
+  // when the front is needed, as it raises the lower limit on keys
+  // that can be inserted.
+  inline void settle(){
+    if ( Count == 0 || !Buckets[0].empty() )
+      {
+      return;
+      }
+    unsigned b = 1;
+    while ( Buckets[b].empty() )
+      {
+      ++b;
+      }
+    std::vector<RadixEntry> & src = Buckets[b];
+    size_t best = 0;
+    for (size_t i = 1; i < src.size(); ++i)
+      {
+      if ( src[i].Bits < src[best].Bits
+           || ( src[i].Bits == src[best].Bits && src[i].Time < src[best].Time ) )
+        {
+        best = i;
+        }
+      }
+    LastKey = src[best].Bits;
+    LastTime = src[best].Time;
+    std::vector<RadixEntry> moving;
+    moving.swap( src );
+    for (size_t i = 0; i < moving.size(); ++i)
+      {
+      place( moving[i] );
+      }
+    // give the storage back to the bucket to avoid reallocating
+    moving.clear();
+    moving.swap( src );
+  }
+
+};
+
+// what the node arena of a queue has done. Only the tree based
+// queues have one, the others report nothing.
+template< typename TQueue >
+inline IFTArenaStatistics IFTQueueArenaStatistics( const TQueue & )
+{
+  return IFTArenaStatistics();
+}
+
+template< typename TKey, typename TValue, typename TKeyComp, typename TValueComp, typename TAllocator >
+inline IFTArenaStatistics IFTQueueArenaStatistics( const IFTQueueA<TKey,TValue,TKeyComp,TValueComp,TAllocator> & q )
+{
+  return q.GetArena().GetStatistics();
+}
+
+template< typename TKey, typename TValue, typename TKeyComp, typename TValueComp, typename TAllocator >
+inline IFTArenaStatistics IFTQueueArenaStatistics( const IFTQueueB<TKey,TValue,TKeyComp,TValueComp,TAllocator> & q )
+{
+  return q.GetArena().GetStatistics();
+}
+
+// The range of integer costs the IFT priority functors (see
+// IFTPriority and IFTWSPriority) can produce from a pixel type: the
+// pixel values themselves, or the absolute difference between
+// two. Only types with a range small enough for a bucket queue are
+// bounded.
+template< typename TPixel >
+class IFTBucketKeyRange {
+public:
+  static const bool Bounded = false;
+  static long Min() { return 0; }
+  static long Max() { return 0; }
+};
+
+template<>
+class IFTBucketKeyRange<unsigned char> {
+public:
+  static const bool Bounded = true;
+  static long Min() { return 0; }
+  static long Max() { return 255; }
+};
+
+template<>
+class IFTBucketKeyRange<unsigned short> {
+public:
+  static const bool Bounded = true;
+  static long Min() { return 0; }
+  static long Max() { return 65535; }
+};
+
+template<>
+class IFTBucketKeyRange<short> {
+public:
+  static const bool Bounded = true;
+  static long Min() { return -32768; }
+  static long Max() { return 65535; }
+};
+
+// the value ordering of IFTQueueB in the IFT filter. Its own type, as
+// the constructors of IFTQueueB can't be told apart when the key and
+// value comparisons are the same type, which they would be for
+// unsigned int costs.
+template< typename TValue >
+class IFTValueLess : public std::less<TValue> {};
+
+// compile time choice of queue for the IFT filter's bucket strategy: a
+// bucket queue when the costs are known to be bounded integers,
+// IFTQueueB otherwise, though the filter doesn't use it then.
+template< typename TKey, typename TValue, typename TPixel, bool VUseBuckets >
+class IFTDefaultQueue {
+public:
+  typedef IFTQueueB<TKey, TValue, std::less<TKey>, IFTValueLess<TValue>, IFTPoolAllocator<TValue> > Type;
+  static void Initialize( Type & q, size_t numberOfValues ) { q.reserve( numberOfValues ); }
+};
+
+template< typename TKey, typename TValue, typename TPixel >
+class IFTDefaultQueue<TKey, TValue, TPixel, true> {
+public:
+  typedef IFTBucketQueue<TKey, TValue> Type;
+  static void Initialize( Type & q, size_t numberOfValues )
+  {
+    q.Initialize( numberOfValues, IFTBucketKeyRange<TPixel>::Min(), IFTBucketKeyRange<TPixel>::Max() );
+  }
+};
+
+
 #endif
@@ -0,0 +1,426 @@
+/* Recording and replay of the queue operations of an IFT flood, so
+* that queues can be compared on the work of a real segmentation
+* without running the filter. The filter writes a trace with
+* IFTQueueTraceWriter (see SetQueueTraceFile), and replayQueue reads
+* it back with IFTQueueTraceReader and drives each queue through it
+* with IFTQueueReplayOps.
+*
+* A trace is a fixed header followed by one record per operation:
+* the operation byte, then the value as a zigzag varint of the
+* difference from the previous value, then, for inserts and updates,
+* the key. Integer keys are stored as zigzag varints of the difference
+* from the previous key, floating point keys as they are. Neighbouring
+* pixels have nearby offsets and costs, so most records take 3 or 4
+* bytes. Everything is in host byte order.
+*/
+
+#ifndef _itk_IFTQueueTrace_h_
+#define _itk_IFTQueueTrace_h_
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <fstream>
+#include <cstring>
+#include "itkIFTQueue.h"
+
+class IFTQueueTraceHeader {
+public:
+  enum KeyKindType { SignedKey = 0, UnsignedKey = 1, FloatKey = 2 };
+
+  IFTQueueTraceHeader() :
+    KeyKind(0), KeySize(0), NumberOfValues(0), NumberOfInserts(0),
+    NumberOfUpdates(0), NumberOfPops(0), PeakSize(0), MinKey(0), MaxKey(0)
+  {
+    std::memcpy( Magic, "IFTQTRC1", 8 );
+  }
+
+  template< typename TKey >
+  inline void SetKeyType(){
+    KeyKind = !std::numeric_limits<TKey>::is_integer ? FloatKey :
+      ( std::numeric_limits<TKey>::is_signed ? SignedKey : UnsignedKey );
+    KeySize = sizeof(TKey);
+  }
+
+  template< typename TKey >
+  inline bool IsKeyType() const {
+    IFTQueueTraceHeader h;
+    h.SetKeyType<TKey>();
+    return h.KeyKind == KeyKind && h.KeySize == KeySize;
+  }
+
+  inline bool IsValid() const {
+    return std::memcmp( Magic, "IFTQTRC1", 8 ) == 0;
+  }
+
+  inline unsigned long long GetNumberOfOperations() const {
+    return NumberOfInserts + NumberOfUpdates + NumberOfPops;
+  }
+
+  char               Magic[8];
+  unsigned int       KeyKind;
+  unsigned int       KeySize;
+  // values lie in [0, NumberOfValues)
+  unsigned long long NumberOfValues;
+  unsigned long long NumberOfInserts;
+  unsigned long long NumberOfUpdates;
+  unsigned long long NumberOfPops;
+  // the most values queued at once
+  unsigned long long PeakSize;
+  double             MinKey;
+  double             MaxKey;
+};
+
+// An insert puts a value that isn't queued into the queue, an update
+// lowers the key of one that is, and a pop takes the front value.
+template< typename TKey, typename TValue >
+class IFTQueueTraceEntry {
+public:
+  enum OperationType { Insert = 0, Update = 1, Pop = 2 };
+  unsigned char Operation;
+  TValue        Value;
+  TKey          Key;
+};
+
+class IFTQueueTraceWriter {
+public:
+  IFTQueueTraceWriter() : LastValue(0), LastKey(0), Size(0) {}
+
+  ~IFTQueueTraceWriter(){
+    Close();
+  }
+
+  template< typename TKey >
+  inline bool Open( const std::string & filename, unsigned long long numberOfValues ){
+    Header = IFTQueueTraceHeader();
+    Header.SetKeyType<TKey>();
+    Header.NumberOfValues = numberOfValues;
+    Header.MinKey = std::numeric_limits<double>::max();
+    Header.MaxKey = -std::numeric_limits<double>::max();
+    LastValue = 0;
+    LastKey = 0;
+    Size = 0;
+    Buffer.clear();
+    Out.open( filename.c_str(), std::ios::binary | std::ios::trunc );
+    // the header is written again with the counts by Close
+    Out.write( reinterpret_cast<const char *>( &Header ), sizeof(Header) );
+    return Out.good();
+  }
+
+  // isQueued says whether val is in the queue already, which makes
+  // this an update rather than an insert
+  template< typename TValue, typename TKey >
+  inline void Insert( TValue val, TKey key, bool isQueued ){
+    if ( isQueued )
+      {
+      Buffer.push_back( IFTQueueTraceEntry<TKey, TValue>::Update );
+      ++Header.NumberOfUpdates;
+      }
+    else
+      {
+      Buffer.push_back( IFTQueueTraceEntry<TKey, TValue>::Insert );
+      ++Header.NumberOfInserts;
+      if ( ++Size > Header.PeakSize )
+        {
+        Header.PeakSize = Size;
+        }
+      }
+    PutValue( static_cast<unsigned long long>( val ) );
+    PutKey( key );
+    if ( Buffer.size() > BufferSize )
+      {
+      Flush();
+      }
+  }
+
+  template< typename TValue >
+  inline void Pop( TValue val ){
+    Buffer.push_back( IFTQueueTraceEntry<int, TValue>::Pop );
+    ++Header.NumberOfPops;
+    --Size;
+    PutValue( static_cast<unsigned long long>( val ) );
+    if ( Buffer.size() > BufferSize )
+      {
+      Flush();
+      }
+  }
+
+  // writes what is left and the final header. False if anything
+  // couldn't be written.
+  inline bool Close(){
+    if ( !Out.is_open() )
+      {
+      return true;
+      }
+    Flush();
+    if ( Header.GetNumberOfOperations() == 0 )
+      {
+      Header.MinKey = Header.MaxKey = 0;
+      }
+    Out.seekp( 0 );
+    Out.write( reinterpret_cast<const char *>( &Header ), sizeof(Header) );
+    const bool good = Out.good();
+    Out.close();
+    return good;
+  }
+
+private:
+  static const size_t BufferSize = 1 << 20;
+
+  inline void Flush(){
+    if ( !Buffer.empty() )
+      {
+      Out.write( reinterpret_cast<const char *>( &Buffer[0] ), Buffer.size() );
+      Buffer.clear();
+      }
+  }
+
+  inline void PutVarint( unsigned long long x ){
+    while ( x >= 0x80 )
+      {
+      Buffer.push_back( static_cast<unsigned char>( x | 0x80 ) );
+      x >>= 7;
+      }
+    Buffer.push_back( static_cast<unsigned char>( x ) );
+  }
+
+  inline void PutDifference( long long d ){
+    PutVarint( ( static_cast<unsigned long long>( d ) << 1 ) ^ static_cast<unsigned long long>( d >> 63 ) );
+  }
+
+  inline void PutValue( unsigned long long val ){
+    PutDifference( static_cast<long long>( val - LastValue ) );
+    LastValue = val;
+  }
+
+  template< typename TKey >
+  inline void PutKey( TKey key ){
+    const double k = static_cast<double>( key );
+    Header.MinKey = std::min( Header.MinKey, k );
+    Header.MaxKey = std::max( Header.MaxKey, k );
+    if ( std::numeric_limits<TKey>::is_integer )
+      {
+      const long long ik = static_cast<long long>( key );
+      PutDifference( ik - LastKey );
+      LastKey = ik;
+      }
+    else
+      {
+      const unsigned char *bytes = reinterpret_cast<const unsigned char *>( &key );
+      Buffer.insert( Buffer.end(), bytes, bytes + sizeof(TKey) );
+      }
+  }
+
+  IFTQueueTraceHeader        Header;
+  std::ofstream              Out;
+  std::vector<unsigned char> Buffer;
+  unsigned long long         LastValue;
+  long long                  LastKey;
+  unsigned long long         Size;
+};
+
+class IFTQueueTraceReader {
+public:
+  IFTQueueTraceReader() : LastValue(0), LastKey(0), Position(0), Remaining(0), Truncated(false) {}
+
+  inline bool Open( const std::string & filename ){
+    In.close();
+    In.clear();
+    In.open( filename.c_str(), std::ios::binary );
+    In.read( reinterpret_cast<char *>( &Header ), sizeof(Header) );
+    LastValue = 0;
+    LastKey = 0;
+    Buffer.clear();
+    Position = 0;
+    Remaining = Header.GetNumberOfOperations();
+    Truncated = false;
+    return In.good() && Header.IsValid();
+  }
+
+  inline const IFTQueueTraceHeader & GetHeader() const {
+    return Header;
+  }
+
+  // whether the file ended before all the operations in the header
+  // had been read
+  inline bool IsTruncated() const {
+    return Truncated;
+  }
+
+  // decodes up to maximum entries, with types that suit the header
+  // (see IFTQueueTraceHeader::IsKeyType). Returns false when there
+  // are none left.
+  template< typename TKey, typename TValue >
+  inline bool Read( std::vector< IFTQueueTraceEntry<TKey, TValue> > & entries, size_t maximum ){
+    entries.clear();
+    while ( Remaining > 0 && entries.size() < maximum )
+      {
+      // a record is at most 1 + 10 + 10 bytes
+      if ( Buffer.size() - Position < 32 && !Fill() && Position >= Buffer.size() )
+        {
+        Truncated = true;
+        Remaining = 0;
+        break;
+        }
+      IFTQueueTraceEntry<TKey, TValue> e;
+      e.Operation = Buffer[Position++];
+      LastValue += static_cast<unsigned long long>( GetDifference() );
+      e.Value = static_cast<TValue>( LastValue );
+      e.Key = TKey();
+      if ( e.Operation != IFTQueueTraceEntry<TKey, TValue>::Pop )
+        {
+        e.Key = GetKey<TKey>();
+        }
+      entries.push_back( e );
+      --Remaining;
+      }
+    return !entries.empty();
+  }
+
+private:
+  inline bool Fill(){
+    Buffer.erase( Buffer.begin(), Buffer.begin() + Position );
+    Position = 0;
+    const size_t kept = Buffer.size();
+    Buffer.resize( kept + ( 1 << 20 ) );
+    In.read( reinterpret_cast<char *>( &Buffer[kept] ), 1 << 20 );
+    Buffer.resize( kept + static_cast<size_t>( In.gcount() ) );
+    return In.gcount() > 0;
+  }
+
+  inline long long GetDifference(){
+    unsigned long long x = 0;
+    unsigned shift = 0;
+    unsigned char b;
+    do
+      {
+      b = Position < Buffer.size() ? Buffer[Position++] : 0;
+      x |= static_cast<unsigned long long>( b & 0x7f ) << shift;
+      shift += 7;
+      }
+    while ( b & 0x80 );
+    return static_cast<long long>( x >> 1 ) ^ -static_cast<long long>( x & 1 );
+  }
+
+  template< typename TKey >
+  inline TKey GetKey(){
+    if ( std::numeric_limits<TKey>::is_integer )
+      {
+      LastKey += GetDifference();
+      return static_cast<TKey>( LastKey );
+      }
+    TKey key = TKey();
+    if ( Position + sizeof(TKey) <= Buffer.size() )
+      {
+      std::memcpy( &key, &Buffer[Position], sizeof(TKey) );
+      }
+    Position += sizeof(TKey);
+    return key;
+  }
+
+  IFTQueueTraceHeader        Header;
+  std::ifstream              In;
+  std::vector<unsigned char> Buffer;
+  unsigned long long         LastValue;
+  long long                  LastKey;
+  size_t                     Position;
+  unsigned long long         Remaining;
+  bool                       Truncated;
+};
+
+// How a replay drives a queue: setting it up from the trace header,
+// queueing a value and taking the front one. The general form suits
+// queues that need no setting up and whose insert also lowers the
+// key of a queued value, as the IFT filter uses them. Other queues,
+// including new ones, get a specialisation below.
+class IFTQueueReplayBasicOps {
+public:
+  template< typename TQueue, typename TValue, typename TKey >
+  inline void Insert( TQueue & q, TValue val, TKey key ){
+    q.insert( val, key );
+  }
+
+  template< typename TValue, typename TQueue >
+  inline TValue Pop( TQueue & q ){
+    TValue val = q.front_value();
+    q.pop();
+    return val;
+  }
+};
+
+template< typename TQueue >
+class IFTQueueReplayOps : public IFTQueueReplayBasicOps {
+public:
+  inline void Initialize( TQueue &, const IFTQueueTraceHeader & ){}
+};
+
+template< typename TKey, typename TValue, typename TKeyComp, typename TValueComp, typename TAllocator >
+class IFTQueueReplayOps< IFTQueueB<TKey, TValue, TKeyComp, TValueComp, TAllocator> > :
+    public IFTQueueReplayBasicOps {
+public:
+  inline void Initialize( IFTQueueB<TKey, TValue, TKeyComp, TValueComp, TAllocator> & q,
+                          const IFTQueueTraceHeader & h ){
+    q.reserve( static_cast<size_t>( h.NumberOfValues ) );
+  }
+};
+
+template< typename TKey, typename TValue, typename TKeyComp, unsigned int VArity >
+class IFTQueueReplayOps< IFTHeapQueue<TKey, TValue, TKeyComp, VArity> > :
+    public IFTQueueReplayBasicOps {
+public:
+  inline void Initialize( IFTHeapQueue<TKey, TValue, TKeyComp, VArity> & q,
+                          const IFTQueueTraceHeader & h ){
+    q.SetNumberOfValues( static_cast<size_t>( h.NumberOfValues ) );
+  }
+};
+
+template< typename TKey, typename TValue >
+class IFTQueueReplayOps< IFTBucketQueue<TKey, TValue> > :
+    public IFTQueueReplayBasicOps {
+public:
+  inline void Initialize( IFTBucketQueue<TKey, TValue> & q, const IFTQueueTraceHeader & h ){
+    q.Initialize( static_cast<size_t>( h.NumberOfValues ),
+                  static_cast<long>( h.MinKey ), static_cast<long>( h.MaxKey ) );
+  }
+};
+
+template< typename TKey, typename TValue >
+class IFTQueueReplayOps< IFTRadixQueue<TKey, TValue> > :
+    public IFTQueueReplayBasicOps {
+public:
+  inline void Initialize( IFTRadixQueue<TKey, TValue> & q, const IFTQueueTraceHeader & h ){
+    q.SetNumberOfValues( static_cast<size_t>( h.NumberOfValues ) );
+  }
+};
+
+// stale entries are recognised, as in the filter, by their key no
+// longer being the latest one given for the value
+template< typename TKey, typename TValue, typename TKeyComp >
+class IFTQueueReplayOps< IFTLazyQueue<TKey, TValue, TKeyComp> > {
+public:
+  inline void Initialize( IFTLazyQueue<TKey, TValue, TKeyComp> &, const IFTQueueTraceHeader & h ){
+    Keys.assign( static_cast<size_t>( h.NumberOfValues ), TKey() );
+  }
+
+  template< typename TQueue >
+  inline void Insert( TQueue & q, TValue val, TKey key ){
+    Keys[val] = key;
+    q.insert( val, key );
+  }
+
+  template< typename TPopValue, typename TQueue >
+  inline TPopValue Pop( TQueue & q ){
+    while ( q.front_key() != Keys[q.front_value()] )
+      {
+      q.discard();
+      }
+    TPopValue val = q.front_value();
+    q.pop();
+    return val;
+  }
+
+private:
+  std::vector<TKey> Keys;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/* Disk backed scratch memory for the streaming mode of the IFT
+* filter. Scratch blocks are shared mappings of temporary files, which
+* are unlinked as soon as they are mapped, so they disappear with the
+* mapping even if the process dies. Pages of a shared file mapping
+* can be dropped from memory at any time (IFTTrimScratch, or the
+* kernel under memory pressure) without losing their contents, which
+* are read back from the file on the next access. That is what lets
+* the working set of a flood be held at a budget while the images it
+* works on are larger than memory.
+*
+* IFTMapFile maps an existing file privately instead, which is how
+* images are read without copying them.
+*
+* POSIX only: elsewhere the mapping functions fail and callers fall
+* back to ordinary memory.
+*/
+
+#ifndef _itk_IFTScratchFile_h_
+#define _itk_IFTScratchFile_h_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <new>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#define IFT_HAVE_SCRATCH_FILES
+#endif
+
+// a mapping of a new, already unlinked, file of the given size in
+// directory, or null if that can't be done
+inline void * IFTMapScratch( const std::string & directory, size_t bytes ){
+#ifdef IFT_HAVE_SCRATCH_FILES
+  if ( bytes == 0 )
+    {
+    return 0;
+    }
+  std::string name = directory + "/iftscratchXXXXXX";
+  std::vector<char> path( name.begin(), name.end() );
+  path.push_back( '\0' );
+  int fd = mkstemp( &path[0] );
+  if ( fd < 0 )
+    {
+    return 0;
+    }
+  unlink( &path[0] );
+  void * data = MAP_FAILED;
+  if ( ftruncate( fd, static_cast<off_t>( bytes ) ) == 0 )
+    {
+    data = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    }
+  if ( data != MAP_FAILED )
+    {
+    // no read around on faults, the accesses are scattered
+    madvise( data, bytes, MADV_RANDOM );
+    }
+  // the mapping keeps the file
+  close( fd );
+  return data == MAP_FAILED ? 0 : data;
+#else
+  (void)directory;
+  (void)bytes;
+  return 0;
+#endif
+}
+
+// a private, copy on write, mapping of bytes of the file at path,
+// starting offset bytes in, or null. Changes to the memory don't go
+// to the file. The offset need not be page aligned, so the mapping as
+// a whole, to be given to IFTUnmapScratch, goes in base and length.
+inline void * IFTMapFile( const std::string & path, size_t offset, size_t bytes,
+			  void ** base, size_t * length ){
+#ifdef IFT_HAVE_SCRATCH_FILES
+  if ( bytes == 0 )
+    {
+    return 0;
+    }
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    {
+    return 0;
+    }
+  const size_t page = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+  const size_t start = offset / page * page;
+  const size_t size = bytes + ( offset - start );
+  void * data = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, static_cast<off_t>( start ) );
+  close( fd );
+  if ( data == MAP_FAILED )
+    {
+    return 0;
+    }
+  *base = data;
+  *length = size;
+  return static_cast<char *>( data ) + ( offset - start );
+#else
+  (void)path;
+  (void)offset;
+  (void)bytes;
+  (void)base;
+  (void)length;
+  return 0;
+#endif
+}
+
+inline void IFTUnmapScratch( void * data, size_t bytes ){
+#ifdef IFT_HAVE_SCRATCH_FILES
+  if ( data )
+    {
+    munmap( data, bytes );
+    }
+#else
+  (void)data;
+  (void)bytes;
+#endif
+}
+
+// drop the whole pages in [data, data + bytes) from memory. Their
+// contents stay in the file.
+inline void IFTTrimScratch( void * data, size_t bytes ){
+#ifdef IFT_HAVE_SCRATCH_FILES
+  const size_t page = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+  size_t begin = reinterpret_cast<size_t>( data );
+  size_t end = begin + bytes;
+  begin = ( begin + page - 1 ) / page * page;
+  end = end / page * page;
+  if ( end > begin )
+    {
+    madvise( reinterpret_cast<void *>( begin ), end - begin, MADV_DONTNEED );
+    }
+#else
+  (void)data;
+  (void)bytes;
+#endif
+}
+
+// Where the blocks of a queue go. Blocks come from operator new
+// until MemoryLimit bytes of them are held, after that they are carved
+// out of large scratch file mappings in Directory, whose pages Trim
+// drops from memory. Without a directory, or if mapping fails,
+// everything comes from operator new. Blocks in mappings are only
+// given back when the arena goes, which suits the queues, as they
+// keep their storage until they are destroyed.
+class IFTSpillArena {
+public:
+  IFTSpillArena() : MemoryLimit(0), HeapSize(0), RegionUsed(0), RegionSize(0), SpilledSize(0) {}
+
+  ~IFTSpillArena(){
+    for ( size_t i = 0; i < Regions.size(); ++i )
+      {
+      IFTUnmapScratch( Regions[i].first, Regions[i].second );
+      }
+  }
+
+  inline void SetDirectory( const std::string & directory ){
+    Directory = directory;
+  }
+
+  inline void SetMemoryLimit( size_t bytes ){
+    MemoryLimit = bytes;
+  }
+
+  inline void * allocate( size_t bytes ){
+    const size_t total = ( bytes + sizeof(size_t) - 1 ) / sizeof(size_t) * sizeof(size_t);
+    if ( !Directory.empty() && HeapSize + total > MemoryLimit )
+      {
+      if ( RegionUsed + total > RegionSize )
+        {
+        const size_t size = total > MinimumRegionSize ? total : MinimumRegionSize;
+        void * region = IFTMapScratch( Directory, size );
+        if ( region )
+          {
+          Regions.push_back( std::make_pair( region, size ) );
+          RegionUsed = 0;
+          RegionSize = size;
+          }
+        }
+      if ( RegionUsed + total <= RegionSize )
+        {
+        void * data = static_cast<char *>( Regions.back().first ) + RegionUsed;
+        RegionUsed += total;
+        SpilledSize += total;
+        return data;
+        }
+      }
+    HeapSize += total;
+    return ::operator new( total );
+  }
+
+  inline void deallocate( void * p, size_t bytes ){
+    // the block itself isn't read, as that would page it back in
+    const char * c = static_cast<const char *>( p );
+    for ( size_t i = 0; i < Regions.size(); ++i )
+      {
+      const char * region = static_cast<const char *>( Regions[i].first );
+      if ( c >= region && c < region + Regions[i].second )
+        {
+        return;
+        }
+      }
+    HeapSize -= ( bytes + sizeof(size_t) - 1 ) / sizeof(size_t) * sizeof(size_t);
+    ::operator delete( p );
+  }
+
+  // drop the mapped blocks from memory. They are read back from the
+  // files when next used.
+  inline void Trim(){
+    for ( size_t i = 0; i < Regions.size(); ++i )
+      {
+      IFTTrimScratch( Regions[i].first, Regions[i].second );
+      }
+  }
+
+  // scratch files mapped, and the bytes of blocks placed in them
+  inline size_t GetNumberOfSpills() const {
+    return Regions.size();
+  }
+
+  inline size_t GetSpilledSize() const {
+    return SpilledSize;
+  }
+
+private:
+  static const size_t MinimumRegionSize = size_t(1) << 26;
+
+  std::string Directory;
+  size_t MemoryLimit;
+  size_t HeapSize;
+  std::vector< std::pair<void *, size_t> > Regions;
+  size_t RegionUsed;
+  size_t RegionSize;
+  size_t SpilledSize;
+};
+
+// standard allocator interface on top of an IFTSpillArena, for the
+// storage of queues. Without an arena it is a plain allocator.
+template< typename T >
+class IFTSpillAllocator {
+public:
+  typedef T              value_type;
+  typedef T *            pointer;
+  typedef const T *      const_pointer;
+  typedef T &            reference;
+  typedef const T &      const_reference;
+  typedef size_t         size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template< typename U >
+  struct rebind {
+    typedef IFTSpillAllocator<U> other;
+  };
+
+  IFTSpillAllocator() : Arena(0) {}
+
+  explicit IFTSpillAllocator( IFTSpillArena * arena ) : Arena(arena) {}
+
+  template< typename U >
+  IFTSpillAllocator( const IFTSpillAllocator<U> & other ) : Arena(other.GetArena()) {}
+
+  inline pointer address( reference x ) const { return &x; }
+  inline const_pointer address( const_reference x ) const { return &x; }
+
+  inline pointer allocate( size_type n, const void * = 0 ){
+    if ( Arena )
+      {
+      return static_cast<pointer>( Arena->allocate( n * sizeof(T) ) );
+      }
+    return static_cast<pointer>( ::operator new( n * sizeof(T) ) );
+  }
+
+  inline void deallocate( pointer p, size_type n ){
+    if ( Arena )
+      {
+      Arena->deallocate( p, n * sizeof(T) );
+      return;
+      }
+    ::operator delete( p );
+  }
+
+  inline size_type max_size() const {
+    return size_type(-1) / sizeof(T);
+  }
+
+  inline void construct( pointer p, const T & val ){
+    new( static_cast<void *>( p ) ) T( val );
+  }
+
+  inline void destroy( pointer p ){
+    p->~T();
+  }
+
+  inline IFTSpillArena * GetArena() const {
+    return Arena;
+  }
+
+private:
+  IFTSpillArena * Arena;
+};
+
+template< typename T, typename U >
+inline bool operator==( const IFTSpillAllocator<T> & a, const IFTSpillAllocator<U> & b ){
+  return a.GetArena() == b.GetArena();
+}
+
+template< typename T, typename U >
+inline bool operator!=( const IFTSpillAllocator<T> & a, const IFTSpillAllocator<U> & b ){
+  return a.GetArena() != b.GetArena();
+}
+
+#endif
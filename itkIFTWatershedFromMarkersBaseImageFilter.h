@@ -3,12 +3,115 @@
 #define __itkIFTWatershedFromMarkersBaseImageFilter_h
 
 #include "itkImageToImageFilter.h"
-
-//#define QUEUEA
+#include "itkProgressReporter.h"
+#include "itkMultiThreader.h"
 #include "itkIFTQueue.h"
+#include "itkIFTQueueTrace.h"
+#include "itkFlatNeighborhood.h"
+#include "itkHierarchicalQueue.h"
+#include "itkPriorityFunctorBatch.h"
+#include "itkMemoryMappedImageContainer.h"
+#include "itkWatershedFloodStatistics.h"
+#include "itkWatershedMemoryEstimate.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <string>
+#include <utility>
 
 namespace itk
 {
+/** \class IFTPriorityFunctorTraits
+ * \brief Describes the costs produced by an IFT priority functor.
+ *
+ * CostType is the narrowest type that holds every cost the functor
+ * can produce from pixels of type TInputPixel. It is the default cost
+ * type of the IFT filter, so functors that stay within the range of
+ * a small integer type should specialize this. An integer CostType
+ * with a bounded IFTBucketKeyRange lets the filter use a bucket
+ * queue.
+ */
+template< class TPriorityFunction, class TInputPixel >
+class IFTPriorityFunctorTraits
+{
+public:
+  typedef typename NumericTraits< TInputPixel >::RealType CostType;
+};
+
+/** \class IFTFloodValues
+ * \brief The values the IFT flood gives its priority functor, by
+ * buffer offset.
+ *
+ * These are the input pixels, read in place. A functor working on
+ * something derived from the input can specialize this to work it out
+ * as the flood goes, and set OnDemand. The flood then calls SetDone
+ * for each pixel once it is finished with it, and uses the values
+ * from one thread only, so ParallelFlood is not used. Only
+ * Vectorizable functors are given the values of done pixels, so they
+ * shouldn't be paired with values on demand. Footprint is the most
+ * memory the values take.
+ */
+template< class TPriorityFunction, class TInputImage >
+class IFTFloodValues
+{
+public:
+  typedef typename TInputImage::PixelType ValueType;
+  itkStaticConstMacro(OnDemand, bool, false);
+
+  IFTFloodValues(const TInputImage *image, const TPriorityFunction &) :
+    m_Buffer( image->GetBufferPointer() )
+  {}
+
+  ValueType operator[](SizeValueType p) const { return m_Buffer[p]; }
+  void SetDone(SizeValueType) {}
+
+  static double Footprint(const typename TInputImage::RegionType &) { return 0; }
+
+private:
+  const ValueType *m_Buffer;
+};
+
+/** \class IFTQueueStrategy
+ * \brief The queues the serial IFT flood can use.
+ *
+ * All of them give out pixels of equal cost in the order they were
+ * queued, so the output doesn't depend on the choice, only the time
+ * and memory do. QueueA is the original tree of (cost, insertion
+ * time) pairs and QueueB a tree of costs with a list of pixels per
+ * cost, searched on update. Bucket is an array of lists indexed by
+ * cost, only for costs with a bounded IFTBucketKeyRange. Heap is an
+ * indexed 4-ary heap, Lazy a binary heap that leaves stale entries
+ * behind rather than updating, and Radix a radix heap. Auto picks one
+ * for the image at hand, see
+ * IFTWatershedFromMarkersBaseImageFilter::SetQueueStrategy.
+ */
+class IFTQueueStrategy
+{
+public:
+  typedef enum { Auto, QueueA, QueueB, Bucket, Heap, Lazy, Radix } Type;
+
+  /** The lower case name of a strategy, as taken by FromName */
+  static const char * GetName(Type strategy)
+  {
+    static const char * const names[] = { "auto", "a", "b", "bucket", "heap", "lazy", "radix" };
+    return names[strategy];
+  }
+
+  /** The strategy called name, returning false if there is none */
+  static bool FromName(const std::string & name, Type & strategy)
+  {
+    for ( int s = Auto; s <= Radix; ++s )
+      {
+      if ( name == GetName( static_cast< Type >( s ) ) )
+	{
+	strategy = static_cast< Type >( s );
+	return true;
+	}
+      }
+    return false;
+  }
+};
+
 /** \class IFTWatershedFromMarkersBaseImageFilter
  * \brief IFT watershed transform from markers
  *
@@ -35,6 +138,12 @@ namespace itk
  * memory footprint. The more complex queue will also contribute to a
  * higher memory footprint.
  *
+ * TCost is the type of the cost image and queue keys. It must hold
+ * every value the priority functor returns. The default, from
+ * IFTPriorityFunctorTraits, is the input pixel type for the
+ * watershed functor rather than a double, so a short image needs 2
+ * bytes of cost per pixel instead of 8.
+ *
  * This class should be equivalent to the mmswatershed function in the
  * SDC toolbox.
  *
@@ -53,7 +162,9 @@ namespace itk
 
 
 
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction,
+	  class TCost = typename IFTPriorityFunctorTraits< TPriorityFunction,
+							   typename TInputImage::PixelType >::CostType >
 class ITK_EXPORT IFTWatershedFromMarkersBaseImageFilter:
     public ImageToImageFilter< TInputImage, TLabelImage >
 {
@@ -79,6 +190,7 @@ public:
   typedef typename LabelImageType::IndexType IndexType;
 
   typedef TPriorityFunction PriorityFunctorType;
+  typedef TCost             CostType;
 
 
   /** ImageDimension constants */
@@ -137,6 +249,182 @@ public:
   itkGetConstReferenceMacro(MarkWatershedLine, bool);
   itkBooleanMacro(MarkWatershedLine);
 
+  /**
+   * Set/Get whether the done and boundary flags of each pixel are
+   * packed into the top two bits of the output labels, rather than
+   * kept in a separate flag image. This saves a byte per pixel and a
+   * memory access per neighbour. It needs the marker labels to leave
+   * those bits free: if they don't, a warning is given and the flag
+   * image is used. Default is false.
+   */
+  itkSetMacro(PackedState, bool);
+  itkGetConstReferenceMacro(PackedState, bool);
+  itkBooleanMacro(PackedState);
+
+  /**
+   * Set/Get whether the flood runs on all threads. The output is split
+   * into one tile per thread and the minimum path costs are computed
+   * by flooding each tile from its own markers, then repairing the
+   * tile seams: cost improvements across a seam are propagated into
+   * the neighbouring tile, in rounds, until none are left. The costs
+   * don't depend on the order in which pixels are visited, so they
+   * are the same as in a serial flood. The labels are then given out
+   * by a cheap replay of the serial visiting order over the final
+   * costs, so the output, including the choice between equally cheap
+   * markers, is identical to the serial one. PackedState is ignored
+   * in this mode, and it isn't used with a priority functor whose
+   * values are computed on demand (see IFTFloodValues). Default is
+   * false.
+   */
+  itkSetMacro(ParallelFlood, bool);
+  itkGetConstReferenceMacro(ParallelFlood, bool);
+  itkBooleanMacro(ParallelFlood);
+
+  /**
+   * The number of seam repair rounds of the last parallel flood.
+   */
+  itkGetConstMacro(NumberOfSeamRounds, SizeValueType);
+
+  /**
+   * Set/Get whether the output buffer and the internal cost and flag
+   * images are kept after an update, and used again by the next
+   * update of an image of the same size rather than allocated
+   * again. The next update overwrites the output of this one, even if
+   * it has been disconnected from the filter, so it has to have been
+   * used by then. Meant for running one filter over many images in
+   * turn. Default is false.
+   */
+  itkSetMacro(ReuseBuffers, bool);
+  itkGetConstReferenceMacro(ReuseBuffers, bool);
+  itkBooleanMacro(ReuseBuffers);
+
+  /**
+   * Set/Get the memory budget, in bytes, of a streaming flood, for
+   * images larger than memory. When it is non zero the labels, costs
+   * and flags are kept in scratch files in ScratchDirectory, mapped
+   * into memory, and the slabs of them the flood has gone longest
+   * without working from are dropped from memory whenever there are
+   * more than the budget allows. Queue storage beyond an eighth of
+   * the budget goes in scratch files too. The output is the same as
+   * without a budget. A budget below what the flood front works on
+   * at once is kept to by reading slabs back repeatedly, which is
+   * slow. The input image is not managed and should itself be file
+   * backed if it doesn't fit in memory. Takes
+   * precedence over ParallelFlood and PackedState. Default is 0, no
+   * streaming.
+   */
+  itkSetMacro(MemoryBudget, SizeValueType);
+  itkGetConstMacro(MemoryBudget, SizeValueType);
+
+  /**
+   * Set/Get the directory for the scratch files of a streaming
+   * flood. The files are removed as soon as they are made. Default is
+   * empty, meaning $TMPDIR or /tmp.
+   */
+  itkSetStringMacro(ScratchDirectory);
+  itkGetStringMacro(ScratchDirectory);
+
+  /**
+   * The number of slabs dropped from memory, and of scratch files
+   * made for queue storage, by the last streaming flood.
+   */
+  itkGetConstMacro(NumberOfTrimmedSlabs, SizeValueType);
+  itkGetConstMacro(NumberOfQueueSpills, SizeValueType);
+
+  /**
+   * The number of stale queue entries skipped during the last
+   * update. Only the lazy deletion queue (the Lazy strategy) leaves stale
+   * entries, so this is zero for the other queues.
+   */
+  itkGetConstMacro(NumberOfStalePops, SizeValueType);
+
+  /**
+   * Set/Get a file to record the queue operations of the flood in, as
+   * an IFTQueueTrace, so that queues can be compared on it offline
+   * with replayQueue. Only the serial flood records: nothing is
+   * written with ParallelFlood or a MemoryBudget. Default is empty,
+   * no recording.
+   */
+  itkSetStringMacro(QueueTraceFile);
+  itkGetStringMacro(QueueTraceFile);
+
+  /** The queues of the serial flood, see IFTQueueStrategy */
+  typedef IFTQueueStrategy::Type QueueStrategyType;
+
+  /**
+   * Set/Get the queue of the serial flood. Auto, the default, uses a
+   * bucket queue for costs with a bounded IFTBucketKeyRange and a
+   * radix heap otherwise, which were the fastest on every image size
+   * and cost distribution timed. Bucket with unbounded costs is taken
+   * as Auto, with a warning. The parallel and streaming floods always
+   * use a hierarchical queue.
+   */
+  itkSetMacro(QueueStrategy, QueueStrategyType);
+  itkGetConstMacro(QueueStrategy, QueueStrategyType);
+
+  /** The queue the last update used, Auto resolved */
+  itkGetConstMacro(SelectedQueueStrategy, QueueStrategyType);
+
+  /**
+   * Node allocation by the tree based queues (the QueueA and QueueB
+   * strategies) during the last update. Their nodes
+   * come from an arena, grown in slabs sized from the pixel count and
+   * released in bulk at the end of GenerateData. Reports the number of
+   * node allocations, the number of slabs obtained from the system
+   * and the peak arena size in bytes. All zero for the other queues.
+   */
+  itkGetConstMacro(NumberOfNodeAllocations, SizeValueType);
+  itkGetConstMacro(NumberOfSlabAllocations, SizeValueType);
+  itkGetConstMacro(PeakArenaSize, SizeValueType);
+
+  /**
+   * Set/Get whether the flood counts what it does, for
+   * GetStatistics. The counting is compiled into a separate flood, so
+   * there is no cost when it is off. Only the serial flood counts:
+   * with ParallelFlood or a MemoryBudget the statistics stay at
+   * zero. Default is false.
+   */
+  itkSetMacro(CollectStatistics, bool);
+  itkGetConstReferenceMacro(CollectStatistics, bool);
+  itkBooleanMacro(CollectStatistics);
+
+  /**
+   * The seeds, pops, decrease-key updates, rejected relaxations, peak
+   * queue size, distinct priorities and phase times of the last
+   * update, if CollectStatistics was on.
+   */
+  const WatershedFloodStatistics & GetStatistics() const { return m_Statistics; }
+
+  /**
+   * The peak memory of an update of region with these settings. A
+   * MemoryBudget gives the streaming flood, which keeps to its budget,
+   * give or take its records of which slabs are in memory.
+   */
+  static WatershedMemoryEstimate EstimateMemory(const LabelImageRegionType & region,
+						bool fullyConnected,
+						bool packedState = false,
+						bool parallelFlood = false,
+						SizeValueType memoryBudget = 0,
+						QueueStrategyType queueStrategy = IFTQueueStrategy::Auto);
+
+  /**
+   * Set/Get the memory, in bytes, an update may use. Before anything
+   * is allocated the worst case of the settings is estimated and, if
+   * it is over the limit, the first leaner configuration that fits
+   * is run instead, with a warning: a serial flood in place of
+   * ParallelFlood, then PackedState, then a streaming flood with the
+   * limit as its MemoryBudget. If none fits, or a MemoryBudget set
+   * explicitly doesn't, the update fails. The input and marker images
+   * aren't counted. Default is 0, no limit.
+   */
+  itkSetMacro(MemoryLimit, SizeValueType);
+  itkGetConstMacro(MemoryLimit, SizeValueType);
+
+  /**
+   * The estimate for the configuration the last update ran.
+   */
+  const WatershedMemoryEstimate & GetMemoryEstimate() const { return m_MemoryEstimate; }
+
 
   /**
    * Set/Get functors controlling the priority. This controls which
@@ -168,9 +456,16 @@ protected:
    * \sa ProcessObject::EnlargeOutputRequestedRegion() */
   void EnlargeOutputRequestedRegion( DataObject *itkNotUsed(output) );
 
-  /** The filter is single threaded. */
+  /** The initialisation pass, which sets up the state of every pixel
+   * and finds the seeds of the flood, is split between threads. The
+   * flood itself is single threaded unless ParallelFlood is on. Pixels are addressed by 32 bit
+   * buffer offsets, or 64 bit ones for images of more than 4G
+   * pixels. */
   void GenerateData();
 
+  /** Sets the output up on the kept buffer with ReuseBuffers */
+  void AllocateOutputs();
+
 private:
   //purposely not implemented
   IFTWatershedFromMarkersBaseImageFilter(const Self &);
@@ -180,10 +475,81 @@ private:
 
   bool m_MarkWatershedLine;
 
+  bool m_PackedState;
+
+  bool m_ParallelFlood;
+
+  bool m_ReuseBuffers;
+
+  SizeValueType m_NumberOfSeamRounds;
+
+  SizeValueType m_MemoryBudget;
+  std::string   m_ScratchDirectory;
+  SizeValueType m_NumberOfTrimmedSlabs;
+  SizeValueType m_NumberOfQueueSpills;
+
+  SizeValueType m_NumberOfStalePops;
+  std::string   m_QueueTraceFile;
+  SizeValueType m_NumberOfNodeAllocations;
+  SizeValueType m_NumberOfSlabAllocations;
+  SizeValueType m_PeakArenaSize;
+
+  QueueStrategyType m_QueueStrategy;
+  QueueStrategyType m_SelectedQueueStrategy;
+
+  /** Resolve Auto, and Bucket where it can't be used */
+  QueueStrategyType SelectQueueStrategy() const;
+
+  bool                     m_CollectStatistics;
+  WatershedFloodStatistics m_Statistics;
+
+  SizeValueType           m_MemoryLimit;
+  WatershedMemoryEstimate m_MemoryEstimate;
+
+  /** Leave the configuration to run as set, or make it leaner to fit
+   * in MemoryLimit */
+  void ChooseConfiguration(bool & parallelFlood, bool & packedState, SizeValueType & memoryBudget);
+
+  /** The scratch images, seeds and queue of an in memory flood with
+   * entries pixels queued at once */
+  static double FloodFootprint(double numberOfPixels, double entries, unsigned int neighbors,
+			       bool packedState, bool parallelFlood, QueueStrategyType queueStrategy);
+
+  /** The bytes per pixel of the scratch files of a streaming flood,
+   * the least budget it can keep to, and what it uses beyond it */
+  static double StreamingBytesPerPixel();
+  static double StreamingMinimumBudget();
+  static double StreamingOverhead(double numberOfPixels);
+
+  typedef CostType PriorityType;
+
+  // what the priority functor is given
+  typedef IFTFloodValues< TPriorityFunction, TInputImage > FloodValuesType;
+  typedef typename FloodValuesType::ValueType              FloodValueType;
+
+  // scratch images, and the buffers kept for them and the output
+  // with ReuseBuffers
+  typedef Image< PriorityType, ImageDimension >  CostImageType;
+  typedef Image< unsigned char, ImageDimension > FlagImageType;
+  typename CostImageType::Pointer                m_CostBuffer;
+  typename FlagImageType::Pointer                m_FlagBuffer;
+  typename LabelImageType::PixelContainerPointer m_OutputBuffer;
+
+  /** An image of region, the one kept in buffer if ReuseBuffers is
+   * set and it is the same size, otherwise a new one, which is kept
+   * with ReuseBuffers */
+  template< class TImage >
+  typename TImage::Pointer GetScratchImage(typename TImage::Pointer & buffer,
+					   const LabelImageRegionType & region);
+
+  // The queue holds linear offsets into the image buffers. The offset
+  // type is chosen at run time from the image size (see
+  // GenerateData), so each queue is described by a policy templated
+  // over it, giving the queue type and how to set it up, fill it and
+  // drain it. The serial flood is compiled for every policy, and
+  // picks one at run time from the SelectedQueueStrategy.
 
-#ifdef QUEUEA
   // typedefs for the double queue structure
-  typedef typename itk::NumericTraits<InputImagePixelType>::RealType PriorityType;
   typedef long IterationType;
 
   // priority has two elements, to preserve fifo ordering on plateaus
@@ -215,20 +581,396 @@ private:
     }
   };
 
-  typedef IFTQueueA<CombPriorityType, IndexType, ComparePriority, 
-		    typename IndexType::LexicographicCompare> DoubleQueueType;
-#else
-    // alternative version that doesn't use two elements in the
-    // priority class, but needs to do a search within the list at the
-    // specific priority to find the voxel.
-  typedef typename itk::NumericTraits<InputImagePixelType>::RealType PriorityType;
+  // what most queues need: the keys are the costs, and no stale
+  // entries are left behind
+  template< class TQueue, class TOffset >
+  class QueuePolicyBase {
+  public:
+    typedef TQueue Type;
+    void Insert( Type & q, TOffset value, PriorityType cost ) { q.insert( value, cost ); }
+    bool DiscardStale( Type &, const PriorityType * ) { return false; }
+    SizeValueType GetNumberOfStalePops( const Type & ) const { return 0; }
+  };
+
+  // the cost is paired with an insertion counter, which keeps the
+  // keys unique and gives the fifo ordering
+  template< class TOffset >
+  class QueueAPolicy {
+  public:
+    typedef IFTQueueA<CombPriorityType, TOffset, ComparePriority,
+		      std::less<TOffset>, IFTPoolAllocator<TOffset> > Type;
+    QueueAPolicy() : m_GlobalTime(0) {}
+    void Initialize( Type & q, size_t numberOfValues ) { q.reserve( numberOfValues ); }
+    void Insert( Type & q, TOffset value, PriorityType cost )
+    {
+      CombPriorityType P;
+      P.P = cost;
+      P.time = m_GlobalTime;
+      ++m_GlobalTime;
+      q.insert( value, P );
+    }
+    bool DiscardStale( Type &, const PriorityType * ) { return false; }
+    SizeValueType GetNumberOfStalePops( const Type & ) const { return 0; }
+  private:
+    IterationType m_GlobalTime;
+  };
+
+  // alternative version that doesn't use two elements in the
+  // priority class, but needs to do a search within the list at the
+  // specific priority to find the voxel.
+  template< class TOffset >
+  class QueueBPolicy:
+    public QueuePolicyBase< IFTQueueB<PriorityType, TOffset, std::less<PriorityType>,
+				      IFTValueLess<TOffset>, IFTPoolAllocator<TOffset> >, TOffset >
+  {
+  public:
+    typedef typename QueueBPolicy::Type Type;
+    void Initialize( Type & q, size_t numberOfValues ) { q.reserve( numberOfValues ); }
+  };
+
+  // an array of lists indexed by the cost, which avoids the
+  // search. Only for costs with a bounded IFTBucketKeyRange: for
+  // others this is QueueB, but SelectQueueStrategy never picks it.
+  template< class TOffset >
+  class BucketQueuePolicy:
+    public QueuePolicyBase< typename IFTDefaultQueue<PriorityType, TOffset, PriorityType,
+						     IFTBucketKeyRange<PriorityType>::Bounded>::Type, TOffset >
+  {
+  public:
+    typedef typename BucketQueuePolicy::Type Type;
+    void Initialize( Type & q, size_t numberOfValues )
+    {
+      IFTDefaultQueue<PriorityType, TOffset, PriorityType,
+		      IFTBucketKeyRange<PriorityType>::Bounded>::Initialize( q, numberOfValues );
+    }
+  };
 
+  // indexed d-ary heap. The heap position of each pixel is kept in a
+  // flat array. Fifo ordering on plateaus is handled by the queue.
+  template< class TOffset >
+  class HeapQueuePolicy:
+    public QueuePolicyBase< IFTHeapQueue<PriorityType, TOffset>, TOffset >
+  {
+  public:
+    typedef typename HeapQueuePolicy::Type Type;
+    void Initialize( Type & q, size_t numberOfValues ) { q.SetNumberOfValues( numberOfValues ); }
+  };
 
+  // binary heap with lazy deletion - updates push a new entry and
+  // stale entries are skipped when popped, by comparing their key
+  // with the cost image.
+  template< class TOffset >
+  class LazyQueuePolicy:
+    public QueuePolicyBase< IFTLazyQueue<PriorityType, TOffset>, TOffset >
+  {
+  public:
+    typedef typename LazyQueuePolicy::Type Type;
+    void Initialize( Type &, size_t ) {}
+    // a later, cheaper, entry for this pixel has already been popped
+    bool DiscardStale( Type & q, const PriorityType * costBuf )
+    {
+      if ( q.front_key() != costBuf[q.front_value()] )
+	{
+	q.discard();
+	return true;
+	}
+      return false;
+    }
+    SizeValueType GetNumberOfStalePops( const Type & q ) const { return q.stale_count(); }
+  };
 
-  typedef IFTQueueB<PriorityType, IndexType, std::less<PriorityType>, typename IndexType::LexicographicCompare> DoubleQueueType;
-  
+  // radix heap - relies on the IFT costs being monotone, and handles
+  // floating point costs without quantizing them.
+  template< class TOffset >
+  class RadixQueuePolicy:
+    public QueuePolicyBase< IFTRadixQueue<PriorityType, TOffset>, TOffset >
+  {
+  public:
+    typedef typename RadixQueuePolicy::Type Type;
+    void Initialize( Type & q, size_t numberOfValues ) { q.SetNumberOfValues( numberOfValues ); }
+  };
 
-#endif
+  /** The Footprint of a queue, with keys distinct costs possible */
+  template< class TOffset >
+  static double QueueFootprint(QueueStrategyType queueStrategy, double numberOfPixels,
+			       double entries, double keys)
+  {
+    switch ( queueStrategy )
+      {
+      case IFTQueueStrategy::QueueA:
+	return QueueAPolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      case IFTQueueStrategy::QueueB:
+	return QueueBPolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      case IFTQueueStrategy::Bucket:
+	return BucketQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      case IFTQueueStrategy::Heap:
+	return HeapQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      case IFTQueueStrategy::Lazy:
+	return LazyQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      case IFTQueueStrategy::Radix:
+	return RadixQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      default:
+	// Auto
+	return IFTBucketKeyRange< PriorityType >::Bounded
+	  ? BucketQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys )
+	  : RadixQueuePolicy< TOffset >::Type::Footprint( numberOfPixels, entries, keys );
+      }
+  }
+
+  // The per pixel state of the flood: the label, whether the pixel
+  // is done and whether it is on the boundary shell of the
+  // image. Every pixel is set with Initialize before anything else is
+  // done to it. FlagState keeps the flags in a separate image, which
+  // is passed in if UsesFlags is set.
+  class FlagState {
+  public:
+    static const bool UsesFlags = true;
+    FlagState( LabelImageType *output, FlagImageType *flags ) :
+      m_Flags( flags->GetBufferPointer() ),
+      m_Labels( output->GetBufferPointer() )
+    {}
+    void Initialize( SizeValueType p, LabelImagePixelType l, bool boundary )
+    {
+      m_Labels[p] = l;
+      m_Flags[p] = boundary ? BoundaryFlag : 0;
+    }
+    bool IsDone( SizeValueType p ) const { return m_Flags[p] & DoneFlag; }
+    void SetDone( SizeValueType p ) { m_Flags[p] |= DoneFlag; }
+    bool IsBoundary( SizeValueType p ) const { return m_Flags[p] & BoundaryFlag; }
+    LabelImagePixelType GetLabel( SizeValueType p ) const { return m_Labels[p]; }
+    void SetLabel( SizeValueType p, LabelImagePixelType l ) { m_Labels[p] = l; }
+    void Finish() {}
+  private:
+    static const unsigned char DoneFlag = 1;
+    static const unsigned char BoundaryFlag = 2;
+    unsigned char       *m_Flags;
+    LabelImagePixelType *m_Labels;
+  };
+
+  // PackedState keeps the flags in the top two value bits of the
+  // output labels, and strips them when the flood is done. Cost and
+  // label are not interleaved, as the output has to be a plain label
+  // image.
+  class PackedState {
+  public:
+    static const bool UsesFlags = false;
+    PackedState( LabelImageType *output, FlagImageType * ) :
+      m_Labels( output->GetBufferPointer() ),
+      m_NumberOfPixels( output->GetBufferedRegion().GetNumberOfPixels() )
+    {}
+    void Initialize( SizeValueType p, LabelImagePixelType l, bool boundary )
+    {
+      m_Labels[p] = boundary ? static_cast< LabelImagePixelType >( l | BoundaryBit() ) : l;
+    }
+    bool IsDone( SizeValueType p ) const { return m_Labels[p] & DoneBit(); }
+    void SetDone( SizeValueType p ) { m_Labels[p] |= DoneBit(); }
+    bool IsBoundary( SizeValueType p ) const { return m_Labels[p] & BoundaryBit(); }
+    LabelImagePixelType GetLabel( SizeValueType p ) const
+    {
+      return static_cast< LabelImagePixelType >( m_Labels[p] & MaximumLabel() );
+    }
+    void SetLabel( SizeValueType p, LabelImagePixelType l )
+    {
+      m_Labels[p] = static_cast< LabelImagePixelType >( ( m_Labels[p] & ( DoneBit() | BoundaryBit() ) ) | l );
+    }
+    void Finish()
+    {
+      for ( SizeValueType p = 0; p < m_NumberOfPixels; ++p )
+        {
+        m_Labels[p] = GetLabel(p);
+        }
+    }
+    // the largest label that leaves the flag bits free
+    static LabelImagePixelType MaximumLabel()
+    {
+      return static_cast< LabelImagePixelType >( BoundaryBit() - 1 );
+    }
+  private:
+    static LabelImagePixelType DoneBit()
+    {
+      return static_cast< LabelImagePixelType >(
+        LabelImagePixelType(1) << ( std::numeric_limits< LabelImagePixelType >::digits - 1 ) );
+    }
+    static LabelImagePixelType BoundaryBit()
+    {
+      return static_cast< LabelImagePixelType >(
+        LabelImagePixelType(1) << ( std::numeric_limits< LabelImagePixelType >::digits - 2 ) );
+    }
+    LabelImagePixelType *m_Labels;
+    SizeValueType        m_NumberOfPixels;
+  };
+
+  // What the threads of the initialisation pass share. Each thread
+  // keeps its own list of seeds, in offset order, and count of pixels
+  // that don't take part in the flood.
+  template< class TOffset, class TState, class TNeighborhood >
+  struct SeedThreadStruct {
+    Self                *Filter;
+    TState              *State;
+    const TNeighborhood *Neighbors;
+    PriorityType        *CostBuf;
+    std::vector< std::vector< TOffset > > Seeds;
+    std::vector< SizeValueType >          Completed;
+  };
+
+  /** Runs ThreadedSeed on a piece of the output */
+  template< class TSeedStruct >
+  static ITK_THREAD_RETURN_TYPE SeedThreaderCallback(void *arg);
+
+  /** The initialisation pass over one piece of the output: set the
+   * label, flags and cost of its pixels and list the marker pixels
+   * with background neighbours. */
+  template< class TOffset, class TState, class TNeighborhood >
+  void ThreadedSeed(const LabelImageRegionType & region,
+		    SeedThreadStruct< TOffset, TState, TNeighborhood > & str,
+		    ThreadIdType threadId);
+
+  // The parallel flood. Threads work on one tile each, in stages:
+  // the initialisation pass and a flood of the tile from its
+  // markers, then rounds of collecting the cost improvements offered
+  // across the tile seams and flooding the tile from them.
+  enum ParallelStage { InitialStage, CollectStage, PropagateStage };
+
+  template< class TOffset, class TNeighborhood >
+  struct ParallelThreadStruct {
+    Self                *Filter;
+    const TNeighborhood *Neighbors;
+    unsigned char       *StatusBuf;
+    PriorityType        *CostBuf;
+    ParallelStage       Stage;
+    // how far from the ends of its offset range a tile pixel can
+    // have neighbours in another tile
+    typename LabelImageType::OffsetValueType SeamDepth;
+    // per thread: the marker pixels that seed the label replay, in
+    // offset order, the cost improvements found at the seams and the
+    // count of completed pixels
+    std::vector< std::vector< TOffset > > Seeds;
+    std::vector< std::vector< std::pair< PriorityType, TOffset > > > Improvements;
+    std::vector< SizeValueType > Completed;
+  };
+
+  /** Runs ThreadedParallelFlood on a tile of the output */
+  template< class TParallelStruct >
+  static ITK_THREAD_RETURN_TYPE ParallelThreaderCallback(void *arg);
+
+  /** One stage of the parallel flood on one tile */
+  template< class TOffset, class TNeighborhood >
+  void ThreadedParallelFlood(const LabelImageRegionType & region,
+			     ParallelThreadStruct< TOffset, TNeighborhood > & str,
+			     ThreadIdType threadId);
+
+  /** Propagate the costs of the pixels in the queue through the tile
+   * covering offsets begin to end, without leaving it */
+  template< class TOffset, class TNeighborhood >
+  void FloodTile(TOffset begin, TOffset end,
+		 ParallelThreadStruct< TOffset, TNeighborhood > & str,
+		 HierarchicalQueue< PriorityType, TOffset > & queue);
+
+  /** Pick the connectivity for ParallelFloodOffsets */
+  template< class TOffset >
+  void ParallelFloodWithConnectivity(ProgressReporter & progress);
+
+  /** The parallel flood: tile costs, seam repair and label replay */
+  template< class TOffset, bool VFullyConnected >
+  void ParallelFloodOffsets(ProgressReporter & progress);
+
+  // Keeps the scratch buffers of a streaming flood within the
+  // budget. The buffers are cut into slabs of whole pages, the same
+  // range of pixels in each buffer. The flood touches the slab of
+  // every pixel it works from, along with the slabs Reach pixels
+  // either side that its neighbours may be in, and as soon as more
+  // slabs have been touched since they were last dropped than fit in
+  // the budget, the least recently touched are dropped. If the flood
+  // front needs more slabs than that they are read back again and
+  // again, which costs time but not correctness. The mapped blocks of
+  // an arena, if one is set, are dropped at fixed intervals.
+  class SlabTrimmer {
+  public:
+    SlabTrimmer( SizeValueType numberOfPixels, SizeValueType budget, size_t bytesPerPixel );
+    void AddBuffer( void *data, size_t elementSize )
+    {
+      m_Buffers.push_back( std::make_pair( static_cast< char * >( data ), elementSize ) );
+    }
+    void SetArena( IFTSpillArena *arena ) { m_Arena = arena; }
+    void SetReach( SizeValueType reach ) { m_Reach = reach; }
+    void Touch( SizeValueType p )
+    {
+      ++m_Clock;
+      this->Use( p >> m_Shift );
+      if ( m_Reach )
+        {
+        this->Use( ( p - std::min( p, m_Reach ) ) >> m_Shift );
+        this->Use( std::min( p + m_Reach, m_NumberOfPixels - 1 ) >> m_Shift );
+        }
+      if ( m_NumberOfResident > m_MaximumResident )
+        {
+        this->Trim();
+        }
+      if ( m_Arena && ( m_Clock & CheckInterval ) == 0 )
+        {
+        m_Arena->Trim();
+        }
+    }
+    SizeValueType GetNumberOfTrimmedSlabs() const { return m_NumberOfTrimmed; }
+  private:
+    static const SizeValueType CheckInterval = ( 1 << 16 ) - 1;
+    void Use( SizeValueType slab )
+    {
+      m_LastUse[slab] = m_Clock;
+      if ( !m_Resident[slab] )
+        {
+        m_Resident[slab] = true;
+        ++m_NumberOfResident;
+        }
+    }
+    void Trim();
+    std::vector< std::pair< char *, size_t > > m_Buffers;
+    std::vector< SizeValueType > m_LastUse;
+    std::vector< bool >          m_Resident;
+    IFTSpillArena *m_Arena;
+    SizeValueType m_NumberOfPixels;
+    SizeValueType m_Reach;
+    unsigned int  m_Shift;
+    SizeValueType m_Clock;
+    SizeValueType m_NumberOfResident;
+    SizeValueType m_MaximumResident;
+    SizeValueType m_NumberOfTrimmed;
+  };
+
+  /** The directory scratch files go in */
+  std::string GetScratchPath() const;
+
+  /** Pick the connectivity for StreamingFloodOffsets */
+  template< class TOffset >
+  void StreamingFloodWithConnectivity(ProgressReporter & progress, SizeValueType budget);
+
+  /** The flood with the labels, costs and flags in trimmed scratch
+   * files, and the queue storage spilling to one, within budget */
+  template< class TOffset, bool VFullyConnected >
+  void StreamingFloodOffsets(ProgressReporter & progress, SizeValueType budget);
+
+  /** Whether all marker labels fit in PackedState */
+  bool MarkersFitPackedState() const;
+
+  /** Pick the state layout and connectivity for FloodOffsets */
+  template< class TOffset >
+  void FloodWithState(ProgressReporter & progress, bool packed);
+
+  /** Pick the flood with or without statistics */
+  template< class TOffset, class TState, bool VFullyConnected >
+  void FloodWithStatistics(ProgressReporter & progress);
+
+  /** Pick the queue policy of the SelectedQueueStrategy */
+  template< class TOffset, class TState, bool VFullyConnected, bool VStatistics >
+  void FloodWithQueue(ProgressReporter & progress);
+
+  /** The initialisation and flooding stages, working on linear
+   * offsets of type TOffset into the raw image buffers, with the
+   * queue set up and used through TQueuePolicy, the per pixel state
+   * held by TState and the neighbourhood fixed at compile
+   * time. VStatistics compiles the counting in. */
+  template< class TQueuePolicy, class TOffset, class TState, bool VFullyConnected, bool VStatistics >
+  void FloodOffsets(ProgressReporter & progress);
 
   PriorityFunctorType m_PriorityFunctor;
 
@@ -3,28 +3,39 @@
 
 #include "itkIFTWatershedFromMarkersBaseImageFilter.h"
 #include "itkProgressReporter.h"
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
-#include "itkConstShapedNeighborhoodIterator.h"
-#include "itkConstantBoundaryCondition.h"
-#include "itkSize.h"
-#include "itkConnectedComponentAlgorithm.h"
+#include <cstdlib>
+#include <algorithm>
 
 
 namespace itk
 {
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
-IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
 ::IFTWatershedFromMarkersBaseImageFilter()
 {
   this->SetNumberOfRequiredInputs(2);
   m_FullyConnected = false;
   m_MarkWatershedLine = true;
+  m_PackedState = false;
+  m_ParallelFlood = false;
+  m_ReuseBuffers = false;
+  m_NumberOfSeamRounds = 0;
+  m_MemoryBudget = 0;
+  m_NumberOfTrimmedSlabs = 0;
+  m_NumberOfQueueSpills = 0;
+  m_NumberOfStalePops = 0;
+  m_NumberOfNodeAllocations = 0;
+  m_NumberOfSlabAllocations = 0;
+  m_PeakArenaSize = 0;
+  m_CollectStatistics = false;
+  m_MemoryLimit = 0;
+  m_QueueStrategy = IFTQueueStrategy::Auto;
+  m_SelectedQueueStrategy = IFTQueueStrategy::Auto;
 }
 
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
 void
-IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
 ::GenerateInputRequestedRegion()
 {
   // call the superclass' implementation of this method
@@ -47,33 +58,55 @@ IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunct
   inputPtr->SetRequestedRegion( inputPtr->GetLargestPossibleRegion() );
 }
 
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
 void
-IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
 ::EnlargeOutputRequestedRegion(DataObject *)
 {
   this->GetOutput()->SetRequestedRegion(
     this->GetOutput()->GetLargestPossibleRegion() );
 }
 
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
 void
-IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction >
-::GenerateData()
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::AllocateOutputs()
 {
+  LabelImageType *output = this->GetOutput();
+  if ( m_ReuseBuffers && m_OutputBuffer )
+    {
+    // Allocate only replaces it if it is too small
+    output->SetPixelContainer(m_OutputBuffer);
+    }
+  output->SetBufferedRegion( output->GetRequestedRegion() );
+  output->Allocate();
+  m_OutputBuffer = m_ReuseBuffers ? output->GetPixelContainer() : 0;
+}
 
-  // the label used to find background in the marker image
-  static const LabelImagePixelType bgLabel =
-    NumericTraits< LabelImagePixelType >::Zero;
-  // the label used to mark the watershed line in the output image
-  static const LabelImagePixelType wsLabel =
-    NumericTraits< LabelImagePixelType >::Zero;
-
-  this->AllocateOutputs();
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TImage >
+typename TImage::Pointer
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::GetScratchImage(typename TImage::Pointer & buffer, const LabelImageRegionType & region)
+{
+  if ( m_ReuseBuffers && buffer && buffer->GetBufferedRegion() == region )
+    {
+    return buffer;
+    }
+  typename TImage::Pointer image = TImage::New();
+  image->SetRegions(region);
+  image->Allocate();
+  buffer = m_ReuseBuffers ? image.GetPointer() : 0;
+  return image;
+}
 
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::GenerateData()
+{
   LabelImageConstPointer markerImage = this->GetMarkerImage();
   InputImageConstPointer inputImage = this->GetInput();
-  LabelImagePointer      outputImage = this->GetOutput();
 
   // Set up the progress reporter
   // we can't found the exact number of pixel to process in the 2nd pass, so we
@@ -87,210 +120,1359 @@ IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunct
     itkExceptionMacro(<< "Marker and input must have the same size.");
     }
 
-  // FAH (in french: File d'Attente Hierarchique)
-  DoubleQueueType fah;
-
-  // the radius which will be used for all the shaped iterators
-  Size< ImageDimension > radius;
-  radius.Fill(1);
-
-  // iterator for the marker image
-  typedef ConstShapedNeighborhoodIterator< LabelImageType > MarkerIteratorType;
-  typename MarkerIteratorType::ConstIterator nmIt;
-  MarkerIteratorType
-  markerIt( radius, markerImage, markerImage->GetRequestedRegion() );
-  // add a boundary constant to avoid adding pixels on the border in the fah
-  ConstantBoundaryCondition< LabelImageType > lcbc;
-  lcbc.SetConstant( NumericTraits< LabelImagePixelType >::max() );
-  markerIt.OverrideBoundaryCondition(&lcbc);
-  setConnectivity(&markerIt, m_FullyConnected);
-
-  // iterator for the input image
-  typedef ConstShapedNeighborhoodIterator< InputImageType > InputIteratorType;
-  InputIteratorType
-  inputIt( radius, inputImage, inputImage->GetRequestedRegion() );
-  typename InputIteratorType::ConstIterator niIt;
-  setConnectivity(&inputIt, m_FullyConnected);
-
-  // iterator for the output image
-  typedef ShapedNeighborhoodIterator< LabelImageType > OutputIteratorType;
-  typedef typename OutputIteratorType::OffsetType      OffsetType;
-  typename OutputIteratorType::Iterator noIt;
-  OutputIteratorType
-  outputIt( radius, outputImage, outputImage->GetRequestedRegion() );
-  setConnectivity(&outputIt, m_FullyConnected);
-
-  // setting up the queue by looking for borders of the markers
-  ConstantBoundaryCondition< LabelImageType > lcbc2;
-  // outside pixel are watershed so they won't be use to find real watershed
-  // pixels
-  lcbc2.SetConstant(wsLabel);
-  outputIt.OverrideBoundaryCondition(&lcbc2);
-
-  // create a temporary image to store the state of each pixel (processed or
-  // not) - this is the "flag" image in the paper
-  typedef Image< bool, ImageDimension > StatusImageType;
-  typename StatusImageType::Pointer flagImage = StatusImageType::New();
-  flagImage->SetRegions( markerImage->GetLargestPossibleRegion() );
-  flagImage->Allocate();
-
-  // a temporary cost image
-  typedef Image< PriorityType, ImageDimension > PriorityImageType;
-  typename PriorityImageType::Pointer costImage = PriorityImageType::New();
-  costImage->SetRegions( markerImage->GetLargestPossibleRegion() );
-  costImage->Allocate();
-
-  // iterator for the flag image
-  typedef ShapedNeighborhoodIterator< StatusImageType > StatusIteratorType;
-  typename StatusIteratorType::Iterator flIt;
-  StatusIteratorType
-    flagIt( radius, flagImage, outputImage->GetRequestedRegion() );
-  ConstantBoundaryCondition< StatusImageType > bcbc;
-  bcbc.SetConstant(true);    // outside pixel are already processed
-  flagIt.OverrideBoundaryCondition(&bcbc);
-  setConnectivity(&flagIt, m_FullyConnected);
-  flagImage->FillBuffer(false);
-
-  // iterator for the cost image
-  typedef ShapedNeighborhoodIterator< PriorityImageType > CostIteratorType;
-  typename CostIteratorType::Iterator ncIt;
-  CostIteratorType
-    costIt( radius, costImage, outputImage->GetRequestedRegion() );
-  ConstantBoundaryCondition< PriorityImageType > costbc;
-  costbc.SetConstant(true);    // outside pixel are already processed
-  costIt.OverrideBoundaryCondition(&costbc);
-  setConnectivity(&costIt, m_FullyConnected);
-  costImage->FillBuffer(itk::NumericTraits<PriorityType>::max());
-
-#ifdef QUEUEA
-  IterationType GlobalTime = 0;
-#endif
+  // queue entries are buffer offsets, so use the smallest type that
+  // can address every pixel
+  const bool smallOffsets = this->GetOutput()->GetRequestedRegion().GetNumberOfPixels()
+    <= static_cast< SizeValueType >( NumericTraits< unsigned int >::max() );
+
+  m_NumberOfSeamRounds = 0;
+  m_NumberOfTrimmedSlabs = 0;
+  m_NumberOfQueueSpills = 0;
+  m_Statistics.Reset();
+  m_SelectedQueueStrategy = this->SelectQueueStrategy();
+
+  // what to run: as set, or leaner if that may not fit in MemoryLimit
+  bool          parallel = m_ParallelFlood;
+  bool          packed = m_PackedState;
+  SizeValueType budget = m_MemoryBudget;
+  this->ChooseConfiguration(parallel, packed, budget);
+
+  if ( budget > 0 )
+    {
+    // the output is set up on a scratch file rather than allocated
+    m_NumberOfStalePops = 0;
+    m_NumberOfNodeAllocations = 0;
+    m_NumberOfSlabAllocations = 0;
+    m_PeakArenaSize = 0;
+    if ( smallOffsets )
+      {
+      this->template StreamingFloodWithConnectivity< unsigned int >(progress, budget);
+      }
+    else
+      {
+      this->template StreamingFloodWithConnectivity< SizeValueType >(progress, budget);
+      }
+    return;
+    }
+
+  TimeProbe allocationTime;
+  allocationTime.Start();
+  this->AllocateOutputs();
+  allocationTime.Stop();
+
+  if ( parallel )
+    {
+    m_NumberOfStalePops = 0;
+    m_NumberOfNodeAllocations = 0;
+    m_NumberOfSlabAllocations = 0;
+    m_PeakArenaSize = 0;
+    if ( smallOffsets )
+      {
+      this->template ParallelFloodWithConnectivity< unsigned int >(progress);
+      }
+    else
+      {
+      this->template ParallelFloodWithConnectivity< SizeValueType >(progress);
+      }
+    return;
+    }
+
+  if ( m_CollectStatistics )
+    {
+    m_Statistics.AllocationTime = allocationTime.GetTotal();
+    }
+
+  if ( smallOffsets )
+    {
+    this->template FloodWithState< unsigned int >(progress, packed);
+    }
+  else
+    {
+    this->template FloodWithState< SizeValueType >(progress, packed);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ChooseConfiguration(bool & parallelFlood, bool & packedState, SizeValueType & memoryBudget)
+{
+  const LabelImageRegionType region = this->GetOutput()->GetRequestedRegion();
+
+  // values worked out on demand are for one thread
+  if ( parallelFlood && FloodValuesType::OnDemand )
+    {
+    itkWarningMacro(<< "The priority functor's values are computed on demand, which the parallel flood can't do, running it serially instead.");
+    parallelFlood = false;
+    }
+
+  // only the serial flood packs its state, and only if the marker
+  // labels leave the bits free
+  if ( packedState && !parallelFlood && memoryBudget == 0 && !this->MarkersFitPackedState() )
+    {
+    itkWarningMacro(<< "Marker labels use the bits needed for the packed state, using a flag image instead.");
+    packedState = false;
+    }
+
+  m_MemoryEstimate = Self::EstimateMemory(region, m_FullyConnected, packedState, parallelFlood, memoryBudget,
+					  m_SelectedQueueStrategy);
+  if ( m_MemoryLimit == 0 || m_MemoryEstimate.Worst <= m_MemoryLimit )
+    {
+    return;
+    }
+  if ( memoryBudget > 0 )
+    {
+    itkExceptionMacro(<< "The streaming flood may need " << m_MemoryEstimate.Worst
+		      << " bytes, over the memory limit of " << m_MemoryLimit << ".");
+    }
+
+  // leaner configurations, in the order they cost time
+  if ( parallelFlood )
+    {
+    const WatershedMemoryEstimate serial = Self::EstimateMemory(region, m_FullyConnected, false, false, 0,
+								m_SelectedQueueStrategy);
+    if ( serial.Worst <= m_MemoryLimit )
+      {
+      itkWarningMacro(<< "The flood may need " << m_MemoryEstimate.Worst << " bytes, over the memory limit of "
+		      << m_MemoryLimit << ", running it serially instead.");
+      parallelFlood = false;
+      packedState = false;
+      m_MemoryEstimate = serial;
+      return;
+      }
+    }
+  if ( ( parallelFlood || !packedState ) && this->MarkersFitPackedState() )
+    {
+    const WatershedMemoryEstimate packed = Self::EstimateMemory(region, m_FullyConnected, true, false, 0,
+								m_SelectedQueueStrategy);
+    if ( packed.Worst <= m_MemoryLimit )
+      {
+      itkWarningMacro(<< "The flood may need " << m_MemoryEstimate.Worst << " bytes, over the memory limit of "
+		      << m_MemoryLimit << ", running it serially with PackedState instead.");
+      parallelFlood = false;
+      packedState = true;
+      m_MemoryEstimate = packed;
+      return;
+      }
+    }
+  const double budget = m_MemoryLimit - StreamingOverhead( region.GetNumberOfPixels() );
+  if ( budget >= StreamingMinimumBudget() )
+    {
+    itkWarningMacro(<< "The flood may need " << m_MemoryEstimate.Worst << " bytes, over the memory limit of "
+		    << m_MemoryLimit << ", streaming it with a budget of " << static_cast< SizeValueType >( budget )
+		    << " bytes instead.");
+    parallelFlood = false;
+    packedState = false;
+    memoryBudget = static_cast< SizeValueType >( budget );
+    m_MemoryEstimate = Self::EstimateMemory(region, m_FullyConnected, false, false, memoryBudget);
+    return;
+    }
+  itkExceptionMacro(<< "The flood may need " << m_MemoryEstimate.Worst << " bytes, and even a streaming flood "
+		    << static_cast< SizeValueType >( StreamingMinimumBudget() + StreamingOverhead( region.GetNumberOfPixels() ) )
+		    << ", over the memory limit of " << m_MemoryLimit << ".");
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+WatershedMemoryEstimate
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::EstimateMemory(const LabelImageRegionType & region, bool fullyConnected, bool packedState,
+		 bool parallelFlood, SizeValueType memoryBudget, QueueStrategyType queueStrategy)
+{
+  const double numberOfPixels = static_cast< double >( region.GetNumberOfPixels() );
+  const double typicalQueued = WatershedMemoryEstimate::TypicalQueued( numberOfPixels );
+  const unsigned int neighbors = fullyConnected ? FlatNeighborhood< LabelImageType, true >::Size
+    : FlatNeighborhood< LabelImageType, false >::Size;
+  // values computed on demand are counted whole, whatever the mode
+  const double values = FloodValuesType::Footprint( region );
+
+  if ( memoryBudget > 0 )
+    {
+    // the scratch files are in memory up to the budget, and the queue
+    // is a hierarchical one, as in the parallel flood
+    const double worst = std::max( static_cast< double >( memoryBudget ), StreamingMinimumBudget() )
+      + StreamingOverhead( numberOfPixels ) + values;
+    const double typical = FloodFootprint( numberOfPixels, typicalQueued, neighbors, false, true, queueStrategy )
+      + StreamingOverhead( numberOfPixels ) + values;
+    return WatershedMemoryEstimate( worst, std::min( worst, typical ) );
+    }
+
+  return WatershedMemoryEstimate( FloodFootprint( numberOfPixels, numberOfPixels, neighbors, packedState, parallelFlood,
+						  queueStrategy ) + values,
+				  FloodFootprint( numberOfPixels, typicalQueued, neighbors, packedState, parallelFlood,
+						  queueStrategy ) + values );
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+double
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodFootprint(double numberOfPixels, double entries, unsigned int neighbors,
+		 bool packedState, bool parallelFlood, QueueStrategyType queueStrategy)
+{
+  // the output and the cost image, and the flag image unless the flags
+  // are packed into the output
+  double bytes = numberOfPixels * ( sizeof( LabelImagePixelType ) + sizeof( PriorityType ) );
+  if ( parallelFlood || !packedState )
+    {
+    bytes += numberOfPixels;
+    }
+
+  // as many seeds as queued pixels, in lists that may have grown to
+  // twice that
+  const bool smallOffsets = numberOfPixels <= static_cast< double >( NumericTraits< unsigned int >::max() );
+  bytes += 2 * entries * ( smallOffsets ? sizeof( unsigned int ) : sizeof( SizeValueType ) );
+
+  typedef IFTBucketKeyRange< PriorityType > KeyRange;
+  const double keys = KeyRange::Bounded ? KeyRange::Max() - KeyRange::Min() + 1 : entries;
+  if ( parallelFlood )
+    {
+    const double levels = std::min( keys, entries );
+    return bytes + ( smallOffsets ? HierarchicalQueue< PriorityType, unsigned int >::Footprint( entries, levels )
+		     : HierarchicalQueue< PriorityType, SizeValueType >::Footprint( entries, levels ) );
+    }
+
+  if ( queueStrategy == IFTQueueStrategy::Lazy )
+    {
+    // updates leave stale entries behind, up to one per pair of
+    // neighbours
+    entries *= 1 + neighbors / 2.0;
+    }
+  return bytes + ( smallOffsets ? QueueFootprint< unsigned int >( queueStrategy, numberOfPixels, entries, keys )
+		   : QueueFootprint< SizeValueType >( queueStrategy, numberOfPixels, entries, keys ) );
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+double
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::StreamingBytesPerPixel()
+{
+  return sizeof( LabelImagePixelType ) + sizeof( PriorityType ) + 1;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+double
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::StreamingMinimumBudget()
+{
+  // the slabs get three quarters of the budget, and at least 4 slabs
+  // of 4096 pixels are kept whatever it is
+  return 4 * 4096 * StreamingBytesPerPixel() * 4 / 3;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+double
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::StreamingOverhead(double numberOfPixels)
+{
+  // when each slab, of at least 4096 pixels, was last used and
+  // whether it is in memory
+  return numberOfPixels / 4096 * ( sizeof( SizeValueType ) + 1 );
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+typename IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >::QueueStrategyType
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::SelectQueueStrategy() const
+{
+  typedef IFTBucketKeyRange< PriorityType > KeyRange;
+  if ( m_QueueStrategy == IFTQueueStrategy::Bucket && !KeyRange::Bounded )
+    {
+    itkWarningMacro(<< "The costs aren't bounded integers, so there is no bucket queue for them, picking another queue.");
+    }
+  else if ( m_QueueStrategy != IFTQueueStrategy::Auto )
+    {
+    return m_QueueStrategy;
+    }
+
+  // a bucket queue was the fastest for bounded costs even on images
+  // with fewer pixels than buckets, and the radix heap for the rest,
+  // whether the costs had plateaus or were mostly distinct
+  return KeyRange::Bounded ? IFTQueueStrategy::Bucket : IFTQueueStrategy::Radix;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+bool
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::MarkersFitPackedState() const
+{
+  const LabelImageType      *markerImage = this->GetMarkerImage();
+  const LabelImagePixelType *markerBuf = markerImage->GetBufferPointer();
+  const LabelImagePixelType  maxLabel = PackedState::MaximumLabel();
+  const SizeValueType        numberOfPixels = markerImage->GetBufferedRegion().GetNumberOfPixels();
+
+  for ( SizeValueType p = 0; p < numberOfPixels; ++p )
+    {
+    if ( markerBuf[p] < NumericTraits< LabelImagePixelType >::Zero || markerBuf[p] > maxLabel )
+      {
+      return false;
+      }
+    }
+  return true;
+}
 
-  for ( markerIt.GoToBegin(), outputIt.GoToBegin(), inputIt.GoToBegin();
-	!markerIt.IsAtEnd();
-	++markerIt, ++outputIt )
-    {
-    LabelImagePixelType markerPixel = markerIt.GetCenterPixel();
-    if ( markerPixel != bgLabel )
-      {
-      IndexType  idx = markerIt.GetIndex();
-      OffsetType shift = idx - flagIt.GetIndex();
-      flagIt += shift;
-      costIt += shift;
-      // this pixels belongs to a marker
-      // copy it to the output image
-      outputIt.SetCenterPixel(markerPixel);
-      costIt.SetCenterPixel(0);
-      // search if it has background pixel in its neighborhood
-      bool haveBgNeighbor = false;
-      for ( nmIt = markerIt.Begin(); nmIt != markerIt.End(); nmIt++ )
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodWithState(ProgressReporter & progress, bool packed)
+{
+  if ( packed )
+    {
+    if ( m_FullyConnected )
+      {
+      this->template FloodWithStatistics< TOffset, PackedState, true >(progress);
+      }
+    else
+      {
+      this->template FloodWithStatistics< TOffset, PackedState, false >(progress);
+      }
+    }
+  else
+    {
+    if ( m_FullyConnected )
+      {
+      this->template FloodWithStatistics< TOffset, FlagState, true >(progress);
+      }
+    else
+      {
+      this->template FloodWithStatistics< TOffset, FlagState, false >(progress);
+      }
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, class TState, bool VFullyConnected >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodWithStatistics(ProgressReporter & progress)
+{
+  if ( m_CollectStatistics )
+    {
+    this->template FloodWithQueue< TOffset, TState, VFullyConnected, true >(progress);
+    }
+  else
+    {
+    this->template FloodWithQueue< TOffset, TState, VFullyConnected, false >(progress);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, class TState, bool VFullyConnected, bool VStatistics >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodWithQueue(ProgressReporter & progress)
+{
+  switch ( m_SelectedQueueStrategy )
+    {
+    case IFTQueueStrategy::QueueA:
+      this->template FloodOffsets< QueueAPolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    case IFTQueueStrategy::QueueB:
+      this->template FloodOffsets< QueueBPolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    case IFTQueueStrategy::Bucket:
+      this->template FloodOffsets< BucketQueuePolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    case IFTQueueStrategy::Lazy:
+      this->template FloodOffsets< LazyQueuePolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    case IFTQueueStrategy::Radix:
+      this->template FloodOffsets< RadixQueuePolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    default:
+      this->template FloodOffsets< HeapQueuePolicy< TOffset >, TOffset, TState, VFullyConnected, VStatistics >(progress);
+      break;
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TSeedStruct >
+ITK_THREAD_RETURN_TYPE
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::SeedThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast< MultiThreader::ThreadInfoStruct * >( arg );
+  TSeedStruct *str = static_cast< TSeedStruct * >( info->UserData );
+  const ThreadIdType threadId = info->ThreadID;
+
+  LabelImageRegionType splitRegion;
+  const ThreadIdType total =
+    str->Filter->SplitRequestedRegion(threadId, info->NumberOfThreads, splitRegion);
+  if ( threadId < total )
+    {
+    str->Filter->ThreadedSeed(splitRegion, *str, threadId);
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, class TState, class TNeighborhood >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ThreadedSeed(const LabelImageRegionType & region,
+	       SeedThreadStruct< TOffset, TState, TNeighborhood > & str,
+	       ThreadIdType threadId)
+{
+  static const LabelImagePixelType bgLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  const LabelImagePixelType *markerBuf = this->GetMarkerImage()->GetBufferPointer();
+  TState                    &state = *str.State;
+  const TNeighborhood       &neighbors = *str.Neighbors;
+  PriorityType              *costBuf = str.CostBuf;
+  std::vector< TOffset >    &seeds = str.Seeds[threadId];
+  SizeValueType             completed = 0;
+  OffsetValueType           scratch[TNeighborhood::Size];
+
+  // the output is split along its last dimension, so each piece is a
+  // contiguous range of offsets. Work through it a row at a time, as
+  // all but the ends of a row are on the boundary shell or none are.
+  const TOffset begin = static_cast< TOffset >( this->GetOutput()->ComputeOffset( region.GetIndex() ) );
+  const TOffset end = static_cast< TOffset >( begin + region.GetNumberOfPixels() );
+  const TOffset rowLength = static_cast< TOffset >( neighbors.GetRowLength() );
+  for ( TOffset rowBegin = begin; rowBegin < end; )
+    {
+    const TOffset rowStart = rowBegin - rowBegin % rowLength;
+    const TOffset rowEnd = std::min( static_cast< TOffset >( rowStart + rowLength ), end );
+    const bool    boundaryRow = neighbors.IsBoundaryRow(rowStart);
+
+    // copy the markers to the output, with the watershed label
+    // elsewhere, and set the flags
+    for ( TOffset p = rowBegin; p < rowEnd; ++p )
+      {
+      const LabelImagePixelType markerPixel = markerBuf[p];
+      const bool boundary = boundaryRow || p == rowStart || p == rowStart + rowLength - 1;
+      state.Initialize(p, markerPixel != bgLabel ? markerPixel : wsLabel, boundary);
+      }
+
+    // then look for the marker borders
+    for ( TOffset p = rowBegin; p < rowEnd; ++p )
+      {
+      if ( markerBuf[p] != bgLabel )
 	{
-	if ( nmIt.Get() == bgLabel )
+	costBuf[p] = 0;
+	// search if it has background pixel in its neighborhood
+	bool haveBgNeighbor = false;
+	const OffsetValueType *strides = neighbors.GetStrides(p, state.IsBoundary(p), scratch);
+	for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
 	  {
-	  haveBgNeighbor = true;
-	  break;
+	  if ( markerBuf[p + strides[i]] == bgLabel )
+	    {
+	    haveBgNeighbor = true;
+	    break;
+	    }
+	  }
+	if ( haveBgNeighbor )
+	  {
+	  // there is a background pixel in the neighborhood; add to fah
+	  seeds.push_back(p);
+	  }
+	else
+	  {
+	  // this pixel will not be used in the flooding stage. Need to
+	  // mark it in the flag image as done
+	  state.SetDone(p);
+	  ++completed;
 	  }
 	}
-      if ( haveBgNeighbor )
-	{
-	// there is a background pixel in the neighborhood; add to fah
-#ifdef QUEUEA
-	CombPriorityType P;
-	P.time=GlobalTime;
-	++GlobalTime;
-	P.P = 0;
-	fah.insert(markerIt.GetIndex(), P);
-#else
-	fah.insert(markerIt.GetIndex(), 0);	
-#endif
-	}
-      else
+      ++completed;
+      }
+    rowBegin = rowEnd;
+    }
+  str.Completed[threadId] = completed;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TQueuePolicy, class TOffset, class TState, bool VFullyConnected, bool VStatistics >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodOffsets(ProgressReporter & progress)
+{
+  WatershedFloodCounter< VStatistics > counter(m_Statistics);
+
+  // the label used to mark the watershed line in the output image
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  LabelImageConstPointer markerImage = this->GetMarkerImage();
+  InputImageConstPointer inputImage = this->GetInput();
+  LabelImagePointer      outputImage = this->GetOutput();
+
+  const TOffset numberOfPixels =
+    static_cast< TOffset >( outputImage->GetBufferedRegion().GetNumberOfPixels() );
+
+  // FAH (in french: File d'Attente Hierarchique)
+  typedef typename TQueuePolicy::Type QueueType;
+  QueueType    fah;
+  TQueuePolicy policy;
+  policy.Initialize( fah, numberOfPixels );
+
+  // neighbours as buffer offsets, in the order the shaped iterators
+  // used to visit them. Neighbours outside the image are replaced by
+  // the pixel itself, which is what the boundary conditions used to
+  // achieve
+  typedef FlatNeighborhood< LabelImageType, VFullyConnected > NeighborhoodType;
+  NeighborhoodType neighbors;
+  neighbors.Initialize(outputImage);
+  const OffsetValueType *strides;
+
+  // the state of each pixel (processed or not) - this is the "flag"
+  // image in the paper, possibly packed into the output. Pixels on the
+  // boundary shell are also flagged, as only they need their
+  // neighbours checked against the image bounds. The state also
+  // holds the output labels.
+  typename FlagImageType::Pointer flagImage;
+  if ( TState::UsesFlags )
+    {
+    flagImage = this->template GetScratchImage< FlagImageType >( m_FlagBuffer, outputImage->GetBufferedRegion() );
+    }
+  TState state(outputImage, flagImage);
+
+  // a temporary cost image. It isn't initialised: a pixel that hasn't
+  // been reached yet still has the watershed label, so no "infinite"
+  // cost is needed, which would not exist for integer costs anyway.
+  typename CostImageType::Pointer costImage =
+    this->template GetScratchImage< CostImageType >( m_CostBuffer, markerImage->GetLargestPossibleRegion() );
+
+  // all buffers cover the same region, so share offsets
+  FloodValuesType values( inputImage.GetPointer(), m_PriorityFunctor );
+  PriorityType   *costBuf = costImage->GetBufferPointer();
+  counter.EndPhase( WatershedFloodStatistics::AllocationPhase );
+
+  // the queue operations, if they are being recorded
+  IFTQueueTraceWriter  traceWriter;
+  IFTQueueTraceWriter *trace = 0;
+  if ( !m_QueueTraceFile.empty() )
+    {
+    if ( !traceWriter.template Open< PriorityType >( m_QueueTraceFile, numberOfPixels ) )
+      {
+      itkExceptionMacro(<< "Can't write the queue trace " << m_QueueTraceFile);
+      }
+    trace = &traceWriter;
+    }
+
+  // the neighbours of the pixel being flooded from. Vectorizable
+  // priority functors are evaluated for all of them, others only for
+  // the ones that aren't done
+  typedef PriorityFunctorBatch< TPriorityFunction > BatchType;
+  const bool     vectorizable = PriorityFunctorBatchTraits< TPriorityFunction >::Vectorizable;
+  FloodValueType NeighVals[NeighborhoodType::Size];
+  bool           NeighOpen[NeighborhoodType::Size];
+  PriorityType   StepCosts[NeighborhoodType::Size];
+
+  // init stage, split between threads:
+  //  - set the label and flags of every pixel
+  //  - find the marker pixels with background neighbours, which seed
+  //    the fah
+  typedef SeedThreadStruct< TOffset, TState, NeighborhoodType > SeedStructType;
+  SeedStructType str;
+  str.Filter = this;
+  str.State = &state;
+  str.Neighbors = &neighbors;
+  str.CostBuf = costBuf;
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  const ThreadIdType numberOfThreads = this->GetMultiThreader()->GetNumberOfThreads();
+  str.Seeds.resize(numberOfThreads);
+  str.Completed.resize(numberOfThreads, 0);
+  this->GetMultiThreader()->SetSingleMethod(&Self::template SeedThreaderCallback< SeedStructType >, &str);
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // the pieces are in offset order, so queueing the seeds a thread at
+  // a time gives the same fah as a serial scan
+  for ( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    const std::vector< TOffset > & seeds = str.Seeds[t];
+    for ( typename std::vector< TOffset >::const_iterator sIt = seeds.begin();
+	  sIt != seeds.end(); ++sIt )
+      {
+      policy.Insert(fah, *sIt, 0);
+      if ( trace )
 	{
-	// increase progress because this pixel will not be used in the
-	// flooding stage.
-	// Need to mark it in the glag image as done
-	flagIt.SetCenterPixel(true);
-	progress.CompletedPixel();
+	trace->Insert( *sIt, PriorityType(0), false );
 	}
+      counter.Seed();
       }
-    else
+    for ( SizeValueType c = 0; c < str.Completed[t]; c++ )
       {
-      outputIt.SetCenterPixel(wsLabel);
+      progress.CompletedPixel();
       }
-    progress.CompletedPixel();
     }
+  if ( FloodValuesType::OnDemand )
+    {
+    // the marker pixels done already
+    for ( TOffset p = 0; p < numberOfPixels; ++p )
+      {
+      if ( state.IsDone(p) )
+	{
+	values.SetDone(p);
+	}
+      }
+    }
+  counter.EndPhase( WatershedFloodStatistics::SeedPhase );
   // end of init stage
-  outputIt.GoToBegin();
-  flagIt.GoToBegin();
-  inputIt.GoToBegin();
-  costIt.GoToBegin();
   // and start flooding
   while ( !fah.empty() )
     {
-#ifdef QUEUEA
-    CombPriorityType CP = fah.front_key();
-    IndexType idx = fah.front_value();
-    fah.pop();
-#else
-    PriorityType CP=fah.front_key();
-    IndexType idx = fah.front_value();
+    if ( policy.DiscardStale(fah, costBuf) )
+      {
+      continue;
+      }
+    TOffset p = fah.front_value();
     fah.pop();
+    if ( trace )
+      {
+      trace->Pop( p );
+      }
+    counter.Pop( costBuf[p] );
 
-#endif
-    OffsetType shift = idx - outputIt.GetIndex();
-    outputIt += shift;
-    flagIt += shift;
-    inputIt += shift;
-    costIt += shift;
-
-    flagIt.SetCenterPixel(true);
+    state.SetDone(p);
     // check for collisions about here?
     // for each p neighbour of idx and flag[p]==false
-    PriorityType CentreCost = costIt.GetCenterPixel();
-    InputImagePixelType CentrePix = inputIt.GetCenterPixel();
-    LabelImagePixelType CentreLab = outputIt.GetCenterPixel();
-    // may be a way of optimizing these neighborhood iterators
-    for (flIt = flagIt.Begin(), ncIt = costIt.Begin(), niIt = inputIt.Begin(), noIt =outputIt.Begin();
-	 flIt != flagIt.End(); 
-	 flIt++, ncIt++, niIt++, noIt++)
-      {
-      if (!flIt.Get())
+    PriorityType CentreCost = costBuf[p];
+    FloodValueType CentrePix = values[p];
+    LabelImagePixelType CentreLab = state.GetLabel(p);
+    strides = neighbors.GetStrides(p, state.IsBoundary(p));
+    // gather the neighbours and get all the step costs in one go
+    for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+      {
+      TOffset q = static_cast< TOffset >( p + strides[i] );
+      NeighOpen[i] = !state.IsDone(q);
+      if ( vectorizable || NeighOpen[i] )
+	{
+	NeighVals[i] = values[q];
+	}
+      }
+    BatchType::Evaluate(m_PriorityFunctor, CentrePix, NeighVals, NeighOpen, StepCosts);
+    for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+      {
+      TOffset q = static_cast< TOffset >( p + strides[i] );
+      if ( NeighOpen[i] )
 	{
-	PriorityType NeighCost = ncIt.Get();
-	InputImagePixelType NeighVal = niIt.Get();
-	// the function defining StepCost needs to be made general
-	PriorityType StepCost = m_PriorityFunctor(CentrePix, NeighVal);
-	//PriorityType StepCost = NeighVal;
+	PriorityType NewCost = std::max(CentreCost, StepCosts[i]);
+	// the neighbour's cost is only valid once it has been reached
+	if ( state.GetLabel(q) == wsLabel || NewCost < costBuf[q] )
+	  {
+	  if ( trace )
+	    {
+	    // reached pixels that aren't done are in the queue
+	    trace->Insert( q, NewCost, state.GetLabel(q) != wsLabel );
+	    }
+	  if ( state.GetLabel(q) == wsLabel )
+	    {
+	    counter.Insert();
+	    }
+	  else
+	    {
+	    counter.Update();
+	    }
+	  costBuf[q] = NewCost;
+	  state.SetLabel(q, CentreLab);
+	  policy.Insert(fah, q, NewCost);
+	  }
+	else
+	  {
+	  counter.Reject();
+	  }
+	}
+      }
+    values.SetDone(p);
+    }
+  state.Finish();
+  counter.EndPhase( WatershedFloodStatistics::FloodPhase );
+  counter.Finish();
+  m_NumberOfStalePops = policy.GetNumberOfStalePops(fah);
+  if ( trace && !trace->Close() )
+    {
+    itkExceptionMacro(<< "Can't write the queue trace " << m_QueueTraceFile);
+    }
+
+  // the arena is released with the queue on return
+  const IFTArenaStatistics arenaStats = IFTQueueArenaStatistics( fah );
+  m_NumberOfNodeAllocations = arenaStats.NumberOfAllocations;
+  m_NumberOfSlabAllocations = arenaStats.NumberOfSlabAllocations;
+  m_PeakArenaSize = arenaStats.PeakSize;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ParallelFloodWithConnectivity(ProgressReporter & progress)
+{
+  if ( m_FullyConnected )
+    {
+    this->template ParallelFloodOffsets< TOffset, true >(progress);
+    }
+  else
+    {
+    this->template ParallelFloodOffsets< TOffset, false >(progress);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, bool VFullyConnected >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ParallelFloodOffsets(ProgressReporter & progress)
+{
+  // the label used to mark the watershed line in the output image
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const unsigned char BoundaryFlag = 2;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  LabelImageConstPointer markerImage = this->GetMarkerImage();
+  InputImageConstPointer inputImage = this->GetInput();
+  LabelImagePointer      outputImage = this->GetOutput();
+
+  typedef FlatNeighborhood< LabelImageType, VFullyConnected > NeighborhoodType;
+  NeighborhoodType neighbors;
+  neighbors.Initialize(outputImage);
+
+  // the cost image, and the flags saying which pixels have a cost
+  // and which are on the boundary shell. Both are set up by the
+  // initial stage.
+  typename CostImageType::Pointer costImage =
+    this->template GetScratchImage< CostImageType >( m_CostBuffer, markerImage->GetLargestPossibleRegion() );
+  typename FlagImageType::Pointer statusImage =
+    this->template GetScratchImage< FlagImageType >( m_FlagBuffer, markerImage->GetLargestPossibleRegion() );
+
+  typedef ParallelThreadStruct< TOffset, NeighborhoodType > ParallelStructType;
+  ParallelStructType str;
+  str.Filter = this;
+  str.Neighbors = &neighbors;
+  str.StatusBuf = statusImage->GetBufferPointer();
+  str.CostBuf = costImage->GetBufferPointer();
+  str.SeamDepth = 0;
+  for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+    {
+    str.SeamDepth = std::max( str.SeamDepth, std::abs( neighbors.GetStride(i) ) );
+    }
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  const ThreadIdType numberOfThreads = this->GetMultiThreader()->GetNumberOfThreads();
+  str.Seeds.resize(numberOfThreads);
+  str.Improvements.resize(numberOfThreads);
+  str.Completed.resize(numberOfThreads, 0);
+  this->GetMultiThreader()->SetSingleMethod(&Self::template ParallelThreaderCallback< ParallelStructType >, &str);
+
+  // the tile floods
+  str.Stage = InitialStage;
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // repair the seams until no tile can offer a neighbour a cheaper
+  // path
+  for ( ;; )
+    {
+    str.Stage = CollectStage;
+    this->GetMultiThreader()->SingleMethodExecute();
+    bool improved = false;
+    for ( ThreadIdType t = 0; t < numberOfThreads; t++ )
+      {
+      improved = improved || !str.Improvements[t].empty();
+      }
+    if ( !improved )
+      {
+      break;
+      }
+    ++m_NumberOfSeamRounds;
+    str.Stage = PropagateStage;
+    this->GetMultiThreader()->SingleMethodExecute();
+    }
+
+  // Every pixel now has its final cost. Give out the labels in the
+  // order the serial flood would visit the pixels: by cost, first in
+  // first out on ties. A pixel takes the label of the first neighbour
+  // visited that gives it its final cost, which is where the serial
+  // flood last lowered it. Each pixel is queued once, at its final
+  // cost, so a plain hierarchical queue does.
+  const InputImagePixelType *inputBuf = inputImage->GetBufferPointer();
+  LabelImagePixelType       *outputBuf = outputImage->GetBufferPointer();
+  const PriorityType        *costBuf = str.CostBuf;
+  const unsigned char       *statusBuf = str.StatusBuf;
+  const OffsetValueType     *strides;
+
+  HierarchicalQueue< PriorityType, TOffset > fah;
+  for ( ThreadIdType t = 0; t < numberOfThreads; t++ )
+    {
+    const std::vector< TOffset > & seeds = str.Seeds[t];
+    for ( typename std::vector< TOffset >::const_iterator sIt = seeds.begin();
+	  sIt != seeds.end(); ++sIt )
+      {
+      fah.Push(0, *sIt);
+      }
+    for ( SizeValueType c = 0; c < str.Completed[t]; c++ )
+      {
+      progress.CompletedPixel();
+      }
+    }
+
+  while ( !fah.empty() )
+    {
+    fah.NextLevel();
+    while ( !fah.CurrentEmpty() )
+      {
+      TOffset p = fah.PopCurrent();
+      PriorityType CentreCost = costBuf[p];
+      InputImagePixelType CentrePix = inputBuf[p];
+      LabelImagePixelType CentreLab = outputBuf[p];
+      strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag);
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	TOffset q = static_cast< TOffset >( p + strides[i] );
+	// a label means the pixel is a marker or already queued
+	if ( outputBuf[q] == wsLabel )
+	  {
+	  PriorityType StepCost = static_cast< PriorityType >( m_PriorityFunctor(CentrePix, inputBuf[q]) );
+	  if ( std::max(CentreCost, StepCost) == costBuf[q] )
+	    {
+	    outputBuf[q] = CentreLab;
+	    if ( costBuf[q] == CentreCost )
+	      {
+	      fah.PushCurrent(q);
+	      }
+	    else
+	      {
+	      fah.Push(costBuf[q], q);
+	      }
+	    }
+	  }
+	}
+      progress.CompletedPixel();
+      }
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TParallelStruct >
+ITK_THREAD_RETURN_TYPE
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ParallelThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct *info = static_cast< MultiThreader::ThreadInfoStruct * >( arg );
+  TParallelStruct *str = static_cast< TParallelStruct * >( info->UserData );
+  const ThreadIdType threadId = info->ThreadID;
+
+  // the split is the same at every stage, so each thread keeps its
+  // tile
+  LabelImageRegionType splitRegion;
+  const ThreadIdType total =
+    str->Filter->SplitRequestedRegion(threadId, info->NumberOfThreads, splitRegion);
+  if ( threadId < total )
+    {
+    str->Filter->ThreadedParallelFlood(splitRegion, *str, threadId);
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, class TNeighborhood >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::ThreadedParallelFlood(const LabelImageRegionType & region,
+			ParallelThreadStruct< TOffset, TNeighborhood > & str,
+			ThreadIdType threadId)
+{
+  static const LabelImagePixelType bgLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const unsigned char ReachedFlag = 1;
+  static const unsigned char BoundaryFlag = 2;
+  static const unsigned char ExpandedFlag = 4;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+  typedef std::pair< PriorityType, TOffset >       ImprovementType;
+
+  const LabelImagePixelType *markerBuf = this->GetMarkerImage()->GetBufferPointer();
+  const InputImagePixelType *inputBuf = this->GetInput()->GetBufferPointer();
+  LabelImagePixelType       *outputBuf = this->GetOutput()->GetBufferPointer();
+  unsigned char             *statusBuf = str.StatusBuf;
+  PriorityType              *costBuf = str.CostBuf;
+  const TNeighborhood       &neighbors = *str.Neighbors;
+  std::vector< ImprovementType > &improvements = str.Improvements[threadId];
+  OffsetValueType           scratch[TNeighborhood::Size];
+
+  // the output is split along its last dimension, so each tile is a
+  // contiguous range of offsets
+  const TOffset begin = static_cast< TOffset >( this->GetOutput()->ComputeOffset( region.GetIndex() ) );
+  const TOffset end = static_cast< TOffset >( begin + region.GetNumberOfPixels() );
+
+  HierarchicalQueue< PriorityType, TOffset > queue;
+
+  switch ( str.Stage )
+    {
+    case InitialStage:
+      {
+      // the same pass as ThreadedSeed, and the markers with
+      // background neighbours also seed the tile flood
+      std::vector< TOffset > & seeds = str.Seeds[threadId];
+      SizeValueType completed = 0;
+      const TOffset rowLength = static_cast< TOffset >( neighbors.GetRowLength() );
+      for ( TOffset rowBegin = begin; rowBegin < end; )
+	{
+	const TOffset rowStart = rowBegin - rowBegin % rowLength;
+	const TOffset rowEnd = std::min( static_cast< TOffset >( rowStart + rowLength ), end );
+	const bool    boundaryRow = neighbors.IsBoundaryRow(rowStart);
+	for ( TOffset p = rowBegin; p < rowEnd; ++p )
+	  {
+	  const LabelImagePixelType markerPixel = markerBuf[p];
+	  const bool boundary = boundaryRow || p == rowStart || p == rowStart + rowLength - 1;
+	  outputBuf[p] = markerPixel != bgLabel ? markerPixel : wsLabel;
+	  statusBuf[p] = static_cast< unsigned char >( ( boundary ? BoundaryFlag : 0 )
+						       | ( markerPixel != bgLabel ? ReachedFlag : 0 ) );
+	  }
+	for ( TOffset p = rowBegin; p < rowEnd; ++p )
+	  {
+	  if ( markerBuf[p] != bgLabel )
+	    {
+	    costBuf[p] = 0;
+	    bool haveBgNeighbor = false;
+	    const OffsetValueType *strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag, scratch);
+	    for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
+	      {
+	      if ( markerBuf[p + strides[i]] == bgLabel )
+		{
+		haveBgNeighbor = true;
+		break;
+		}
+	      }
+	    if ( haveBgNeighbor )
+	      {
+	      seeds.push_back(p);
+	      queue.Push(0, p);
+	      }
+	    else
+	      {
+	      ++completed;
+	      }
+	    }
+	  ++completed;
+	  }
+	rowBegin = rowEnd;
+	}
+      str.Completed[threadId] = completed;
+      this->FloodTile(begin, end, str, queue);
+      break;
+      }
+    case CollectStage:
+      {
+      // Only pixels within SeamDepth of the ends of the tile have
+      // neighbours in other tiles. Find the cheapest path each one is
+      // offered from there. Other tiles are only read at this stage.
+      improvements.clear();
+      const TOffset depth = static_cast< TOffset >( str.SeamDepth );
+      for ( TOffset q = begin; q < end; ++q )
+	{
+	if ( q - begin == depth && end - q > depth )
+	  {
+	  // skip the middle of the tile
+	  q = end - depth;
+	  }
+	bool         offered = false;
+	PriorityType best = 0;
+	const OffsetValueType *strides = neighbors.GetStrides(q, statusBuf[q] & BoundaryFlag, scratch);
+	for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
+	  {
+	  const OffsetValueType p = static_cast< OffsetValueType >( q ) + strides[i];
+	  if ( ( p >= static_cast< OffsetValueType >( begin ) && p < static_cast< OffsetValueType >( end ) )
+	       || !( statusBuf[p] & ReachedFlag ) )
+	    {
+	    continue;
+	    }
+	  PriorityType StepCost = static_cast< PriorityType >( m_PriorityFunctor(inputBuf[p], inputBuf[q]) );
+	  PriorityType NewCost = std::max(costBuf[p], StepCost);
+	  if ( !offered || NewCost < best )
+	    {
+	    best = NewCost;
+	    offered = true;
+	    }
+	  }
+	if ( offered && ( !( statusBuf[q] & ReachedFlag ) || best < costBuf[q] ) )
+	  {
+	  improvements.push_back( ImprovementType(best, q) );
+	  }
+	}
+      break;
+      }
+    case PropagateStage:
+      {
+      for ( typename std::vector< ImprovementType >::const_iterator iIt = improvements.begin();
+	    iIt != improvements.end(); ++iIt )
+	{
+	const TOffset q = iIt->second;
+	costBuf[q] = iIt->first;
+	statusBuf[q] = static_cast< unsigned char >( ( statusBuf[q] | ReachedFlag ) & ~ExpandedFlag );
+	queue.Push(iIt->first, q);
+	}
+      this->FloodTile(begin, end, str, queue);
+      break;
+      }
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, class TNeighborhood >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::FloodTile(TOffset begin, TOffset end,
+	    ParallelThreadStruct< TOffset, TNeighborhood > & str,
+	    HierarchicalQueue< PriorityType, TOffset > & queue)
+{
+  static const unsigned char ReachedFlag = 1;
+  static const unsigned char BoundaryFlag = 2;
+  static const unsigned char ExpandedFlag = 4;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  const InputImagePixelType *inputBuf = this->GetInput()->GetBufferPointer();
+  unsigned char             *statusBuf = str.StatusBuf;
+  PriorityType              *costBuf = str.CostBuf;
+  const TNeighborhood       &neighbors = *str.Neighbors;
+  OffsetValueType           scratch[TNeighborhood::Size];
+
+  // Only the costs matter here, and costs only go up as the flood
+  // goes on, so a pixel can be pushed again when it is lowered rather
+  // than moved in the queue. Its cheapest entry comes out first and
+  // the others are skipped as already expanded.
+  while ( !queue.empty() )
+    {
+    queue.NextLevel();
+    while ( !queue.CurrentEmpty() )
+      {
+      TOffset p = queue.PopCurrent();
+      if ( statusBuf[p] & ExpandedFlag )
+	{
+	continue;
+	}
+      statusBuf[p] |= ExpandedFlag;
+
+      PriorityType CentreCost = costBuf[p];
+      InputImagePixelType CentrePix = inputBuf[p];
+      const OffsetValueType *strides = neighbors.GetStrides(p, statusBuf[p] & BoundaryFlag, scratch);
+      for ( unsigned int i = 0; i < TNeighborhood::Size; i++ )
+	{
+	const OffsetValueType r = static_cast< OffsetValueType >( p ) + strides[i];
+	if ( r < static_cast< OffsetValueType >( begin ) || r >= static_cast< OffsetValueType >( end ) )
+	  {
+	  // another tile's pixel, dealt with at the seams
+	  continue;
+	  }
+	TOffset q = static_cast< TOffset >( r );
+	PriorityType StepCost = static_cast< PriorityType >( m_PriorityFunctor(CentrePix, inputBuf[q]) );
 	PriorityType NewCost = std::max(CentreCost, StepCost);
-	if (NewCost < NeighCost)
+	if ( !( statusBuf[q] & ReachedFlag ) || NewCost < costBuf[q] )
 	  {
-	  ncIt.Set(NewCost);
-	  noIt.Set(CentreLab);
-#ifdef QUEUEA	  
-	  CombPriorityType NP;
-	  NP.P = NewCost;
-	  NP.time = GlobalTime;
-	  ++GlobalTime;
-	  fah.insert(flagIt.GetIndex() + flIt.GetNeighborhoodOffset(), NP);
-#else
-	  fah.insert(flagIt.GetIndex() + flIt.GetNeighborhoodOffset(), NewCost);
-#endif
+	  costBuf[q] = NewCost;
+	  statusBuf[q] = static_cast< unsigned char >( ( statusBuf[q] | ReachedFlag ) & ~ExpandedFlag );
+	  if ( NewCost == CentreCost )
+	    {
+	    queue.PushCurrent(q);
+	    }
+	  else
+	    {
+	    queue.Push(NewCost, q);
+	    }
+	  }
+	}
+      }
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >::SlabTrimmer
+::SlabTrimmer(SizeValueType numberOfPixels, SizeValueType budget, size_t bytesPerPixel) :
+  m_Arena(0), m_NumberOfPixels(numberOfPixels), m_Reach(0), m_Shift(12), m_Clock(0),
+  m_NumberOfResident(0), m_NumberOfTrimmed(0)
+{
+  // slabs of at least 4096 pixels, so at least a page of every
+  // buffer, growing while 16 of them still fit in the budget
+  while ( m_Shift < 22
+	  && ( static_cast< SizeValueType >( 2 ) << m_Shift ) * bytesPerPixel * 16 <= budget )
+    {
+    ++m_Shift;
+    }
+  const SizeValueType slabBytes = ( static_cast< SizeValueType >( 1 ) << m_Shift ) * bytesPerPixel;
+  m_MaximumResident = std::max( budget / slabBytes, static_cast< SizeValueType >( 4 ) );
+  const SizeValueType numberOfSlabs = ( ( numberOfPixels - 1 ) >> m_Shift ) + 1;
+  m_LastUse.assign(numberOfSlabs, 0);
+  m_Resident.assign(numberOfSlabs, false);
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >::SlabTrimmer
+::Trim()
+{
+  // drop down to three quarters of the maximum, so that this isn't
+  // done again at the next check
+  std::vector< std::pair< SizeValueType, SizeValueType > > resident;
+  resident.reserve(m_NumberOfResident);
+  for ( SizeValueType slab = 0; slab < m_Resident.size(); ++slab )
+    {
+    if ( m_Resident[slab] )
+      {
+      resident.push_back( std::make_pair(m_LastUse[slab], slab) );
+      }
+    }
+  const SizeValueType keep = m_MaximumResident - m_MaximumResident / 4;
+  const SizeValueType drop = resident.size() - keep;
+  std::nth_element( resident.begin(), resident.begin() + drop, resident.end() );
+  for ( SizeValueType i = 0; i < drop; ++i )
+    {
+    const SizeValueType slab = resident[i].second;
+    const SizeValueType begin = slab << m_Shift;
+    const SizeValueType end = std::min( begin + ( static_cast< SizeValueType >( 1 ) << m_Shift ), m_NumberOfPixels );
+    for ( size_t b = 0; b < m_Buffers.size(); ++b )
+      {
+      IFTTrimScratch( m_Buffers[b].first + begin * m_Buffers[b].second,
+		      ( end - begin ) * m_Buffers[b].second );
+      }
+    m_Resident[slab] = false;
+    }
+  m_NumberOfResident -= drop;
+  m_NumberOfTrimmed += drop;
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+std::string
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::GetScratchPath() const
+{
+  if ( !m_ScratchDirectory.empty() )
+    {
+    return m_ScratchDirectory;
+    }
+  const char *tmp = getenv("TMPDIR");
+  return tmp && *tmp ? std::string(tmp) : std::string("/tmp");
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::StreamingFloodWithConnectivity(ProgressReporter & progress, SizeValueType budget)
+{
+  if ( m_FullyConnected )
+    {
+    this->template StreamingFloodOffsets< TOffset, true >(progress, budget);
+    }
+  else
+    {
+    this->template StreamingFloodOffsets< TOffset, false >(progress, budget);
+    }
+}
+
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
+template< class TOffset, bool VFullyConnected >
+void
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
+::StreamingFloodOffsets(ProgressReporter & progress, SizeValueType budget)
+{
+  // the label used to mark the watershed line in the output image
+  static const LabelImagePixelType wsLabel =
+    NumericTraits< LabelImagePixelType >::Zero;
+  static const unsigned char BoundaryFlag = 2;
+
+  typedef typename LabelImageType::OffsetValueType OffsetValueType;
+
+  LabelImageConstPointer markerImage = this->GetMarkerImage();
+  InputImageConstPointer inputImage = this->GetInput();
+  LabelImagePointer      outputImage = this->GetOutput();
+
+  // the output, costs and flags all live in scratch files
+  const std::string dir = this->GetScratchPath();
+  outputImage->SetBufferedRegion( outputImage->GetRequestedRegion() );
+  const SizeValueType numberOfPixels = outputImage->GetBufferedRegion().GetNumberOfPixels();
+  typedef MemoryMappedImageContainer< SizeValueType, LabelImagePixelType > LabelContainerType;
+  typedef MemoryMappedImageContainer< SizeValueType, PriorityType >        CostContainerType;
+  typedef MemoryMappedImageContainer< SizeValueType, unsigned char >       FlagContainerType;
+  typename LabelContainerType::Pointer labels = LabelContainerType::New();
+  typename CostContainerType::Pointer  costs = CostContainerType::New();
+  typename FlagContainerType::Pointer  flags = FlagContainerType::New();
+  if ( !labels->MapScratch(dir, numberOfPixels) || !costs->MapScratch(dir, numberOfPixels)
+       || !flags->MapScratch(dir, numberOfPixels) )
+    {
+    itkExceptionMacro(<< "Can't make scratch files in " << dir);
+    }
+  outputImage->SetPixelContainer(labels);
+
+  FloodValuesType            values( inputImage.GetPointer(), m_PriorityFunctor );
+  const LabelImagePixelType *markerBuf = markerImage->GetBufferPointer();
+  LabelImagePixelType       *labelBuf = labels->GetBufferPointer();
+  PriorityType              *costBuf = costs->GetBufferPointer();
+  unsigned char             *flagBuf = flags->GetBufferPointer();
+
+  // a quarter of the budget is left for the queue and the rest
+  const size_t bytesPerPixel = static_cast< size_t >( StreamingBytesPerPixel() );
+  SlabTrimmer trimmer(numberOfPixels, budget - budget / 4, bytesPerPixel);
+  trimmer.AddBuffer( labelBuf, sizeof( LabelImagePixelType ) );
+  trimmer.AddBuffer( costBuf, sizeof( PriorityType ) );
+  trimmer.AddBuffer( flagBuf, 1 );
+
+  // The queue keeps no per pixel arrays. Entries aren't moved when a
+  // pixel gets cheaper, it is pushed again and the old entry skipped
+  // when popped, which leaves the FIFO order of the other queues. Half
+  // of what is left of the budget is for queue blocks on the heap,
+  // the rest go in scratch files and are dropped with the slabs.
+  IFTSpillArena arena;
+  arena.SetDirectory(dir);
+  arena.SetMemoryLimit(budget / 8);
+  trimmer.SetArena(&arena);
+  typedef HierarchicalQueue< PriorityType, TOffset, IFTSpillAllocator< TOffset > > QueueType;
+  QueueType fah( ( IFTSpillAllocator< TOffset >( &arena ) ) );
+
+  typedef FlatNeighborhood< LabelImageType, VFullyConnected > NeighborhoodType;
+  NeighborhoodType neighbors;
+  neighbors.Initialize(outputImage);
+  const OffsetValueType *strides;
+  SizeValueType reach = 0;
+  for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+    {
+    reach = std::max( reach, static_cast< SizeValueType >( std::abs( neighbors.GetStride(i) ) ) );
+    }
+  trimmer.SetReach(reach);
+
+  // init stage, in offset order so the slabs are filled one after
+  // the other: the same labels, flags and seeds as ThreadedSeed
+  const TOffset rowLength = static_cast< TOffset >( neighbors.GetRowLength() );
+  for ( TOffset rowStart = 0; rowStart < numberOfPixels; rowStart += rowLength )
+    {
+    const bool boundaryRow = neighbors.IsBoundaryRow(rowStart);
+    const TOffset rowEnd = rowStart + rowLength;
+    for ( TOffset p = rowStart; p < rowEnd; ++p )
+      {
+      trimmer.Touch(p);
+      const bool boundary = boundaryRow || p == rowStart || p == rowEnd - 1;
+      flagBuf[p] = boundary ? BoundaryFlag : 0;
+      labelBuf[p] = markerBuf[p];
+      if ( markerBuf[p] != wsLabel )
+	{
+	costBuf[p] = 0;
+	strides = neighbors.GetStrides(p, boundary);
+	bool haveBgNeighbor = false;
+	for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	  {
+	  if ( markerBuf[p + strides[i]] == wsLabel )
+	    {
+	    haveBgNeighbor = true;
+	    break;
+	    }
+	  }
+	if ( haveBgNeighbor )
+	  {
+	  fah.Push(0, p);
+	  }
+	else
+	  {
+	  values.SetDone(p);
 	  }
 	}
+      progress.CompletedPixel();
       }
+    }
+
+  typedef PriorityFunctorBatch< TPriorityFunction > BatchType;
+  const bool     vectorizable = PriorityFunctorBatchTraits< TPriorityFunction >::Vectorizable;
+  FloodValueType NeighVals[NeighborhoodType::Size];
+  bool           NeighOpen[NeighborhoodType::Size];
+  PriorityType   StepCosts[NeighborhoodType::Size];
 
+  while ( !fah.empty() )
+    {
+    fah.NextLevel();
+    const PriorityType level = fah.CurrentPriority();
+    while ( !fah.CurrentEmpty() )
+      {
+      TOffset p = fah.PopCurrent();
+      // stale entries read the cost too, and can run for a long time
+      // once the flood is done
+      trimmer.Touch(p);
+      if ( costBuf[p] != level )
+	{
+	// it has been pushed again since at a lower cost
+	continue;
+	}
+
+      PriorityType CentreCost = costBuf[p];
+      FloodValueType CentrePix = values[p];
+      LabelImagePixelType CentreLab = labelBuf[p];
+      strides = neighbors.GetStrides(p, flagBuf[p] & BoundaryFlag);
+      // a neighbour no dearer than the centre can't be improved,
+      // which covers the done ones without a done flag
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	TOffset q = static_cast< TOffset >( p + strides[i] );
+	NeighOpen[i] = labelBuf[q] == wsLabel || costBuf[q] > CentreCost;
+	if ( vectorizable || NeighOpen[i] )
+	  {
+	  NeighVals[i] = values[q];
+	  }
+	}
+      BatchType::Evaluate(m_PriorityFunctor, CentrePix, NeighVals, NeighOpen, StepCosts);
+      for ( unsigned int i = 0; i < NeighborhoodType::Size; i++ )
+	{
+	TOffset q = static_cast< TOffset >( p + strides[i] );
+	if ( NeighOpen[i] )
+	  {
+	  PriorityType NewCost = std::max(CentreCost, StepCosts[i]);
+	  if ( labelBuf[q] == wsLabel || NewCost < costBuf[q] )
+	    {
+	    costBuf[q] = NewCost;
+	    labelBuf[q] = CentreLab;
+	    if ( NewCost == CentreCost )
+	      {
+	      fah.PushCurrent(q);
+	      }
+	    else
+	      {
+	      fah.Push(NewCost, q);
+	      }
+	    }
+	  }
+	}
+      values.SetDone(p);
+      progress.CompletedPixel();
+      }
     }
+
+  m_NumberOfTrimmedSlabs = trimmer.GetNumberOfTrimmedSlabs();
+  m_NumberOfQueueSpills = arena.GetNumberOfSpills();
 }
 
-template< class TInputImage, class TLabelImage, class TPriorityFunction >
+template< class TInputImage, class TLabelImage, class TPriorityFunction, class TCost >
 void
-IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction >
+IFTWatershedFromMarkersBaseImageFilter< TInputImage, TLabelImage, TPriorityFunction, TCost >
 ::PrintSelf(std::ostream & os, Indent indent) const
 {
   Superclass::PrintSelf(os, indent);
 
   os << indent << "FullyConnected: "  << m_FullyConnected << std::endl;
+  os << indent << "ParallelFlood: "  << m_ParallelFlood << std::endl;
+  os << indent << "ReuseBuffers: "  << m_ReuseBuffers << std::endl;
+  os << indent << "MemoryBudget: "  << m_MemoryBudget << std::endl;
+  os << indent << "MemoryLimit: "  << m_MemoryLimit << std::endl;
+  os << indent << "MemoryEstimate: "  << m_MemoryEstimate.Typical << " typical, "
+     << m_MemoryEstimate.Worst << " worst" << std::endl;
+  os << indent << "ScratchDirectory: "  << m_ScratchDirectory << std::endl;
   os << indent << "MarkWatershedLine: "  << m_MarkWatershedLine << std::endl;
+  os << indent << "PackedState: "  << m_PackedState << std::endl;
+  os << indent << "QueueTraceFile: "  << m_QueueTraceFile << std::endl;
+  os << indent << "QueueStrategy: "  << IFTQueueStrategy::GetName(m_QueueStrategy) << std::endl;
+  os << indent << "SelectedQueueStrategy: "  << IFTQueueStrategy::GetName(m_SelectedQueueStrategy) << std::endl;
+  os << indent << "CollectStatistics: "  << m_CollectStatistics << std::endl;
+  m_Statistics.Print(os, indent);
+  os << indent << "NumberOfStalePops: "  << m_NumberOfStalePops << std::endl;
+  os << indent << "NumberOfNodeAllocations: "  << m_NumberOfNodeAllocations << std::endl;
+  os << indent << "NumberOfSlabAllocations: "  << m_NumberOfSlabAllocations << std::endl;
+  os << indent << "PeakArenaSize: "  << m_PeakArenaSize << std::endl;
+  os << indent << "NumberOfTrimmedSlabs: "  << m_NumberOfTrimmedSlabs << std::endl;
+  os << indent << "NumberOfQueueSpills: "  << m_NumberOfQueueSpills << std::endl;
 }
 } // end namespace itk
 #endif
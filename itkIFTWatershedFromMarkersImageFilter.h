@@ -84,6 +84,81 @@ public:
 
 }
 
+// the watershed functor returns pixel values, so the input pixel type
+// holds every cost
+template< class TInput1, class TOutput, class TInputPixel >
+class IFTPriorityFunctorTraits< Functor::IFTWSPriority< TInput1, TOutput >, TInputPixel >
+{
+public:
+  typedef TInput1 CostType;
+};
+
+// the dissimilarity functor returns absolute differences between
+// pixel values, which need the unsigned type of the same size
+template< class TInput >
+class IFTAbsoluteDifferenceType
+{
+public:
+  typedef TInput Type;
+};
+
+template<>
+class IFTAbsoluteDifferenceType< char >
+{
+public:
+  typedef unsigned char Type;
+};
+
+template<>
+class IFTAbsoluteDifferenceType< signed char >
+{
+public:
+  typedef unsigned char Type;
+};
+
+template<>
+class IFTAbsoluteDifferenceType< short >
+{
+public:
+  typedef unsigned short Type;
+};
+
+template<>
+class IFTAbsoluteDifferenceType< int >
+{
+public:
+  typedef unsigned int Type;
+};
+
+template<>
+class IFTAbsoluteDifferenceType< long >
+{
+public:
+  typedef unsigned long Type;
+};
+
+template< class TInput1, class TOutput, class TInputPixel >
+class IFTPriorityFunctorTraits< Functor::IFTPriority< TInput1, TOutput >, TInputPixel >
+{
+public:
+  typedef typename IFTAbsoluteDifferenceType< TInput1 >::Type CostType;
+};
+
+// both functors are a single branch free expression, so evaluate
+// them for the whole neighbourhood
+template< class TInput1, class TOutput >
+class PriorityFunctorBatchTraits< Functor::IFTWSPriority< TInput1, TOutput > >
+{
+public:
+  itkStaticConstMacro(Vectorizable, bool, true);
+};
+
+template< class TInput1, class TOutput >
+class PriorityFunctorBatchTraits< Functor::IFTPriority< TInput1, TOutput > >
+{
+public:
+  itkStaticConstMacro(Vectorizable, bool, true);
+};
 
 template< class TInputImage, class TLabelImage >
 class ITK_EXPORT IFTWatershedFromMarkersImageFilter:
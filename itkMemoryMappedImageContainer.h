@@ -0,0 +1,133 @@
+#ifndef __itkMemoryMappedImageContainer_h
+#define __itkMemoryMappedImageContainer_h
+
+#include "itkImportImageContainer.h"
+#include "itkIFTScratchFile.h"
+#include <string>
+
+namespace itk
+{
+/** \class MemoryMappedImageContainer
+ * \brief A pixel container whose memory is a mapping of a disk
+ * file rather than heap memory.
+ *
+ * MapScratch maps a new temporary file in a given directory, so an
+ * image set up with this container is backed by the file and its
+ * pages can be dropped from memory with Trim without losing their
+ * contents. MapFile maps part of an existing file privately, which
+ * gives an image of the file's data without reading it in. Changes
+ * to the pixels of such an image stay in memory. The mapping is
+ * released with the container. Reserving more elements than are
+ * mapped falls back to the usual heap allocation.
+ *
+ * \author Richard Beare. Department of Medicine, Monash University,
+ * Melbourne, Australia.
+ */
+template< typename TElementIdentifier, typename TElement >
+class MemoryMappedImageContainer:
+  public ImportImageContainer< TElementIdentifier, TElement >
+{
+public:
+  /** Standard class typedefs. */
+  typedef MemoryMappedImageContainer                           Self;
+  typedef ImportImageContainer< TElementIdentifier, TElement > Superclass;
+  typedef SmartPointer< Self >                                 Pointer;
+  typedef SmartPointer< const Self >                           ConstPointer;
+
+  typedef TElementIdentifier ElementIdentifier;
+  typedef TElement           Element;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Runtime information support. */
+  itkTypeMacro(MemoryMappedImageContainer, ImportImageContainer);
+
+  /** Map a scratch file of size elements in directory and use it as
+   * the buffer. Returns false, leaving the container alone, if the
+   * file can't be made. */
+  bool MapScratch(const std::string & directory, ElementIdentifier size)
+  {
+    const size_t bytes = static_cast< size_t >( size ) * sizeof( TElement );
+    void *data = IFTMapScratch(directory, bytes);
+    if ( !data )
+      {
+      return false;
+      }
+    this->Unmap();
+    m_MappedData = data;
+    m_MappedLength = bytes;
+    m_Shared = true;
+    this->SetImportPointer(static_cast< TElement * >( data ), size, false);
+    return true;
+  }
+
+  /** Map size elements of the file at path, starting offset bytes
+   * in, and use them as the buffer. Returns false, leaving the
+   * container alone, if the file can't be mapped. */
+  bool MapFile(const std::string & path, size_t offset, ElementIdentifier size)
+  {
+    void  *base;
+    size_t length;
+    void  *data = IFTMapFile(path, offset, static_cast< size_t >( size ) * sizeof( TElement ),
+			     &base, &length);
+    if ( !data )
+      {
+      return false;
+      }
+    this->Unmap();
+    m_MappedData = base;
+    m_MappedLength = length;
+    m_Shared = false;
+    this->SetImportPointer(static_cast< TElement * >( data ), size, false);
+    return true;
+  }
+
+  /** Drop elements [begin, end) from memory, as far as whole pages
+   * allow. Only has an effect on scratch buffers, as a private
+   * mapping would lose its changes. */
+  void Trim(ElementIdentifier begin, ElementIdentifier end)
+  {
+    if ( m_MappedData && m_Shared && end > begin )
+      {
+      IFTTrimScratch( this->GetBufferPointer() + begin,
+		      static_cast< size_t >( end - begin ) * sizeof( TElement ) );
+      }
+  }
+
+  /** Whether the buffer is a file mapping */
+  bool IsMapped() const
+  {
+    return m_MappedData != 0;
+  }
+
+protected:
+  MemoryMappedImageContainer() : m_MappedData(0), m_MappedLength(0), m_Shared(false) {}
+  ~MemoryMappedImageContainer()
+  {
+    this->Unmap();
+  }
+
+private:
+  MemoryMappedImageContainer(const Self &); //purposely not implemented
+  void operator=(const Self &);             //purposely not implemented
+
+  void Unmap()
+  {
+    if ( m_MappedData )
+      {
+      // the import pointer is not owned, so nothing else frees it
+      this->SetImportPointer(0, 0, false);
+      IFTUnmapScratch(m_MappedData, m_MappedLength);
+      m_MappedData = 0;
+      m_MappedLength = 0;
+      }
+  }
+
+  void  *m_MappedData;
+  size_t m_MappedLength;
+  bool   m_Shared;
+};
+} // end namespace itk
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __itkPriorityFunctorBatch_h
+#define __itkPriorityFunctorBatch_h
+
+#include "itkMacro.h"
+
+namespace itk
+{
+/** \class PriorityFunctorBatchTraits
+ * \brief Whether a priority functor can be evaluated for a whole
+ * neighbourhood at once.
+ *
+ * A functor is Vectorizable when it is cheap, branch free and has no
+ * side effects, so evaluating it for neighbours whose result is not
+ * needed costs less than deciding which ones to skip. Such functors
+ * are evaluated in one tight loop over a fixed number of gathered
+ * neighbour values, which compilers turn into SIMD code. Functors
+ * default to the scalar path and should specialize this to opt in.
+ */
+template< class TPriorityFunction >
+class PriorityFunctorBatchTraits
+{
+public:
+  itkStaticConstMacro(Vectorizable, bool, false);
+};
+
+/** \class PriorityFunctorBatch
+ * \brief Evaluates a priority functor between a centre pixel and
+ * the gathered values of its neighbours.
+ *
+ * Only the results of the neighbours flagged in mask are used. The
+ * scalar version only calls the functor for those, the vectorizable
+ * one for every neighbour.
+ */
+template< class TPriorityFunction,
+	  bool VVectorizable = PriorityFunctorBatchTraits< TPriorityFunction >::Vectorizable >
+class PriorityFunctorBatch
+{
+public:
+  template< class TInput, class TOutput, unsigned int VSize >
+  static void Evaluate(const TPriorityFunction & functor, const TInput & centre,
+		       const TInput (&values)[VSize], const bool (&mask)[VSize],
+		       TOutput (&out)[VSize])
+  {
+    for ( unsigned int i = 0; i < VSize; i++ )
+      {
+      if ( mask[i] )
+	{
+	out[i] = static_cast< TOutput >( functor(centre, values[i]) );
+	}
+      }
+  }
+};
+
+template< class TPriorityFunction >
+class PriorityFunctorBatch< TPriorityFunction, true >
+{
+public:
+  template< class TInput, class TOutput, unsigned int VSize >
+  static void Evaluate(const TPriorityFunction & functor, const TInput & centre,
+		       const TInput (&values)[VSize], const bool (&)[VSize],
+		       TOutput (&out)[VSize])
+  {
+    // constant trip count and no branches, so this unrolls and
+    // vectorizes
+    for ( unsigned int i = 0; i < VSize; i++ )
+      {
+      out[i] = static_cast< TOutput >( functor(centre, values[i]) );
+      }
+  }
+};
+} // end namespace itk
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef __itkWatershedFloodStatistics_h
+#define __itkWatershedFloodStatistics_h
+
+#include "itkIntTypes.h"
+#include "itkIndent.h"
+#include "itkTimeProbe.h"
+#include <algorithm>
+#include <ostream>
+#include <set>
+
+namespace itk
+{
+/** \class WatershedFloodStatistics
+ * \brief What the flood of a watershed filter did in its last update.
+ *
+ * Filled in by the IFT and DisSim watershed filters when
+ * CollectStatistics is on, and all zero otherwise.
+ *
+ * NumberOfSeeds is the number of pixels queued before the flood
+ * starts, NumberOfPops the number of pixels taken out of the queue to
+ * flood from. NumberOfUpdates counts decrease-key operations, a pixel
+ * already in the queue being given a cheaper cost, and
+ * NumberOfRejected the neighbours that weren't done but were offered
+ * a cost no cheaper than the one they had. The hierarchical queue of
+ * the DisSim filter never changes the priority of a queued pixel, so
+ * both are zero there. PeakQueueSize is the most pixels queued at
+ * once, not counting stale entries left by a lazy deletion queue, and
+ * NumberOfPriorityLevels the number of distinct priorities flooded
+ * from.
+ *
+ * The times are wall clock seconds: allocating the output and
+ * scratch images, the initialisation pass that finds and queues the
+ * seeds, and the flood.
+ */
+class WatershedFloodStatistics
+{
+public:
+  enum PhaseType { AllocationPhase, SeedPhase, FloodPhase };
+
+  WatershedFloodStatistics() { this->Reset(); }
+
+  void Reset()
+  {
+    NumberOfSeeds = 0;
+    NumberOfPops = 0;
+    NumberOfUpdates = 0;
+    NumberOfRejected = 0;
+    PeakQueueSize = 0;
+    NumberOfPriorityLevels = 0;
+    AllocationTime = 0;
+    SeedTime = 0;
+    FloodTime = 0;
+  }
+
+  void AddTime( PhaseType phase, double seconds )
+  {
+    switch ( phase )
+      {
+      case AllocationPhase:
+	AllocationTime += seconds;
+	break;
+      case SeedPhase:
+	SeedTime += seconds;
+	break;
+      case FloodPhase:
+	FloodTime += seconds;
+	break;
+      }
+  }
+
+  void Print( std::ostream & os, Indent indent ) const
+  {
+    os << indent << "NumberOfSeeds: " << NumberOfSeeds << std::endl;
+    os << indent << "NumberOfPops: " << NumberOfPops << std::endl;
+    os << indent << "NumberOfUpdates: " << NumberOfUpdates << std::endl;
+    os << indent << "NumberOfRejected: " << NumberOfRejected << std::endl;
+    os << indent << "PeakQueueSize: " << PeakQueueSize << std::endl;
+    os << indent << "NumberOfPriorityLevels: " << NumberOfPriorityLevels << std::endl;
+    os << indent << "AllocationTime: " << AllocationTime << std::endl;
+    os << indent << "SeedTime: " << SeedTime << std::endl;
+    os << indent << "FloodTime: " << FloodTime << std::endl;
+  }
+
+  /** One JSON object, on one line */
+  void WriteJSON( std::ostream & os ) const
+  {
+    os << "{\"seeds\": " << NumberOfSeeds
+       << ", \"pops\": " << NumberOfPops
+       << ", \"updates\": " << NumberOfUpdates
+       << ", \"rejected\": " << NumberOfRejected
+       << ", \"peak_queue\": " << PeakQueueSize
+       << ", \"priority_levels\": " << NumberOfPriorityLevels
+       << ", \"alloc_s\": " << AllocationTime
+       << ", \"seed_s\": " << SeedTime
+       << ", \"flood_s\": " << FloodTime << "}";
+  }
+
+  SizeValueType NumberOfSeeds;
+  SizeValueType NumberOfPops;
+  SizeValueType NumberOfUpdates;
+  SizeValueType NumberOfRejected;
+  SizeValueType PeakQueueSize;
+  SizeValueType NumberOfPriorityLevels;
+  double        AllocationTime;
+  double        SeedTime;
+  double        FloodTime;
+};
+
+/** \class WatershedFloodCounter
+ * \brief Gathers WatershedFloodStatistics in the flood loop.
+ *
+ * The filters pick the flood with VEnabled at run time, so that with
+ * statistics off every call here is empty and compiles away, leaving
+ * the loop as it was. The counts are kept in the counter and written
+ * to the statistics by Finish.
+ */
+template< bool VEnabled >
+class WatershedFloodCounter
+{
+public:
+  explicit WatershedFloodCounter( WatershedFloodStatistics & ) {}
+  void Seed() {}
+  void Insert() {}
+  void Update() {}
+  void Reject() {}
+  template< class TPriority >
+  void Pop( const TPriority & ) {}
+  void EndPhase( WatershedFloodStatistics::PhaseType ) {}
+  void Finish() {}
+};
+
+template<>
+class WatershedFloodCounter< true >
+{
+public:
+  // the clock starts with the counter, in the allocation phase
+  explicit WatershedFloodCounter( WatershedFloodStatistics & stats ) :
+    m_Statistics( stats ), m_Seeds(0), m_Pops(0), m_Updates(0), m_Rejected(0),
+    m_QueueSize(0), m_PeakQueueSize(0), m_LastPriority(0), m_Elapsed(0)
+  {
+    m_Probe.Start();
+  }
+
+  // a new pixel queued before the flood, or during it
+  void Seed() { ++m_Seeds; this->Insert(); }
+  void Insert()
+  {
+    ++m_QueueSize;
+    m_PeakQueueSize = std::max( m_PeakQueueSize, m_QueueSize );
+  }
+  void Update() { ++m_Updates; }
+  void Reject() { ++m_Rejected; }
+
+  // pops come in runs of the same priority, so the set of them is
+  // only looked at when it changes
+  template< class TPriority >
+  void Pop( const TPriority & priority )
+  {
+    const double p = static_cast< double >( priority );
+    if ( m_Pops == 0 || p != m_LastPriority )
+      {
+      m_Levels.insert( p );
+      m_LastPriority = p;
+      }
+    ++m_Pops;
+    --m_QueueSize;
+  }
+
+  void EndPhase( WatershedFloodStatistics::PhaseType phase )
+  {
+    m_Probe.Stop();
+    m_Statistics.AddTime( phase, m_Probe.GetTotal() - m_Elapsed );
+    m_Elapsed = m_Probe.GetTotal();
+    m_Probe.Start();
+  }
+
+  void Finish()
+  {
+    m_Statistics.NumberOfSeeds += m_Seeds;
+    m_Statistics.NumberOfPops += m_Pops;
+    m_Statistics.NumberOfUpdates += m_Updates;
+    m_Statistics.NumberOfRejected += m_Rejected;
+    m_Statistics.PeakQueueSize = std::max( m_Statistics.PeakQueueSize, m_PeakQueueSize );
+    m_Statistics.NumberOfPriorityLevels += m_Levels.size();
+  }
+
+private:
+  WatershedFloodStatistics & m_Statistics;
+  SizeValueType m_Seeds;
+  SizeValueType m_Pops;
+  SizeValueType m_Updates;
+  SizeValueType m_Rejected;
+  SizeValueType m_QueueSize;
+  SizeValueType m_PeakQueueSize;
+  std::set< double > m_Levels;
+  double        m_LastPriority;
+  TimeProbe     m_Probe;
+  double        m_Elapsed;
+};
+} // end namespace itk
+
+#endif
@@ -4,41 +4,64 @@
 #include <itkSubtractImageFilter.h>
 #include <itkFlatStructuringElement.h>
 #include <itkOrientImageFilter.h>
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+#include <itkTimeProbe.h>
+#include <typeinfo>
+#include <algorithm>
+#include <cstring>
 #include "tclap/CmdLine.h"
 #include "ioutils.h"
 
 #include "itkDisSimMorphologicalWatershedFromMarkersImageFilter.h"
+#include "itkIFTWatershedFromMarkersImageFilter.h"
+#include "itkIFTGradientPriority.h"
+#include "itkDifPriority.h"
 
 #ifdef USEPARA
 #include <itkParabolicErodeImageFilter.h>
 #include <itkParabolicDilateImageFilter.h>
 #endif
 
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
 typedef class CmdLineType
 {
 public:
-  std::string InputIm, OutputIm, MarkerIm;
+  std::string InputIm, OutputIm, MarkerIm, Batch, Serve, QueueTrace;
   float scale;
-  bool morphGrad, MarkWSLine, dissim;
+  bool morphGrad, MarkWSLine, dissim, ift, fused, stats;
+  int workers, memory, memoryLimit;
+  itk::IFTQueueStrategy::Type queue;
 } CmdLineType;
 
-void ParseCmdLine(int argc, char* argv[],
-                  CmdLineType &CmdLineObj
-                  )
+// args starts with the program name. A job sent to --serve is parsed
+// with Job set, so that bad options give false and the reason in
+// Error rather than ending the service.
+bool ParseCmdLine(std::vector<std::string> args,
+		  CmdLineType &CmdLineObj, bool Job, std::string &Error)
 {
   using namespace TCLAP;
   try
     {
     // Define the command line object.
     CmdLine cmd("scaleWS ", ' ', "0.9");
+    cmd.setExceptionHandling(!Job);
 
-    ValueArg<std::string> inArg("i","input","input image",true,"result","string");
+    ValueArg<std::string> inArg("i","input","input image",false,"","string");
     cmd.add( inArg );
 
-    ValueArg<std::string> markArg("m","marker","marker image",true,"result","string");
+    ValueArg<std::string> markArg("m","marker","marker image",false,"","string");
     cmd.add( markArg );
 
-    ValueArg<std::string> outArg("o","output","output image", true,"","string");
+    ValueArg<std::string> outArg("o","output","output image", false,"","string");
     cmd.add( outArg );
 
     ValueArg<float> scaleArg("s","scale","scale of smoothing of gradient, in (mm) if not also morphgrad", false, 1,"float");
@@ -54,8 +77,59 @@ void ParseCmdLine(int argc, char* argv[],
     SwitchArg disArg("","dissimilarity","use a dissimilarity watershed (internal gradient calculation - all gradient stuff is ignored", false);
     cmd.add(disArg);
 
+    SwitchArg iftArg("","ift","use the image foresting transform watershed. With --dissimilarity the IFT dissimilarity cost is used on the input image", false);
+    cmd.add(iftArg);
+
+    SwitchArg fusedArg("","fused","with --ift, work the gradient out inside the flood, a block at a time as it is reached, rather than as an image beforehand. No grad.nii.gz is written", false);
+    cmd.add(fusedArg);
+
+    ValueArg<std::string> batchArg("","batch","file of input, marker and output images, one case per line, to run in place of -i, -m and -o. The other options apply to every case", false,"","string");
+    cmd.add(batchArg);
+
+    ValueArg<int> workersArg("","workers","number of cases run at once in batch mode. By default as many as the cores and memory allow", false, 0,"int");
+    cmd.add(workersArg);
+
+    ValueArg<int> memoryArg("","memory","memory (MB) the batch workers may use between them, by default all of it", false, 0,"int");
+    cmd.add(memoryArg);
+
+    ValueArg<int> memoryLimitArg("","memorylimit","memory (MB) each watershed may use. Over it the IFT watershed runs a leaner flood, and the dissimilarity watershed fails before starting", false, 0,"int");
+    cmd.add(memoryLimitArg);
+
+    SwitchArg statsArg("","stats","print what the flood did (seeds, pops, queue size, phase times) as a line of JSON per case", false);
+    cmd.add(statsArg);
+
+    ValueArg<std::string> traceArg("","queuetrace","record the queue operations of the IFT watershed to this file, for replayQueue", false,"","string");
+    cmd.add(traceArg);
+
+    ValueArg<std::string> queueArg("","queue","queue of the IFT watershed: auto, a, b, bucket, heap, lazy or radix", false,"auto","string");
+    cmd.add(queueArg);
+
+    ValueArg<std::string> serveArg("","serve","run as a service on this Unix domain socket. Each job is a line of the other options, with -i, -m and -o, and is answered once the output is written", false,"","string");
+    cmd.add(serveArg);
+
     // Parse the args.
-    cmd.parse( argc, argv );
+    cmd.parse( args );
+
+    if (Job && (batchArg.isSet() || serveArg.isSet()))
+      Error = "a job can't use --batch or --serve";
+    else if (serveArg.isSet() && args.size() > 3)
+      Error = "--serve takes no other options, they come with each job";
+    else if (!batchArg.isSet() && !serveArg.isSet()
+	     && !(inArg.isSet() && markArg.isSet() && outArg.isSet()))
+      Error = "-i, -m and -o are required without --batch or --serve";
+    else if (batchArg.isSet() && traceArg.isSet())
+      Error = "--queuetrace records a single case, not a --batch";
+    else if (!itk::IFTQueueStrategy::FromName(queueArg.getValue(), CmdLineObj.queue))
+      Error = "unknown --queue " + queueArg.getValue();
+    else if (fusedArg.isSet()
+	     && (!iftArg.isSet() || disArg.isSet() || scaleArg.getValue() == 0))
+      Error = "--fused needs --ift, a gradient scale and no --dissimilarity";
+#ifdef USEPARA
+    else if (fusedArg.isSet() && morphArg.isSet())
+      Error = "--fused has no parabolic gradient, leave out --morphgrad";
+#endif
+    if (!Error.empty())
+      return false;
 
     CmdLineObj.InputIm = inArg.getValue();
     CmdLineObj.OutputIm = outArg.getValue();
@@ -64,40 +138,128 @@ void ParseCmdLine(int argc, char* argv[],
     CmdLineObj.morphGrad = morphArg.getValue();
     CmdLineObj.MarkWSLine = lineArg.getValue();
     CmdLineObj.dissim = disArg.getValue();
+    CmdLineObj.ift = iftArg.getValue();
+    CmdLineObj.fused = fusedArg.getValue();
+    CmdLineObj.Batch = batchArg.getValue();
+    CmdLineObj.Serve = serveArg.getValue();
+    CmdLineObj.workers = workersArg.getValue();
+    CmdLineObj.memory = memoryArg.getValue();
+    CmdLineObj.memoryLimit = memoryLimitArg.getValue();
+    CmdLineObj.QueueTrace = traceArg.getValue();
+    CmdLineObj.stats = statsArg.getValue();
 
     }
   catch (ArgException &e)  // catch any exceptions
     {
-    std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+    Error = e.error() + " for arg " + e.argId();
+    return false;
     }
+  catch (ExitException &)
+    {
+    // --help or --version in a job
+    Error = "no job given";
+    return false;
+    }
+  return true;
 }
 ////////////////////////////////////////////////////////
-template< class TInput1, class TOutput = TInput1 >
-class DifPriority
+// The filters of a batch worker, one of each type, kept from case to
+// case. The IFT and dissimilarity filters hold on to their label, cost
+// and status buffers, so a run of same sized cases doesn't allocate
+// them again. The gradient stays connected to its filter, see
+// keepGradient, so the filter writes the next one over the same
+// buffer. The ITK watershed filter replaces its output on every
+// update, so only the object itself is saved.
+class WorkerCache
 {
 public:
-  DifPriority() {}
-  ~DifPriority() {}
-  bool operator!=(const DifPriority &) const
-  {
-    return false;
-  }
+  WorkerCache(int threads) : Threads(threads) {}
 
-  bool operator==(const DifPriority & other) const
+  template <class TFilter>
+  TFilter *Get()
   {
-    return !( *this != other );
+    itk::LightObject::Pointer &filter = Filters[typeid(TFilter).name()];
+    if (filter.IsNull())
+      {
+      typename TFilter::Pointer created = TFilter::New();
+      created->SetNumberOfThreads(Threads);
+      filter = created.GetPointer();
+      }
+    return static_cast<TFilter *>(filter.GetPointer());
   }
 
-  // A is the centre pixel, B the neighbour
-  inline TOutput operator()(const TInput1 & A, const TInput1 & B) const
+  // after a failure, as the filters may be left in any state
+  void Clear()
   {
-    return static_cast< TOutput > (vcl_abs( B - A ));
+    Filters.clear();
   }
+
+private:
+  int Threads;
+  std::map<std::string, itk::LightObject::Pointer> Filters;
 };
+
+// a new filter, or the worker's one if there is a cache
+template <class TFilter>
+typename TFilter::Pointer newFilter(WorkerCache *Cache)
+{
+  if (Cache)
+    return Cache->Get<TFilter>();
+  return TFilter::New();
+}
+
+// The gradient is only disconnected from its filter without a
+// cache. With one it stays the filter's output, which ITK image
+// sources don't release before an update, so the next case of the
+// same size or smaller is written into the same buffer. Filters that
+// pass their output to one running in place still allocate.
+template <class TImage>
+void keepGradient(TImage *grad, WorkerCache *Cache)
+{
+  if (!Cache)
+    grad->DisconnectPipeline();
+}
 ////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////
+// --stats: one line of JSON per case on stdout. Batch workers can
+// finish cases together, so lines are written whole, under a lock.
+static itk::SimpleFastMutexLock StatsLock;
+
+std::string jsonString(const std::string &s)
+{
+  std::string r;
+  for (size_t i = 0; i < s.size(); i++)
+    {
+    if (s[i] == '"' || s[i] == '\\')
+      r += '\\';
+    r += s[i];
+    }
+  return r;
+}
+
+// stats is null for the ITK watershed, which doesn't count
+void printStats(const CmdLineType &CmdLineObj, const char *filter,
+		const itk::WatershedFloodStatistics *stats)
+{
+  std::ostringstream line;
+  line << "{\"input\": \"" << jsonString(CmdLineObj.InputIm)
+       << "\", \"output\": \"" << jsonString(CmdLineObj.OutputIm)
+       << "\", \"filter\": \"" << filter << "\", \"stats\": ";
+  if (stats)
+    stats->WriteJSON(line);
+  else
+    line << "null";
+  line << "}" << std::endl;
+  StatsLock.Lock();
+  std::cout << line.str() << std::flush;
+  StatsLock.Unlock();
+}
+
+// Cache is null outside batch mode. In batch mode the filters come
+// from it, and nothing but the result is printed or written.
 template <class PixType, class LabPixType, int dim>
-void doWatershed(const CmdLineType &CmdLineObj)
+void doWatershed(const CmdLineType &CmdLineObj, WorkerCache *Cache)
 {
   typedef typename itk::Image<PixType, dim> RawImType;
   typedef typename itk::Image<LabPixType, dim> LabImType;
@@ -108,39 +270,85 @@ void doWatershed(const CmdLineType &CmdLineObj)
   typedef typename itk::MorphologicalGradientImageFilter<RawImType,RawImType, KernType> MorphGradFiltType;
 
   typedef typename itk::MorphologicalWatershedFromMarkersImageFilter<RawImType, LabImType> WSFiltType;
-  typedef DifPriority<PixType, 
+  typedef itk::Functor::DifPriority<PixType, 
 		      typename itk::NumericTraits<PixType>::FloatType > DiffP;
   typedef typename itk::DisSimMorphologicalWatershedFromMarkersImageFilter<RawImType, 
 									   LabImType,
 									   DiffP> WSFiltType2;
+  // The IFT filters. The queue is picked at run time with --queue,
+  // auto choosing from the cost type of each branch of nasty_switch.h.
+  typedef typename itk::IFTWatershedFromMarkersImageFilter<RawImType, LabImType> IFTDisFiltType;
+  typedef typename itk::IFTWatershedFromMarkersBaseImageFilter<RawImType, LabImType,
+							       itk::Functor::IFTWSPriority<PixType,
+											   typename itk::NumericTraits<PixType>::RealType> > IFTFiltType;
+  typedef typename itk::Functor::IFTGradientPriority<PixType,
+						      typename itk::NumericTraits<PixType>::RealType> FusedP;
+  typedef typename itk::IFTWatershedFromMarkersBaseImageFilter<RawImType, LabImType, FusedP> IFTFusedFiltType;
 
+  const bool verbose = Cache == 0;
   typename RawImType::Pointer input = readIm<RawImType>(CmdLineObj.InputIm);
+  typename LabImType::Pointer marker = readIm<LabImType>(CmdLineObj.MarkerIm);
   typename RawImType::Pointer grad;
+  if (!input || !marker)
+    {
+    itkGenericExceptionMacro(<< "failed to read " << (input ? CmdLineObj.MarkerIm : CmdLineObj.InputIm));
+    }
   
-  if (CmdLineObj.dissim) 
+  if (CmdLineObj.dissim && CmdLineObj.ift)
+    {
+    // IFT dissimilarity cost, computed from the input
+    typename IFTDisFiltType::Pointer wsfilt = newFilter<IFTDisFiltType>(Cache);
+    wsfilt->SetReuseBuffers(Cache != 0);
+    wsfilt->SetInput(input);
+    wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
+    wsfilt->SetMarkerImage(marker);
+    wsfilt->SetQueueTraceFile(CmdLineObj.QueueTrace);
+    wsfilt->SetQueueStrategy(CmdLineObj.queue);
+    wsfilt->SetCollectStatistics(CmdLineObj.stats);
+    wsfilt->SetMemoryLimit(CmdLineObj.memoryLimit * itk::SizeValueType(1048576));
+    if (verbose)
+      std::cout << "started IFT dissimilarity watershed" << std::endl;
+    typename LabImType::Pointer res = wsfilt->GetOutput();
+    res->Update();
+    res->DisconnectPipeline();
+    if (CmdLineObj.stats)
+      printStats(CmdLineObj, "ift-dissimilarity", &wsfilt->GetStatistics());
+    writeIm<LabImType>(res, CmdLineObj.OutputIm);
+    }
+  else if (CmdLineObj.dissim)
     {
     // Dissimilarity transform
-    typename WSFiltType2::Pointer wsfilt = WSFiltType2::New();
+    typename WSFiltType2::Pointer wsfilt = newFilter<WSFiltType2>(Cache);
+    wsfilt->SetReuseBuffers(Cache != 0);
     wsfilt->SetInput(input);
     wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
     // wsfilt->SetMarkerImage(orienter->GetOutput());
-    wsfilt->SetMarkerImage(readIm<LabImType>(CmdLineObj.MarkerIm));
-    std::cout << "started dissimilarity watershed" << std::endl;
+    wsfilt->SetMarkerImage(marker);
+    wsfilt->SetCollectStatistics(CmdLineObj.stats);
+    wsfilt->SetMemoryLimit(CmdLineObj.memoryLimit * itk::SizeValueType(1048576));
+    if (verbose)
+      std::cout << "started dissimilarity watershed" << std::endl;
     typename LabImType::Pointer res = wsfilt->GetOutput();
     res->Update();
     res->DisconnectPipeline();
+    if (CmdLineObj.stats)
+      printStats(CmdLineObj, "dissimilarity", &wsfilt->GetStatistics());
     //res->CopyInformation(raw);
     writeIm<LabImType>(res, CmdLineObj.OutputIm);
     } 
   else 
     {
-    if (CmdLineObj.scale != 0.0)
+    if (CmdLineObj.fused)
+      {
+      // the flood works the gradient out as it goes, below
+      }
+    else if (CmdLineObj.scale != 0.0)
       {
       if (CmdLineObj.morphGrad)
 	{
 #ifndef USEPARA
 	// using a morphological gradient - something wrong with this at present
-	typename MorphGradFiltType::Pointer morphgrad = MorphGradFiltType::New();
+	typename MorphGradFiltType::Pointer morphgrad = newFilter<MorphGradFiltType>(Cache);
 	typename KernType::RadiusType radius;
 	radius.Fill(int(CmdLineObj.scale));
 	KernType kern = KernType::Box(radius);
@@ -149,16 +357,16 @@ void doWatershed(const CmdLineType &CmdLineObj)
 	morphgrad->SetKernel(kern);
 	grad = morphgrad->GetOutput();
 	grad->Update();
-	grad->DisconnectPipeline();
+	keepGradient<RawImType>(grad, Cache);
 #else
 	// use parabolic instead
 	typedef typename itk::ParabolicErodeImageFilter<RawImType> EPType;
 	typedef typename itk::ParabolicDilateImageFilter<RawImType> DPType;
 	typedef typename itk::SubtractImageFilter<RawImType, RawImType, RawImType> SType;
 	
-	typename DPType::Pointer dilate = DPType::New();
-	typename EPType::Pointer erode = EPType::New();
-	typename SType::Pointer sub = SType::New();
+	typename DPType::Pointer dilate = newFilter<DPType>(Cache);
+	typename EPType::Pointer erode = newFilter<EPType>(Cache);
+	typename SType::Pointer sub = newFilter<SType>(Cache);
 	
 	dilate->SetInput(input);
 	erode->SetInput(dilate->GetOutput());
@@ -172,25 +380,26 @@ void doWatershed(const CmdLineType &CmdLineObj)
 	erode->SetScale(CmdLineObj.scale);
 	grad = sub->GetOutput();
 	grad->Update();
-	grad->DisconnectPipeline();
+	keepGradient<RawImType>(grad, Cache);
 
 #endif 
 	}
       else
 	{
-	typename GradFiltType::Pointer gradfilt = GradFiltType::New();
+	typename GradFiltType::Pointer gradfilt = newFilter<GradFiltType>(Cache);
 	gradfilt->SetInput(input);
 	gradfilt->SetSigma(CmdLineObj.scale);
 	grad = gradfilt->GetOutput();
 	grad->Update();
-	grad->DisconnectPipeline();
+	keepGradient<RawImType>(grad, Cache);
 	
 	
 	}
       }
     else
       {
-      std::cout << "No gradient being used" << std::endl;
+      if (verbose)
+	std::cout << "No gradient being used" << std::endl;
       grad = input;
       }
 
@@ -202,29 +411,84 @@ void doWatershed(const CmdLineType &CmdLineObj)
     // orienter->SetInput(readIm<LabImType>(CmdLineObj.MarkerIm));
     // orienter->UseImageDirectionOn();
     // orienter->SetDesiredCoordinateOrientation(orientAd.FromDirectionCosines(grad->GetDirection()));
-    typename WSFiltType::Pointer wsfilt = WSFiltType::New();
-    wsfilt->SetInput(grad);
-    wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
-    // wsfilt->SetMarkerImage(orienter->GetOutput());
-    wsfilt->SetMarkerImage(readIm<LabImType>(CmdLineObj.MarkerIm));
-    std::cout << "started watershed" << std::endl;
-    typename LabImType::Pointer res = wsfilt->GetOutput();
-    res->Update();
-    res->DisconnectPipeline();
+    typename LabImType::Pointer res;
+    if (CmdLineObj.fused)
+      {
+      FusedP fp;
+      if (CmdLineObj.morphGrad)
+	{
+	fp.SetMethod(FusedP::Morphological);
+	fp.SetRadius(int(CmdLineObj.scale));
+	}
+      else
+	{
+	fp.SetMethod(FusedP::Gaussian);
+	fp.SetSigma(CmdLineObj.scale);
+	}
+      typename IFTFusedFiltType::Pointer wsfilt = newFilter<IFTFusedFiltType>(Cache);
+      wsfilt->SetReuseBuffers(Cache != 0);
+      wsfilt->SetInput(input);
+      wsfilt->SetFunctor(fp);
+      wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
+      wsfilt->SetMarkerImage(marker);
+      wsfilt->SetQueueTraceFile(CmdLineObj.QueueTrace);
+      wsfilt->SetQueueStrategy(CmdLineObj.queue);
+      wsfilt->SetCollectStatistics(CmdLineObj.stats);
+      wsfilt->SetMemoryLimit(CmdLineObj.memoryLimit * itk::SizeValueType(1048576));
+      if (verbose)
+	std::cout << "started fused IFT watershed" << std::endl;
+      res = wsfilt->GetOutput();
+      res->Update();
+      res->DisconnectPipeline();
+      if (CmdLineObj.stats)
+	printStats(CmdLineObj, "ift-fused", &wsfilt->GetStatistics());
+      }
+    else if (CmdLineObj.ift)
+      {
+      typename IFTFiltType::Pointer wsfilt = newFilter<IFTFiltType>(Cache);
+      wsfilt->SetReuseBuffers(Cache != 0);
+      wsfilt->SetInput(grad);
+      wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
+      wsfilt->SetMarkerImage(marker);
+      wsfilt->SetQueueTraceFile(CmdLineObj.QueueTrace);
+      wsfilt->SetQueueStrategy(CmdLineObj.queue);
+      wsfilt->SetCollectStatistics(CmdLineObj.stats);
+      wsfilt->SetMemoryLimit(CmdLineObj.memoryLimit * itk::SizeValueType(1048576));
+      if (verbose)
+	std::cout << "started IFT watershed" << std::endl;
+      res = wsfilt->GetOutput();
+      res->Update();
+      res->DisconnectPipeline();
+      if (CmdLineObj.stats)
+	printStats(CmdLineObj, "ift", &wsfilt->GetStatistics());
+      }
+    else
+      {
+      typename WSFiltType::Pointer wsfilt = newFilter<WSFiltType>(Cache);
+      wsfilt->SetInput(grad);
+      wsfilt->SetMarkWatershedLine(CmdLineObj.MarkWSLine);
+      // wsfilt->SetMarkerImage(orienter->GetOutput());
+      wsfilt->SetMarkerImage(marker);
+      if (verbose)
+	std::cout << "started watershed" << std::endl;
+      res = wsfilt->GetOutput();
+      res->Update();
+      res->DisconnectPipeline();
+      if (CmdLineObj.stats)
+	printStats(CmdLineObj, "morphological", 0);
+      }
     //res->CopyInformation(raw);
     writeIm<LabImType>(res, CmdLineObj.OutputIm);
-    writeIm<RawImType>(grad, "grad.nii.gz");
+    if (verbose && grad)
+      writeIm<RawImType>(grad, "grad.nii.gz");
     }
 
 }
 ////////////////////////////////////////////////////////
-int main(int argc, char * argv[])
+// One case, through the type switches. Cache as for doWatershed.
+int runCase(const CmdLineType &CmdLineObj, WorkerCache *Cache)
 {
-
   int dim1, dim2 = 0;
-  CmdLineType CmdLineObj;
-  ParseCmdLine(argc, argv, CmdLineObj);
-//  itk::MultiThreader::SetGlobalMaximumNumberOfThreads(1);
   itk::ImageIOBase::IOComponentType ComponentType, MarkerComponentType;
 
   if (!readImageInfo(CmdLineObj.InputIm, &ComponentType, &dim1))
@@ -266,8 +530,427 @@ int main(int argc, char * argv[])
     break;
     default:
       std::cerr << "Unsupported dimension" << std::endl;
-      break;
+      return(EXIT_FAILURE);
     }
 
   return EXIT_SUCCESS;
 }
+////////////////////////////////////////////////////////
+// Batch mode
+
+typedef struct BatchCase
+{
+  CmdLineType Args;
+  double Voxels, Bytes, Seconds;
+  int Worker;
+  std::string Error;
+} BatchCase;
+
+typedef struct BatchType
+{
+  std::vector<BatchCase> Cases;
+  size_t Next;
+  int Threads;
+  itk::SimpleFastMutexLock Lock;
+} BatchType;
+
+// input, marker and output per line, with # starting a comment. The
+// other settings come from CmdLineObj.
+bool readManifest(const CmdLineType &CmdLineObj, std::vector<BatchCase> &Cases)
+{
+  std::ifstream manifest(CmdLineObj.Batch.c_str());
+  if (!manifest)
+    {
+    std::cerr << "Failed to open " << CmdLineObj.Batch << std::endl;
+    return false;
+    }
+  std::string line, extra;
+  for (int lineNo = 1; std::getline(manifest, line); lineNo++)
+    {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    BatchCase c;
+    c.Args = CmdLineObj;
+    if (!(fields >> c.Args.InputIm))
+      continue;
+    if (!(fields >> c.Args.MarkerIm >> c.Args.OutputIm) || (fields >> extra))
+      {
+      std::cerr << CmdLineObj.Batch << ":" << lineNo << ": expected input, marker and output" << std::endl;
+      return false;
+      }
+    c.Voxels = c.Bytes = c.Seconds = 0;
+    c.Worker = -1;
+    Cases.push_back(c);
+    }
+  return true;
+}
+
+// Rough peak memory of a case: the input and marker, read and in the
+// worker's filters from the case before, the labels and the reused
+// label copy, the cost, status and queue of the flood, and the
+// gradient with the floating point images of the gaussian. A fused
+// gradient only keeps the blocks around the flood front.
+double caseBytes(const CmdLineType &CmdLineObj, const ImageFileHeader &input,
+		 const ImageFileHeader &marker, double voxels)
+{
+  double perVoxel = 2 * componentSize(input.ComponentType)
+    + 2 * componentSize(marker.ComponentType) + 17;
+  if (!CmdLineObj.dissim && !CmdLineObj.fused && CmdLineObj.scale != 0.0)
+    {
+    perVoxel += componentSize(input.ComponentType);
+    if (!CmdLineObj.morphGrad)
+      perVoxel += 16;
+    }
+  return perVoxel * voxels;
+}
+
+ITK_THREAD_RETURN_TYPE batchWorker(void *arg)
+{
+  itk::MultiThreader::ThreadInfoStruct *info = static_cast< itk::MultiThreader::ThreadInfoStruct * >( arg );
+  BatchType *batch = static_cast< BatchType * >( info->UserData );
+  WorkerCache cache(batch->Threads);
+  for (;;)
+    {
+    batch->Lock.Lock();
+    const size_t next = batch->Next++;
+    batch->Lock.Unlock();
+    if (next >= batch->Cases.size())
+      break;
+
+    BatchCase &c = batch->Cases[next];
+    c.Worker = info->ThreadID;
+    itk::TimeProbe timer;
+    timer.Start();
+    try
+      {
+      if (runCase(c.Args, &cache) != EXIT_SUCCESS)
+	c.Error = "unreadable or unsupported images";
+      }
+    catch (itk::ExceptionObject &ex)
+      {
+      c.Error = ex.GetDescription();
+      }
+    catch (std::exception &ex)
+      {
+      c.Error = ex.what();
+      }
+    timer.Stop();
+    c.Seconds = timer.GetTotal();
+    if (!c.Error.empty())
+      cache.Clear();
+    }
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+int runBatch(const CmdLineType &CmdLineObj)
+{
+  BatchType batch;
+  if (!readManifest(CmdLineObj, batch.Cases))
+    return(EXIT_FAILURE);
+  if (batch.Cases.empty())
+    {
+    std::cerr << "No cases in " << CmdLineObj.Batch << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  // the headers give the sizes for the memory estimate
+  double largest = 0;
+  for (size_t i = 0; i < batch.Cases.size(); i++)
+    {
+    BatchCase &c = batch.Cases[i];
+    ImageFileHeader input, marker;
+    if (!getImageHeader(c.Args.InputIm, input) || !getImageHeader(c.Args.MarkerIm, marker))
+      continue;
+    c.Voxels = 1;
+    for (size_t d = 0; d < input.Size.size(); d++)
+      c.Voxels *= input.Size[d];
+    c.Bytes = caseBytes(c.Args, input, marker, c.Voxels);
+    largest = std::max(largest, c.Bytes);
+    }
+  // the IO factories are set up on first use, which mustn't happen
+  // in several workers at once
+  itk::ImageIOFactory::CreateImageIO(batch.Cases[0].Args.OutputIm.c_str(), itk::ImageIOFactory::WriteMode);
+
+  const int cores = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  int workers = CmdLineObj.workers;
+  if (workers <= 0)
+    {
+    workers = std::min<int>(cores, batch.Cases.size());
+    const double memory = CmdLineObj.memory > 0 ? CmdLineObj.memory * 1048576.0 : physicalMemory();
+    if (memory > 0 && largest > 0)
+      workers = std::min<int>(workers, static_cast<int>(memory / largest));
+    workers = std::max(workers, 1);
+    }
+  batch.Threads = std::max(cores / workers, 1);
+  batch.Next = 0;
+  std::cout << batch.Cases.size() << " cases, " << workers << " workers of "
+	    << batch.Threads << " threads" << std::endl;
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(workers);
+  threader->SetSingleMethod(batchWorker, &batch);
+  itk::TimeProbe timer;
+  timer.Start();
+  threader->SingleMethodExecute();
+  timer.Stop();
+
+  int failed = 0;
+  double voxels = 0;
+  std::cout << "input\tvoxels\tseconds\tMvox/s\tworker\tstatus" << std::endl;
+  for (size_t i = 0; i < batch.Cases.size(); i++)
+    {
+    const BatchCase &c = batch.Cases[i];
+    std::cout << c.Args.InputIm << "\t" << c.Voxels << "\t" << c.Seconds << "\t"
+	      << (c.Seconds > 0 ? c.Voxels / c.Seconds / 1e6 : 0) << "\t" << c.Worker << "\t"
+	      << (c.Error.empty() ? "ok" : c.Error) << std::endl;
+    if (c.Error.empty())
+      voxels += c.Voxels;
+    else
+      failed++;
+    }
+  std::cout << "total: " << batch.Cases.size() - failed << " done, " << failed << " failed, "
+	    << timer.GetTotal() << " seconds, "
+	    << (timer.GetTotal() > 0 ? voxels / timer.GetTotal() / 1e6 : 0) << " Mvox/s" << std::endl;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+////////////////////////////////////////////////////////
+// Service mode. markerWS --serve path listens on a Unix domain socket
+// at path and runs the jobs sent to it one at a time, all with the
+// same cache of filters, so that a job costs only its reads, flood
+// and write. A job is a line of options as for the command line,
+// with double quotes around paths holding spaces, and is answered by
+// a line of "ok <seconds>" once its output is written, or of
+// "error <reason>". A connection can send any number of jobs, and
+// other connections wait for it to close. "quit" stops the service.
+
+// the words of a job line, after the program name
+std::vector<std::string> jobArgs(const std::string &line)
+{
+  std::vector<std::string> args(1, "markerWS");
+  std::string word;
+  bool quoted = false, inWord = false;
+  for (size_t i = 0; i < line.size(); i++)
+    {
+    const char c = line[i];
+    if (c == '"')
+      {
+      quoted = !quoted;
+      inWord = true;
+      }
+    else if (!quoted && std::isspace(static_cast<unsigned char>(c)))
+      {
+      if (inWord)
+	args.push_back(word);
+      word.clear();
+      inWord = false;
+      }
+    else
+      {
+      word += c;
+      inWord = true;
+      }
+    }
+  if (inWord)
+    args.push_back(word);
+  return args;
+}
+
+// Runs one job line, giving the reply. Headers are read again, as
+// interactive jobs rewrite their markers between runs.
+std::string runJob(const std::string &line, WorkerCache &cache)
+{
+  CmdLineType job;
+  std::string error;
+  itk::TimeProbe timer;
+  timer.Start();
+  if (ParseCmdLine(jobArgs(line), job, true, error))
+    {
+    ImageFileHeader header;
+    rereadImageHeader(job.InputIm, header);
+    rereadImageHeader(job.MarkerIm, header);
+    try
+      {
+      if (runCase(job, &cache) != EXIT_SUCCESS)
+	error = "unreadable or unsupported images";
+      }
+    catch (itk::ExceptionObject &ex)
+      {
+      error = ex.GetDescription();
+      }
+    catch (std::exception &ex)
+      {
+      error = ex.what();
+      }
+    if (!error.empty())
+      cache.Clear();
+    }
+  timer.Stop();
+
+  std::ostringstream reply;
+  if (error.empty())
+    reply << "ok " << timer.GetTotal();
+  else
+    {
+    // the reply is a single line
+    std::replace(error.begin(), error.end(), '\n', ' ');
+    reply << "error " << error;
+    }
+  std::cout << (job.InputIm.empty() ? line : job.InputIm) << "\t" << reply.str() << std::endl;
+  return reply.str();
+}
+
+#if !defined(_WIN32)
+// a connection to the service, read a line at a time
+class ServiceConnection
+{
+public:
+  ServiceConnection(int fd) : Fd(fd) {}
+  ~ServiceConnection() { close(Fd); }
+
+  // false at the end of the connection, or for a line too long to be
+  // a job
+  bool ReadLine(std::string &line)
+  {
+    for (;;)
+      {
+      const std::string::size_type end = Pending.find('\n');
+      if (end != std::string::npos)
+	{
+	line = Pending.substr(0, end);
+	Pending.erase(0, end + 1);
+	if (!line.empty() && line[line.size() - 1] == '\r')
+	  line.erase(line.size() - 1);
+	return true;
+	}
+      if (Pending.size() > 65536)
+	return false;
+      char buffer[4096];
+      const ssize_t n = read(Fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      Pending.append(buffer, n);
+      }
+  }
+
+  bool WriteLine(const std::string &line)
+  {
+    const std::string s = line + "\n";
+    size_t done = 0;
+    while (done < s.size())
+      {
+      const ssize_t n = write(Fd, s.data() + done, s.size() - done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      done += n;
+      }
+    return true;
+  }
+
+private:
+  int Fd;
+  std::string Pending;
+};
+
+int runService(const CmdLineType &CmdLineObj)
+{
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (CmdLineObj.Serve.size() >= sizeof(address.sun_path))
+    {
+    std::cerr << "Socket path too long: " << CmdLineObj.Serve << std::endl;
+    return(EXIT_FAILURE);
+    }
+  std::strcpy(address.sun_path, CmdLineObj.Serve.c_str());
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    {
+    std::cerr << "socket: " << std::strerror(errno) << std::endl;
+    return(EXIT_FAILURE);
+    }
+  // a socket left by a service that stopped without removing it is
+  // replaced, but not one that is still answering, or any other file
+  struct stat st;
+  if (stat(address.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+    const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+      unlink(address.sun_path);
+    if (probe >= 0)
+      close(probe);
+    }
+  if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+      || listen(listener, 16) != 0)
+    {
+    std::cerr << "Can't listen on " << CmdLineObj.Serve << ": " << std::strerror(errno) << std::endl;
+    close(listener);
+    return(EXIT_FAILURE);
+    }
+  // a client that leaves before its reply mustn't stop the service
+  signal(SIGPIPE, SIG_IGN);
+
+  WorkerCache cache(itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
+  std::cout << "serving on " << CmdLineObj.Serve << std::endl;
+  bool quit = false;
+  while (!quit)
+    {
+    const int fd = accept(listener, 0, 0);
+    if (fd < 0)
+      {
+      if (errno == EINTR)
+	continue;
+      std::cerr << "accept: " << std::strerror(errno) << std::endl;
+      break;
+      }
+    ServiceConnection connection(fd);
+    std::string line;
+    while (!quit && connection.ReadLine(line))
+      {
+      std::string reply;
+      if (line.find_first_not_of(" \t") == std::string::npos)
+	continue;
+      if (line == "quit")
+	{
+	quit = true;
+	reply = "ok";
+	}
+      else
+	reply = runJob(line, cache);
+      if (!connection.WriteLine(reply))
+	break;
+      }
+    }
+  close(listener);
+  unlink(address.sun_path);
+  return quit ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#else
+int runService(const CmdLineType &)
+{
+  std::cerr << "--serve needs Unix domain sockets, which this platform doesn't have" << std::endl;
+  return(EXIT_FAILURE);
+}
+#endif
+////////////////////////////////////////////////////////
+int main(int argc, char * argv[])
+{
+
+  CmdLineType CmdLineObj;
+  std::string error;
+  if (!ParseCmdLine(std::vector<std::string>(argv, argv + argc), CmdLineObj, false, error))
+    {
+    std::cerr << "error: " << error << std::endl;
+    return(EXIT_FAILURE);
+    }
+//  itk::MultiThreader::SetGlobalMaximumNumberOfThreads(1);
+
+  if (!CmdLineObj.Serve.empty())
+    return runService(CmdLineObj);
+  if (!CmdLineObj.Batch.empty())
+    return runBatch(CmdLineObj);
+  return runCase(CmdLineObj, 0);
+}
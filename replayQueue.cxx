@@ -0,0 +1,268 @@
+#include "itkIFTQueueTrace.h"
+#include <itkTimeProbe.h>
+#include <iostream>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Replays a queue trace recorded by the IFT filter (SetQueueTraceFile,
+// or markerWS --queuetrace) through each of the queues of
+// itkIFTQueue.h that can take it, and reports the time per
+// operation and the memory used. Pops are checked against the trace:
+// a queue that gives out values in another order, e.g. by breaking
+// ties differently, has mismatches. Only the queue operations are
+// timed, decoding the trace is not.
+//
+// usage: replayQueue trace [repeats [queue...]]
+//
+// Without queue names every queue that can take the trace is
+// run. IFTQueueB searches a list per key on update, so it can take
+// very long on traces with few distinct keys.
+//
+// A new queue is added by giving it an IFTQueueReplayOps
+// specialisation if it needs setting up, and a line in replayAll.
+
+// IFTQueueA needs every key to be unique, so, as in the filter with
+// the QueueA strategy, the cost is paired with an insertion counter
+template <class TKey>
+class TimedKey
+{
+public:
+  TKey               P;
+  unsigned long long Time;
+  bool operator<(const TimedKey &other) const
+  {
+    return P < other.P || ( P == other.P && Time < other.Time );
+  }
+};
+
+// the value ordering of the tree based queues. Its own type, as their
+// constructors can't be told apart when the key and value comparisons
+// are the same type
+template <class TValue>
+class ValueLess : public std::less<TValue> {};
+
+template <class TKey, class TValue>
+class IFTQueueReplayOps< IFTQueueA<TimedKey<TKey>, TValue, std::less<TimedKey<TKey> >,
+				   ValueLess<TValue>, IFTPoolAllocator<TValue> > > :
+  public IFTQueueReplayBasicOps
+{
+public:
+  template <class TQueue>
+  void Initialize(TQueue &q, const IFTQueueTraceHeader &h)
+  {
+    q.reserve(static_cast<size_t>(h.NumberOfValues));
+    Time = 0;
+  }
+
+  template <class TQueue>
+  void Insert(TQueue &q, TValue val, TKey key)
+  {
+    TimedKey<TKey> k;
+    k.P = key;
+    k.Time = Time++;
+    q.insert(val, k);
+  }
+
+private:
+  unsigned long long Time;
+};
+
+////////////////////////////////////////////////////////
+// resident set size, in bytes, from /proc on Linux. Elsewhere nothing
+// is reported. Memory freed by the queue before is given back first,
+// so that it isn't reused unseen by the next one.
+static void resetPeakRSS()
+{
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  std::ofstream clear("/proc/self/clear_refs");
+  if (clear)
+    clear << "5" << std::flush;
+}
+
+static double procStatus(const char *field)
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  const size_t len = strlen(field);
+  while (std::getline(status, line))
+    {
+    if (line.compare(0, len, field) == 0)
+      return atof(line.c_str() + len) * 1024;
+    }
+  return 0;
+}
+
+////////////////////////////////////////////////////////
+const size_t ChunkSize = 1 << 20;
+
+// set if the file ends before the operations in its header do
+static bool truncated = false;
+
+// the queues asked for, all if empty
+static std::vector<std::string> queues;
+
+template <class TQueue, class TKey, class TValue>
+void replay(const char *name, const std::string &filename, int repeats)
+{
+  if (!queues.empty() && std::find(queues.begin(), queues.end(), name) == queues.end())
+    return;
+
+  typedef IFTQueueTraceEntry<TKey, TValue> EntryType;
+  typedef typename std::vector<EntryType>::const_iterator EntryIterator;
+  std::vector<EntryType> entries;
+  entries.reserve(ChunkSize);
+
+  double best = std::numeric_limits<double>::max(), memory = 0;
+  unsigned long long mismatches = 0;
+  IFTArenaStatistics arena;
+  for (int r = 0; r < repeats; r++)
+    {
+    IFTQueueTraceReader reader;
+    reader.Open(filename);
+    resetPeakRSS();
+    const double base = procStatus("VmRSS:");
+    itk::TimeProbe timer;
+    mismatches = 0;
+      {
+      TQueue q;
+      IFTQueueReplayOps<TQueue> ops;
+      ops.Initialize(q, reader.GetHeader());
+      while (reader.Read(entries, ChunkSize))
+	{
+	timer.Start();
+	for (EntryIterator e = entries.begin(); e != entries.end(); ++e)
+	  {
+	  if (e->Operation == EntryType::Pop)
+	    {
+	    mismatches += ops.template Pop<TValue>(q) != e->Value;
+	    }
+	  else
+	    {
+	    ops.Insert(q, e->Value, e->Key);
+	    }
+	  }
+	timer.Stop();
+	}
+      truncated = truncated || reader.IsTruncated();
+      arena = IFTQueueArenaStatistics(q);
+      memory = procStatus("VmHWM:") - base;
+      }
+    best = std::min(best, timer.GetTotal());
+    }
+
+  IFTQueueTraceReader reader;
+  reader.Open(filename);
+  const double ops = static_cast<double>(reader.GetHeader().GetNumberOfOperations());
+  std::cout << name << "\t" << (ops > 0 ? best * 1e9 / ops : 0) << "\t" << best << "\t"
+	    << memory / 1048576 << "\t" << arena.PeakSize / 1048576.0 << "\t"
+	    << mismatches << std::endl;
+}
+
+template <class TKey, class TValue>
+void replayAll(const std::string &filename, const IFTQueueTraceHeader &h, int repeats)
+{
+  typedef ValueLess<TValue> VLess;
+  std::cout << "queue\tns/op\tseconds\tpeak RSS (MB)\tarena (MB)\tpop mismatches" << std::endl;
+  replay<IFTQueueA<TimedKey<TKey>, TValue, std::less<TimedKey<TKey> >, VLess, IFTPoolAllocator<TValue> >,
+    TKey, TValue>("IFTQueueA", filename, repeats);
+  replay<IFTQueueB<TKey, TValue, std::less<TKey>, VLess, IFTPoolAllocator<TValue> >,
+    TKey, TValue>("IFTQueueB", filename, repeats);
+  replay<IFTHeapQueue<TKey, TValue>, TKey, TValue>("IFTHeapQueue", filename, repeats);
+  replay<IFTLazyQueue<TKey, TValue>, TKey, TValue>("IFTLazyQueue", filename, repeats);
+  replay<IFTRadixQueue<TKey, TValue>, TKey, TValue>("IFTRadixQueue", filename, repeats);
+  if (h.KeyKind != IFTQueueTraceHeader::FloatKey && h.MaxKey - h.MinKey < (1 << 24))
+    {
+    replay<IFTBucketQueue<TKey, TValue>, TKey, TValue>("IFTBucketQueue", filename, repeats);
+    }
+}
+
+template <class TKey>
+void replayKey(const std::string &filename, const IFTQueueTraceHeader &h, int repeats)
+{
+  if (h.NumberOfValues <= std::numeric_limits<unsigned int>::max())
+    replayAll<TKey, unsigned int>(filename, h, repeats);
+  else
+    replayAll<TKey, unsigned long long>(filename, h, repeats);
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 2)
+    {
+    std::cerr << "usage: " << argv[0] << " trace [repeats [queue...]]" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  const std::string filename = argv[1];
+  const int repeats = argc > 2 ? std::max(atoi(argv[2]), 1) : 3;
+  queues.assign(argv + std::min(argc, 3), argv + argc);
+#ifdef __GLIBC__
+  // large blocks always get their own mappings, which go back to the
+  // system when they are freed
+  mallopt(M_MMAP_THRESHOLD, 1 << 17);
+#endif
+
+  IFTQueueTraceReader reader;
+  if (!reader.Open(filename))
+    {
+    std::cerr << "Failed to read a queue trace from " << filename << std::endl;
+    return(EXIT_FAILURE);
+    }
+  const IFTQueueTraceHeader h = reader.GetHeader();
+  std::cout << filename << ": " << h.NumberOfValues << " values, "
+	    << h.NumberOfInserts << " inserts, " << h.NumberOfUpdates << " updates, "
+	    << h.NumberOfPops << " pops, at most " << h.PeakSize << " queued, keys "
+	    << h.MinKey << " to " << h.MaxKey << std::endl;
+
+  const unsigned kind = h.KeyKind * 16 + h.KeySize;
+  switch (kind)
+    {
+    case IFTQueueTraceHeader::SignedKey * 16 + 1:
+      replayKey<signed char>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::SignedKey * 16 + 2:
+      replayKey<short>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::SignedKey * 16 + 4:
+      replayKey<int>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::SignedKey * 16 + 8:
+      replayKey<long long>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::UnsignedKey * 16 + 1:
+      replayKey<unsigned char>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::UnsignedKey * 16 + 2:
+      replayKey<unsigned short>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::UnsignedKey * 16 + 4:
+      replayKey<unsigned int>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::UnsignedKey * 16 + 8:
+      replayKey<unsigned long long>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::FloatKey * 16 + 4:
+      replayKey<float>(filename, h, repeats);
+      break;
+    case IFTQueueTraceHeader::FloatKey * 16 + 8:
+      replayKey<double>(filename, h, repeats);
+      break;
+    default:
+      std::cerr << "Unsupported key type in " << filename << std::endl;
+      return(EXIT_FAILURE);
+    }
+
+  if (truncated)
+    {
+    std::cerr << filename << " is cut short, only part of it was replayed" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  return(EXIT_SUCCESS);
+}
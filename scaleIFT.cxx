@@ -0,0 +1,108 @@
+#include "itkIFTWatershedFromMarkersImageFilter.h"
+#include <itkTimeProbe.h>
+#include <itkMultiThreader.h>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+
+// Thread count scaling of the parallel IFT flood, on a synthetic
+// volume. Each thread count is checked against the serial result.
+//
+// usage: scaleIFT [size] [max threads]
+
+const int dimension=3;
+
+typedef itk::Image<unsigned char, dimension> LabImType;
+typedef itk::Image<short, dimension> RawImType;
+typedef itk::IFTWatershedFromMarkersImageFilter<RawImType, LabImType> IFTWSType;
+
+static unsigned long state = 1;
+static unsigned long nextRandom()
+{
+  state = state * 1103515245 + 12345;
+  return (state / 65536) % 32768;
+}
+
+int main(int argc, char * argv[])
+{
+  const unsigned size = argc > 1 ? atoi(argv[1]) : 128;
+  const unsigned maxThreads = argc > 2 ? atoi(argv[2]) :
+    itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  RawImType::RegionType region;
+  RawImType::SizeType sz;
+  sz.Fill(size);
+  region.SetSize(sz);
+
+  // smooth blobs plus noise, so there are basins and plateaus
+  RawImType::Pointer control = RawImType::New();
+  control->SetRegions(region);
+  control->Allocate();
+  LabImType::Pointer marker = LabImType::New();
+  marker->SetRegions(region);
+  marker->Allocate();
+  marker->FillBuffer(0);
+
+  short *raw = control->GetBufferPointer();
+  unsigned long p = 0;
+  for (unsigned z = 0; z < size; z++)
+    {
+    for (unsigned y = 0; y < size; y++)
+      {
+      for (unsigned x = 0; x < size; x++, p++)
+	{
+	double v = std::sin(x * 0.11) + std::sin(y * 0.07) + std::sin(z * 0.05 + x * 0.03);
+	raw[p] = static_cast<short>(100 * (v + 3) + nextRandom() % 8);
+	}
+      }
+    }
+  const unsigned long numberOfPixels = p;
+  for (unsigned m = 0; m < 200; m++)
+    {
+    marker->GetBufferPointer()[nextRandom() * 32768 % numberOfPixels] = 1 + m % 250;
+    }
+
+  IFTWSType::Pointer IFT = IFTWSType::New();
+  IFT->SetInput(control);
+  IFT->SetMarkerImage(marker);
+  IFT->SetFullyConnected(true);
+
+  itk::TimeProbe serialTime;
+  serialTime.Start();
+  IFT->Update();
+  serialTime.Stop();
+  LabImType::Pointer serial = IFT->GetOutput();
+  serial->DisconnectPipeline();
+
+  std::cout << "size " << size << "^3, serial " << serialTime.GetMean() << "s" << std::endl;
+  std::cout << "threads\ttime\tspeedup\tseam rounds" << std::endl;
+
+  for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+    {
+    IFT->SetParallelFlood(true);
+    IFT->SetNumberOfThreads(threads);
+    IFT->Modified();
+    itk::TimeProbe parallelTime;
+    parallelTime.Start();
+    IFT->Update();
+    parallelTime.Stop();
+
+    std::cout << threads << "\t" << parallelTime.GetMean() << "\t"
+	      << serialTime.GetMean() / parallelTime.GetMean() << "\t"
+	      << IFT->GetNumberOfSeamRounds() << std::endl;
+
+    const unsigned char *a = serial->GetBufferPointer();
+    const unsigned char *b = IFT->GetOutput()->GetBufferPointer();
+    for (unsigned long i = 0; i < numberOfPixels; i++)
+      {
+      if (a[i] != b[i])
+	{
+	std::cerr << "Parallel result differs from serial with "
+		  << threads << " threads" << std::endl;
+	return(EXIT_FAILURE);
+	}
+      }
+    }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,104 @@
+#include "itkDifferentialIFTWatershedFromMarkersImageFilter.h"
+#include <iostream>
+#include <algorithm>
+#include "ioutils.h"
+
+// usage: testDIFT control markers output [x y label]...
+// Each x y label triple is applied as a separate edit after the
+// first update. A label of 0 removes the marker. After each edit the
+// costs and the reached pixels are checked against a fresh run with
+// the edited markers, and the test fails if they differ. Labels
+// aren't checked, as they may differ on plateaus.
+
+// the number of pixels where the costs, or whether a marker reaches
+// the pixel, differ between the two filters
+template <class TFilter>
+unsigned long countDifferences(const TFilter *incremental, const TFilter *fresh)
+{
+  const typename TFilter::LabelImageType *label = incremental->GetOutput();
+  const typename TFilter::LabelImageType *freshLabel = fresh->GetOutput();
+  const typename TFilter::CostType *cost = incremental->GetCostImage()->GetBufferPointer();
+  const typename TFilter::CostType *freshCost = fresh->GetCostImage()->GetBufferPointer();
+  const typename TFilter::LabelImagePixelType *labelBuf = label->GetBufferPointer();
+  const typename TFilter::LabelImagePixelType *freshLabelBuf = freshLabel->GetBufferPointer();
+
+  unsigned long differences = 0;
+  const itk::SizeValueType numberOfPixels = label->GetBufferedRegion().GetNumberOfPixels();
+  for (itk::SizeValueType p = 0; p < numberOfPixels; p++)
+    {
+    // unreached pixels have the watershed label and an undefined cost
+    const bool reached = labelBuf[p] != 0;
+    if (reached != (freshLabelBuf[p] != 0) || (reached && cost[p] != freshCost[p]))
+      {
+      ++differences;
+      }
+    }
+  return differences;
+}
+
+int main(int argc, char * argv[])
+{
+  const int dimension=2;
+
+  typedef itk::Image<unsigned char, dimension> LabImType;
+  typedef itk::Image<short, dimension> RawImType;
+
+  typedef itk::DifferentialIFTWatershedFromMarkersImageFilter<RawImType, LabImType> IFTWSType;
+
+  RawImType::Pointer control = readIm<RawImType>(argv[1]);
+  LabImType::Pointer marker = readIm<LabImType>(argv[2]);
+
+  IFTWSType::Pointer IFT = IFTWSType::New();
+
+  IFT->SetInput(control);
+  IFT->SetMarkerImage(marker);
+  IFT->Update();
+
+  // the markers of the fresh runs, with the edits written in, as the
+  // filter doesn't write them back
+  LabImType::Pointer edited = LabImType::New();
+  edited->CopyInformation(marker);
+  edited->SetRegions(marker->GetLargestPossibleRegion());
+  edited->Allocate();
+  std::copy(marker->GetBufferPointer(),
+	    marker->GetBufferPointer() + marker->GetBufferedRegion().GetNumberOfPixels(),
+	    edited->GetBufferPointer());
+
+  bool failed = false;
+  for (int a = 4; a + 2 < argc; a += 3)
+    {
+    LabImType::IndexType idx;
+    idx[0] = atoi(argv[a]);
+    idx[1] = atoi(argv[a+1]);
+    const int label = atoi(argv[a+2]);
+    if (label)
+      {
+      IFT->AddMarker(idx, label);
+      }
+    else
+      {
+      IFT->RemoveMarker(idx);
+      }
+    IFT->Update();
+
+    edited->SetPixel(idx, label);
+    edited->Modified();
+    IFTWSType::Pointer fresh = IFTWSType::New();
+    fresh->SetInput(control);
+    fresh->SetMarkerImage(edited);
+    fresh->Update();
+
+    const unsigned long differences = countDifferences<IFTWSType>(IFT, fresh);
+    std::cout << idx << " -> " << label << ": "
+	      << IFT->GetNumberOfVisitedPixels() << " pixels visited, "
+	      << differences << " differ from a fresh run" << std::endl;
+    if (differences)
+      {
+      failed = true;
+      }
+    }
+
+  writeIm<LabImType>(IFT->GetOutput(), argv[3]);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
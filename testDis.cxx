@@ -27,8 +27,37 @@ public:
 };
 
 
+// The worst case estimate of a dissimilarity watershed on an unsigned
+// char image has no more priority levels than pixel values, so the
+// queue is a few bytes a pixel. The seed lists, a double priority and
+// an offset for each marker and background pair, are most of it.
+// A level per pixel would be over a kilobyte a pixel.
+bool checkEstimate()
+{
+  typedef itk::Image<unsigned char, 2> ImType;
+  typedef itk::Image<unsigned char, 2> LabType;
+  typedef itk::DisSimMorphologicalWatershedFromMarkersImageFilter<ImType, LabType,
+    DifPriority<unsigned char, itk::NumericTraits<unsigned char>::RealType> > EstType;
+
+  LabType::RegionType region;
+  region.SetSize(0, 512);
+  region.SetSize(1, 512);
+  const double pixels = region.GetNumberOfPixels();
+  const itk::SizeValueType limit = static_cast<itk::SizeValueType>(80 * pixels);
+  const itk::WatershedMemoryEstimate estimate = EstType::EstimateMemory(region, false, true);
+  std::cout << "unsigned char estimate: " << estimate.Worst / pixels << " bytes a pixel at worst, "
+	    << estimate.Typical / pixels << " typically" << std::endl;
+  return estimate.Worst <= limit && estimate.Typical <= estimate.Worst;
+}
+
 int main(int, char * argv[])
 {
+  if (!checkEstimate())
+    {
+    std::cerr << "memory estimate over the limit" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
   const int dimension=2;
 
   typedef itk::Image<unsigned char, dimension> LabImType;
@@ -0,0 +1,65 @@
+#include <itkImageRegionConstIterator.h>
+#include <iostream>
+#include "ioutils.h"
+
+// usage: testMapRead image.nrrd|image.mha|image.mhd
+// Reads a 3D short image with readIm, mapped if it can be, and with
+// ImageFileReader, and checks they agree.
+int main(int argc, char * argv[])
+{
+  const int dimension=3;
+
+  typedef itk::Image<short, dimension> RawImType;
+
+  if (argc < 2)
+    {
+    std::cerr << "usage: " << argv[0] << " image" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  ImageFileHeader header;
+  const bool known = getImageHeader(argv[1], header);
+  RawImType::Pointer mapped = readIm<RawImType>(argv[1]);
+  if (!known || !mapped)
+    {
+    return(EXIT_FAILURE);
+    }
+  typedef itk::MemoryMappedImageContainer<itk::SizeValueType, short> MappedType;
+  const bool isMapped = dynamic_cast<const MappedType *>(mapped->GetPixelContainer()) != 0;
+  std::cout << argv[1] << (isMapped ? " mapped" : " read") << std::endl;
+
+  typedef itk::ImageFileReader<RawImType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(argv[1]);
+  reader->Update();
+  RawImType::Pointer read = reader->GetOutput();
+
+  // the header arithmetic may differ from ITK's in the last bits
+  const double tol = 1e-6;
+  bool same = mapped->GetLargestPossibleRegion() == read->GetLargestPossibleRegion();
+  for (int i = 0; i < dimension; i++)
+    {
+    same = same && std::fabs(mapped->GetSpacing()[i] - read->GetSpacing()[i]) < tol
+      && std::fabs(mapped->GetOrigin()[i] - read->GetOrigin()[i]) < tol;
+    for (int j = 0; j < dimension; j++)
+      same = same && std::fabs(mapped->GetDirection()[i][j] - read->GetDirection()[i][j]) < tol;
+    }
+  if (!same)
+    {
+    std::cerr << "Geometry differs" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  itk::ImageRegionConstIterator<RawImType> mit(mapped, mapped->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<RawImType> rit(read, read->GetLargestPossibleRegion());
+  for (; !mit.IsAtEnd(); ++mit, ++rit)
+    {
+    if (mit.Get() != rit.Get())
+      {
+      std::cerr << "Pixels differ at " << mit.GetIndex() << std::endl;
+      return(EXIT_FAILURE);
+      }
+    }
+
+  return(EXIT_SUCCESS);
+}
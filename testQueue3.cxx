@@ -0,0 +1,77 @@
+#include "itkIFTQueue.h"
+#include <iostream>
+#include <cstdlib>
+
+typedef long IndexType;
+typedef float PriorityType;
+
+typedef IFTHeapQueue<PriorityType, IndexType> ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  // values are offsets, so the queue needs to know how many there are
+  ThisQueueType Q(20);
+
+  for (int t = 0; t < 10; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,5);
+    }
+  for (int t = 10; t < 20; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,3);
+    }
+  PriorityType f1 = Q.front_key();
+  IndexType i1 = Q.front_value();
+
+  std::cout << "priority=" << f1 <<" " << i1 << std::endl;
+  std::cout << Q.size() << std::endl;
+
+  Q.PrintKeyMap();
+  std::cout << "===============" << std::endl;
+  // insert an existing value with a new priority
+  PriorityType p;
+  p=7;
+  Q.insert(10, p);
+
+  p=7;
+  Q.insert(15, p);
+
+  // decrease key - should end up behind the other entries at 3
+  p=3;
+  Q.insert(5, p);
+
+  Q.PrintKeyMap();
+  std::cout << "+++++++++++++++++++++" << std::endl;
+  Q.pop();
+  Q.PrintKeyMap();
+  for (unsigned j=0; j< 12;j++) Q.pop();
+  std::cout << "+++++++++++++++++++++" << std::endl;
+  Q.PrintKeyMap();
+
+  // the entries must come out in fifo order within each priority
+  Q.clear();
+  for (int t = 0; t < 20; t++)
+    {
+    Q.insert(t, (t*7)%3);
+    }
+  PriorityType lastP = -1;
+  IndexType lastI = -1;
+  while (!Q.empty())
+    {
+    PriorityType P = Q.front_key();
+    IndexType I = Q.front_value();
+    Q.pop();
+    if ((P < lastP) || ((P == lastP) && (I < lastI)))
+      {
+      std::cerr << "Queue order broken at " << I << std::endl;
+      return(EXIT_FAILURE);
+      }
+    lastP = P;
+    lastI = I;
+    }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,66 @@
+#include "itkIFTQueue.h"
+#include <iostream>
+#include <cstdlib>
+
+typedef long IndexType;
+typedef double PriorityType;
+
+typedef IFTBucketQueue<PriorityType, IndexType> ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  // values are offsets and keys are integers in a known range
+  ThisQueueType Q(20, 0, 255);
+
+  for (int t = 0; t < 10; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,5);
+    }
+  for (int t = 10; t < 20; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,3);
+    }
+  PriorityType f1 = Q.front_key();
+  IndexType i1 = Q.front_value();
+
+  std::cout << "priority=" << f1 <<" " << i1 << std::endl;
+  std::cout << Q.size() << std::endl;
+
+  Q.PrintKeyMap();
+  std::cout << "===============" << std::endl;
+  // insert an existing value with a new priority
+  PriorityType p;
+  p=7;
+  Q.insert(10, p);
+
+  p=7;
+  Q.insert(15, p);
+
+  Q.PrintKeyMap();
+  std::cout << "+++++++++++++++++++++" << std::endl;
+  Q.pop();
+  Q.PrintKeyMap();
+  for (unsigned j=0; j< 12;j++) Q.pop();
+  std::cout << "+++++++++++++++++++++" << std::endl;
+  Q.PrintKeyMap();
+
+  // a key below the current front
+  Q.insert(0, 1);
+  if (Q.front_value() != 0 || Q.front_key() != 1)
+    {
+    std::cerr << "Lower key not at the front" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  // emptying the front bucket by moving its only entry
+  Q.insert(0, 200);
+  if (Q.front_key() != 5)
+    {
+    std::cerr << "Front not advanced after move" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,77 @@
+#include "itkIFTQueue.h"
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+typedef long IndexType;
+typedef float PriorityType;
+
+typedef IFTLazyQueue<PriorityType, IndexType> ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  ThisQueueType Q;
+  // the lazy queue relies on the caller to keep the current key of
+  // each value - in the IFT this is the cost image
+  std::vector<PriorityType> cost(20);
+
+  for (int t = 0; t < 10; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,5);
+    cost[t] = 5;
+    }
+  for (int t = 10; t < 20; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,3);
+    cost[t] = 3;
+    }
+  PriorityType f1 = Q.front_key();
+  IndexType i1 = Q.front_value();
+
+  std::cout << "priority=" << f1 <<" " << i1 << std::endl;
+  std::cout << Q.size() << std::endl;
+
+  Q.PrintKeyMap();
+  std::cout << "===============" << std::endl;
+  // lower the key of some values, leaving stale entries behind
+  Q.insert(3, 1);
+  cost[3] = 1;
+  Q.insert(7, 3);
+  cost[7] = 3;
+
+  Q.PrintKeyMap();
+  std::cout << "+++++++++++++++++++++" << std::endl;
+
+  // 3 comes first, then the entries at 3 in the order they went in
+  IndexType expected[] = {3, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 7,
+                          0, 1, 2, 4, 5, 6, 8, 9};
+  unsigned pos = 0;
+  while (!Q.empty())
+    {
+    PriorityType P = Q.front_key();
+    IndexType I = Q.front_value();
+    if (P != cost[I])
+      {
+      Q.discard();
+      continue;
+      }
+    Q.pop();
+    std::cout << P << " " << I << std::endl;
+    if (I != expected[pos])
+      {
+      std::cerr << "Queue order broken at " << I << std::endl;
+      return(EXIT_FAILURE);
+      }
+    ++pos;
+    }
+  std::cout << "stale entries " << Q.stale_count() << std::endl;
+  if (pos != 20 || Q.stale_count() != 2)
+    {
+    return(EXIT_FAILURE);
+    }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,85 @@
+#include "itkIFTQueue.h"
+#include <iostream>
+#include <cstdlib>
+
+typedef long IndexType;
+typedef float PriorityType;
+
+typedef IFTRadixQueue<PriorityType, IndexType> ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  // values are offsets, so the queue needs to know how many there are
+  ThisQueueType Q(20);
+
+  for (int t = 0; t < 10; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,5.5);
+    }
+  for (int t = 10; t < 20; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t,3.25);
+    }
+  PriorityType f1 = Q.front_key();
+  IndexType i1 = Q.front_value();
+
+  std::cout << "priority=" << f1 <<" " << i1 << std::endl;
+  std::cout << Q.size() << std::endl;
+
+  std::cout << "===============" << std::endl;
+  // insert an existing value with a new priority - keys can't go
+  // below the front of the queue
+  PriorityType p;
+  p=7;
+  Q.insert(10, p);
+
+  p=7;
+  Q.insert(15, p);
+
+  // pop everything, checking that values with equal keys come out in
+  // the order they went in. 3 is moved to the back of its plateau
+  // part way through
+  IndexType expected[] = {11, 12, 13, 14, 16, 17, 18, 19,
+                          0, 1, 2, 4, 5, 6, 7, 8, 9, 3, 10, 15};
+  unsigned pos = 0;
+  while (!Q.empty())
+    {
+    PriorityType P = Q.front_key();
+    IndexType I = Q.front_value();
+    Q.pop();
+    std::cout << P << " " << I << std::endl;
+    if (I != expected[pos])
+      {
+      std::cerr << "Queue order broken at " << I << std::endl;
+      return(EXIT_FAILURE);
+      }
+    // monotone insertion while popping
+    if (pos == 3)
+      {
+      Q.insert(3, 5.5);
+      }
+    ++pos;
+    }
+
+  // negative floating point keys
+  Q.clear();
+  Q.insert(1, -2.5);
+  Q.insert(2, -7.0);
+  Q.insert(3, 0.0);
+  if (Q.front_value() != 2)
+    {
+    std::cerr << "Negative keys out of order" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  Q.pop();
+  if (Q.front_value() != 1)
+    {
+    std::cerr << "Negative keys out of order" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  return(EXIT_SUCCESS);
+}
@@ -0,0 +1,84 @@
+#include "itkIFTQueue.h"
+#include <iostream>
+#include <cstdlib>
+
+typedef long IndexType;
+typedef float PriorityType;
+
+typedef IFTQueueB<PriorityType, IndexType> PlainQueueType;
+typedef IFTQueueB<PriorityType, IndexType, std::less<PriorityType>,
+		  std::less<IndexType>, IFTPoolAllocator<IndexType> > ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  // the same operations on a queue using the node arena and one
+  // using std::allocator must give the same order
+  ThisQueueType Q;
+  PlainQueueType R;
+  Q.reserve(100000);
+
+  for (int t = 0; t < 2000; t++)
+    {
+    // pretend t is an index too.
+    Q.insert(t, t % 7);
+    R.insert(t, t % 7);
+    }
+  // move some values around
+  for (int t = 0; t < 2000; t += 3)
+    {
+    Q.insert(t, (t % 11) - 1);
+    R.insert(t, (t % 11) - 1);
+    }
+  for (int t = 1; t < 2000; t += 5)
+    {
+    Q.erase(t);
+    R.erase(t);
+    }
+
+  // a copy has its own arena
+  ThisQueueType C(Q);
+
+  while (!R.empty())
+    {
+    if (Q.empty() || C.empty()
+	|| Q.front_value() != R.front_value() || Q.front_key() != R.front_key()
+	|| C.front_value() != R.front_value() || C.front_key() != R.front_key())
+      {
+      std::cerr << "Pool allocated queue order differs" << std::endl;
+      return(EXIT_FAILURE);
+      }
+    Q.pop();
+    R.pop();
+    C.pop();
+    }
+  if (!Q.empty() || !C.empty())
+    {
+    std::cerr << "Pool allocated queue not empty" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  const IFTArenaStatistics & stats = Q.GetArena().GetStatistics();
+  std::cout << "node allocations=" << stats.NumberOfAllocations
+	    << " deallocations=" << stats.NumberOfDeallocations
+	    << " slabs=" << stats.NumberOfSlabAllocations
+	    << " peak bytes=" << stats.PeakSize << std::endl;
+
+  // every node should have gone back to the arena, and the nodes are
+  // recycled rather than each one needing a slab
+  if (stats.NumberOfAllocations != stats.NumberOfDeallocations
+      || stats.NumberOfSlabAllocations == 0
+      || stats.NumberOfSlabAllocations >= stats.NumberOfAllocations)
+    {
+    std::cerr << "Unexpected arena statistics" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  // the default allocator doesn't touch the arena
+  if (R.GetArena().GetStatistics().NumberOfAllocations != 0)
+    {
+    std::cerr << "std::allocator queue used the arena" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  return(EXIT_SUCCESS);
+}
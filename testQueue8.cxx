@@ -0,0 +1,86 @@
+#include "itkHierarchicalQueue.h"
+#include <iostream>
+#include <cstdlib>
+
+typedef unsigned int IndexType;
+typedef double PriorityType;
+
+typedef itk::HierarchicalQueue<PriorityType, IndexType> ThisQueueType;
+
+int main(int, char * argv[])
+{
+
+  ThisQueueType Q;
+
+  // integer priorities go in the bucket array, the others in the
+  // sorted index. Levels must come out in priority order, each one
+  // in fifo order.
+  for (IndexType t = 0; t < 1000; t++)
+    {
+    // pretend t is an index too.
+    Q.Push(5, t);
+    }
+  Q.Push(2.5, 1000);
+  Q.Push(3, 1001);
+  Q.Push(-1, 1002);
+  Q.Push(1e9, 1003);
+  Q.Push(2.5, 1004);
+
+  const PriorityType expectedLevels[] = {-1, 2.5, 3, 5, 1e9};
+  const IndexType    expectedSizes[] = {1, 2, 1, 1000, 1};
+  IndexType expectedFront[] = {1002, 1000, 1001, 0, 1003};
+
+  for (unsigned l = 0; l < 5; l++)
+    {
+    if (Q.empty())
+      {
+      std::cerr << "Queue empty before level " << expectedLevels[l] << std::endl;
+      return(EXIT_FAILURE);
+      }
+    Q.NextLevel();
+    IndexType n = 0;
+    IndexType prev = 0;
+    while (!Q.CurrentEmpty())
+      {
+      IndexType v = Q.PopCurrent();
+      if ((n == 0 && v != expectedFront[l]) || (n > 0 && v <= prev))
+	{
+	std::cerr << "Wrong order at level " << expectedLevels[l] << std::endl;
+	return(EXIT_FAILURE);
+	}
+      prev = v;
+      ++n;
+      }
+    if (n != expectedSizes[l])
+      {
+      std::cerr << "Level " << expectedLevels[l] << " has " << n << " values" << std::endl;
+      return(EXIT_FAILURE);
+      }
+    }
+  if (!Q.empty())
+    {
+    std::cerr << "Queue not empty" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  // pushing to the level being processed starts a new level, while
+  // PushCurrent extends the current one
+  Q.Push(4, 1);
+  Q.NextLevel();
+  Q.Push(4, 2);
+  Q.PushCurrent(3);
+  if (Q.PopCurrent() != 1 || Q.PopCurrent() != 3 || !Q.CurrentEmpty())
+    {
+    std::cerr << "Current level wrong" << std::endl;
+    return(EXIT_FAILURE);
+    }
+  Q.NextLevel();
+  if (Q.PopCurrent() != 2 || !Q.empty())
+    {
+    std::cerr << "Repeated level wrong" << std::endl;
+    return(EXIT_FAILURE);
+    }
+
+  std::cout << "OK" << std::endl;
+  return(EXIT_SUCCESS);
+}
@@ -1,18 +1,19 @@
-// #define the macros in the files including this
+// #define the macros in the files including this. Cache is the
+// WorkerCache of a batch worker, or null
 
 switch (ComponentType)
   {
   case (itk::ImageIOBase::UCHAR):
-    doWatershed<unsigned char, WSMARKTYPE, WSDIM>(CmdLineObj);
+    doWatershed<unsigned char, WSMARKTYPE, WSDIM>(CmdLineObj, Cache);
     break;
   case (itk::ImageIOBase::USHORT):
-    doWatershed<unsigned short, WSMARKTYPE, WSDIM>(CmdLineObj);
+    doWatershed<unsigned short, WSMARKTYPE, WSDIM>(CmdLineObj, Cache);
     break;
   case (itk::ImageIOBase::SHORT):
-    doWatershed<short, WSMARKTYPE, WSDIM>(CmdLineObj);
+    doWatershed<short, WSMARKTYPE, WSDIM>(CmdLineObj, Cache);
     break;
   case (itk::ImageIOBase::FLOAT):
-    doWatershed<float, WSMARKTYPE, WSDIM>(CmdLineObj);
+    doWatershed<float, WSMARKTYPE, WSDIM>(CmdLineObj, Cache);
     break;
   default:
     std::cerr << "Unsupported pixel type" << std::endl;